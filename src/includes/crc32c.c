@@ -0,0 +1,193 @@
+/**
+ * CRC-32C (Castagnoli) checksums.
+ *
+ * The implementation is chosen once, on first use: the SSE4.2 crc32
+ * instruction if the CPU supports it, otherwise a slicing-by-8 table lookup
+ * which consumes 8 bytes per step.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+//==============================================================================
+// MACROS
+//==============================================================================
+
+/**
+ * CRC-32C polynomial, bit-reversed
+ */
+#define CRC32C_POLY   0x82F63B78U
+
+//==============================================================================
+// TYPES
+//==============================================================================
+
+/**
+ * Function which advances the (pre-inverted) CRC state over a buffer
+ */
+typedef uint32_t (*Crc32cImpl)(uint32_t crc, const unsigned char *data, size_t num_bytes);
+
+//==============================================================================
+// FORWARD DECLARATIONS
+//==============================================================================
+
+static void     _crc32c_init(void);
+static uint32_t _crc32c_sw(uint32_t crc, const unsigned char *data, size_t num_bytes);
+#if defined(__x86_64__)
+static uint32_t _crc32c_hw(uint32_t crc, const unsigned char *data, size_t num_bytes);
+#endif
+
+//==============================================================================
+// GLOBALS
+//==============================================================================
+
+static pthread_once_t _crc32c_once = PTHREAD_ONCE_INIT;
+static Crc32cImpl     _crc32c_impl = NULL;
+static uint32_t       _crc32c_table[8][256];
+
+//==============================================================================
+// PUBLIC FUNCTIONS
+//==============================================================================
+
+uint32_t
+crc32c(const void *data, size_t num_bytes) {
+  return crc32c_update(0, data, num_bytes);
+}
+
+uint32_t
+crc32c_update(uint32_t crc, const void *data, size_t num_bytes) {
+  pthread_once(&_crc32c_once, _crc32c_init);
+
+  return ~(_crc32c_impl(~crc, (const unsigned char *)data, num_bytes));
+}
+
+//==============================================================================
+// PRIVATE FUNCTIONS
+//==============================================================================
+
+/**
+ * Build the lookup tables and choose an implementation
+ *
+ * Table k holds the CRC of each byte value followed by k zero bytes, so that 8
+ * bytes can be folded into the CRC with 8 independent lookups.
+ */
+static void
+_crc32c_init(void) {
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+
+    for (int j = 0; j < 8; ++j) {
+      crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+    }
+
+    _crc32c_table[0][i] = crc;
+  }
+
+  for (uint32_t i = 0; i < 256; ++i) {
+    for (int k = 1; k < 8; ++k) {
+      uint32_t prev = _crc32c_table[k - 1][i];
+
+      _crc32c_table[k][i] = (prev >> 8) ^ _crc32c_table[0][prev & 0xFF];
+    }
+  }
+
+  _crc32c_impl = _crc32c_sw;
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    _crc32c_impl = _crc32c_hw;
+  }
+#endif
+}
+
+/**
+ * Slicing-by-8 software implementation
+ *
+ * @param crc         Inverted CRC of the preceding bytes
+ * @param data        Buffer to checksum
+ * @param num_bytes   Size of buffer in bytes
+ *
+ * @return  uint32_t  inverted CRC
+ */
+static uint32_t
+_crc32c_sw(uint32_t crc, const unsigned char *data, size_t num_bytes) {
+  while (num_bytes >= 8) {
+    uint32_t lo = crc ^ (
+        (uint32_t)data[0] |
+        ((uint32_t)data[1] << 8) |
+        ((uint32_t)data[2] << 16) |
+        ((uint32_t)data[3] << 24));
+    uint32_t hi = (
+        (uint32_t)data[4] |
+        ((uint32_t)data[5] << 8) |
+        ((uint32_t)data[6] << 16) |
+        ((uint32_t)data[7] << 24));
+
+    crc = _crc32c_table[7][lo & 0xFF] ^
+          _crc32c_table[6][(lo >> 8) & 0xFF] ^
+          _crc32c_table[5][(lo >> 16) & 0xFF] ^
+          _crc32c_table[4][lo >> 24] ^
+          _crc32c_table[3][hi & 0xFF] ^
+          _crc32c_table[2][(hi >> 8) & 0xFF] ^
+          _crc32c_table[1][(hi >> 16) & 0xFF] ^
+          _crc32c_table[0][hi >> 24];
+
+    data += 8;
+    num_bytes -= 8;
+  }
+
+  while (num_bytes--) {
+    crc = (crc >> 8) ^ _crc32c_table[0][(crc ^ *data++) & 0xFF];
+  }
+
+  return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * SSE4.2 implementation
+ *
+ * @param crc         Inverted CRC of the preceding bytes
+ * @param data        Buffer to checksum
+ * @param num_bytes   Size of buffer in bytes
+ *
+ * @return  uint32_t  inverted CRC
+ */
+__attribute__((target("sse4.2")))
+static uint32_t
+_crc32c_hw(uint32_t crc, const unsigned char *data, size_t num_bytes) {
+  uint64_t crc64;
+
+  // Align to 8 bytes
+  while (num_bytes && ((uintptr_t)data & 7)) {
+    crc = _mm_crc32_u8(crc, *data++);
+    --num_bytes;
+  }
+
+  crc64 = crc;
+  while (num_bytes >= 8) {
+    uint64_t word;
+
+    memcpy(&word, data, sizeof(uint64_t));
+    crc64 = _mm_crc32_u64(crc64, word);
+
+    data += 8;
+    num_bytes -= 8;
+  }
+  crc = (uint32_t)crc64;
+
+  while (num_bytes--) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+
+  return crc;
+}
+#endif
@@ -0,0 +1,35 @@
+/**
+ * CRC-32C (Castagnoli) checksums, using the SSE4.2 crc32 instruction when the
+ * CPU supports it and a slicing-by-8 table lookup otherwise.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compute the CRC-32C checksum of a buffer
+ *
+ * @param data        Buffer to checksum
+ * @param num_bytes   Size of buffer in bytes
+ *
+ * @return  uint32_t  checksum
+ */
+uint32_t
+crc32c(const void *data, size_t num_bytes);
+
+/**
+ * Extend a CRC-32C checksum with the contents of another buffer
+ *
+ * crc32c_update(crc32c(a, m), b, n) is the checksum of the m bytes of a
+ * followed by the n bytes of b. The checksum of an empty buffer is 0.
+ *
+ * @param crc         Checksum of the preceding bytes
+ * @param data        Buffer to checksum
+ * @param num_bytes   Size of buffer in bytes
+ *
+ * @return  uint32_t  checksum
+ */
+uint32_t
+crc32c_update(uint32_t crc, const void *data, size_t num_bytes);
@@ -8,8 +8,11 @@
  */
 #include <assert.h>
 #include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -20,7 +23,17 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(PMA_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
 #include "includes/checksum.h"
+#include "includes/crc32c.h"
 #include "malloc.h"
 
 //==============================================================================
@@ -107,6 +120,27 @@
  */
 #define INDEX_TO_PTR(foo)     (void *)((char *)_pma_state->metadata->arena_start + (foo * PMA_PAGE_SIZE))
 
+/**
+ * Page directory entries pack the status of a page into the low bits of its
+ * offset in the backing file, which is always page-aligned
+ */
+#define PMA_DIR_STATUS_MASK   0x7UL
+
+/**
+ * Build a page directory entry from an offset and a status
+ */
+#define DIR_ENTRY(offset, status) (((uint64_t)(offset)) | ((uint64_t)(status)))
+
+/**
+ * Get the offset of a page in the backing file from its page directory entry
+ */
+#define ENTRY_OFFSET(foo)     ((foo) & (~PMA_DIR_STATUS_MASK))
+
+/**
+ * Get the status of a page from its page directory entry
+ */
+#define ENTRY_STATUS(foo)     ((PageStatus)((foo) & PMA_DIR_STATUS_MASK))
+
 /**
  * Flags to use for all mmap operations, excluding initial metadata page mapping
  *
@@ -121,6 +155,18 @@
  */
 #define PMA_MMAP_FLAGS        (MAP_SHARED | MAP_FIXED_NOREPLACE)
 
+/**
+ * Flags to use for arena mmap operations inside the address range reserved for
+ * the arena. The reservation guarantees that nothing else is mapped there, so
+ * the new mapping replaces part of it. See _pma_reserve_arena.
+ */
+#define PMA_MMAP_RESERVED_FLAGS (MAP_SHARED | MAP_FIXED)
+
+/**
+ * Flags for the anonymous mapping which reserves address space for the arena
+ */
+#define PMA_RESERVE_FLAGS     (MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE)
+
 /**
  * Magic code that identifies a file as an event snapshot file
  */
@@ -130,7 +176,15 @@
  * Version of the persistent memory arena which created an event snapshot (in
  * case of breaking changes)
  */
-#define PMA_DATA_VERSION      1
+#define PMA_DATA_VERSION      3
+
+/**
+ * Metadata flags which persist across loads
+ *
+ * PMA_FLAG_PAGE_SUMS: record a checksum for each dpage written by a sync. See
+ *                     _pma_write_page_sums.
+ */
+#define PMA_FLAG_PAGE_SUMS    0x01
 
 /**
  * Representation of an empty byte for a byte in a bitmap (1 = empty, 0 = full)
@@ -143,12 +197,74 @@
 #define PMA_BITMAP_SIZE       32
 
 /**
- * Max number of dpage offsets that can fit into a cache of free dpages stored
- * as an array in a single page (when factoring in space used by metadata).
+ * Number of 64-bit words in the bitmap of a SharedPageHeader. The slot search
+ * operates on whole words rather than individual bytes.
+ */
+#define PMA_BITMAP_WORDS      (PMA_BITMAP_SIZE / sizeof(uint64_t))
+
+/**
+ * Number of bins of the free page run index (one per power of two of the run
+ * length), and number of levels of the skip list of each bin. With one in
+ * four nodes promoted per level, 8 levels keep searches logarithmic up to
+ * tens of thousands of runs per bin. See PageRunIndex.
+ */
+#define PMA_RUN_BINS          64
+#define PMA_RUN_LEVELS        8
+
+/**
+ * Initial state of the generators of skip list levels of the free page run
+ * index (the golden ratio, as a 64-bit fraction)
+ */
+#define PMA_RUN_SEED          0x9E3779B97F4A7C15ULL
+
+/**
+ * Size of the blocks from which the nodes of the volatile caches are carved;
+ * see NodePool. Large enough that loading a big arena takes a few thousand
+ * blocks rather than millions of heap allocations.
+ */
+#define PMA_NODE_POOL_BLOCK_SIZE  65536
+
+/**
+ * Number of non-full shared pages which each bucket keeps, even if they're
+ * empty. Empty shared pages beyond this are released to the free page cache on
+ * sync. Keeping a spare page prevents a bucket that repeatedly fills and
+ * empties a single page from churning through the free page cache.
+ */
+#define PMA_SHARED_SPARE_PAGES  1
+
+/**
+ * Max number of pages in the partial shared page cache of a bucket that are
+ * examined when choosing a page in which to allocate. See
+ * _pma_select_partial_page.
+ */
+#define PMA_AFFINITY_SCAN_LIMIT 16
+
+/**
+ * Number of slots in a shared page with slot size 2^foo
+ */
+#define PMA_SHARED_SLOTS(foo) ((PMA_PAGE_SIZE - sizeof(SharedPageHeader)) >> (foo))
+
+/**
+ * Max number of dpage runs that can fit into a cache of free dpages stored as an
+ * array in a single page (when factoring in space used by metadata).
  *
- * 511 for 4 KiB page
+ * 255 for 4 KiB page
+ */
+#define PMA_DPAGE_CACHE_SIZE  ((PMA_PAGE_SIZE - sizeof(DPageCache)) / sizeof(DPageRun))
+
+/**
+ * Max number of dpage offsets in the free dpage cache written by
+ * PMA_DATA_VERSION 2 and earlier
  */
-#define PMA_DPAGE_CACHE_SIZE  ((PMA_PAGE_SIZE - sizeof(DPageCache)) / sizeof(uint64_t))
+#define PMA_DPAGE_CACHE_SIZE_V2 ((PMA_PAGE_SIZE - sizeof(DPageCacheV2)) / sizeof(uint64_t))
+
+/**
+ * Number of runs of reusable dpages in the dpage cache above which new pages at
+ * the end of the arena are taken from the cache, even if a dpage at the end of
+ * the snapshot file would continue the mapping of the previous page. Keeps the
+ * cache from filling up while the arena grows.
+ */
+#define PMA_LINEAR_CACHE_LIMIT  (PMA_DPAGE_CACHE_SIZE / 4)
 
 /**
  * Max number of dirty page entries that can be stored in the extra space of the
@@ -156,10 +272,49 @@
  * the metadata allows us to solve the problem of desynchronization between the
  * metadata and page directory without using B+ Trees.
  *
- * 164 for 4 KiB page
+ * Dirty page entries beyond this limit are written to the overflow journal on
+ * sync. See _pma_write_journal.
+ *
+ * 163 for 4 KiB page
  */
 #define PMA_DIRTY_PAGE_LIMIT  ((PMA_PAGE_SIZE - sizeof(Metadata)) / sizeof(DirtyPageEntry))
 
+/**
+ * Maximum number of page directory entries written to disk at once when syncing
+ * dirty pages. See _pma_sync_dirty_pages.
+ *
+ * 4 KiB (one page) of 8 byte directory entries
+ */
+#define PMA_DIR_BATCH_SIZE    512
+
+/**
+ * Maximum number of threads which scan the page directory in pma_load, and
+ * minimum number of directory entries scanned by each of them. See
+ * _pma_load_pages.
+ *
+ * 65536 entries = 256 MiB of arena for 4 KiB pages
+ */
+#define PMA_LOAD_MAX_THREADS  16
+#define PMA_LOAD_CHUNK_SIZE   65536
+
+/**
+ * Number of submission queue entries in the io_uring used to commit syncs. See
+ * _pma_uring_commit.
+ */
+#define PMA_URING_ENTRIES     256
+
+/**
+ * Max size in bytes of a single write submitted to the io_uring (the length of
+ * a submission queue entry is 32 bits). Larger writes are split.
+ */
+#define PMA_URING_MAX_WRITE   1073741824
+
+/**
+ * Number of most recent dirty page entries searched for an entry for the same
+ * page(s) when marking pages dirty. See _pma_mark_page_dirty.
+ */
+#define PMA_DIRTY_FOLD_WINDOW 16
+
 /**
  * Default settings for new PMA backing files
  *
@@ -169,27 +324,38 @@
  * Start with a page directory big enough to hold 1 GiB of data:
  *
  *    1 GiB = 262144 page entries
- *    (up to) 16 bytes per page dir entry
- *    4096 / 16 = 256 entries per page
- *    262144 / 256 = 1024 pages
- *    1024 * 4096 = 4194304 bytes
+ *    8 bytes per page dir entry
+ *    4096 / 8 = 512 entries per page
+ *    262144 / 512 = 512 pages
+ *    512 * 4096 = 2097152 bytes
  *
- * Maximum size of page directory = 340 GiB
+ * Maximum size of page directory = 170 GiB
  */
 #define PMA_SNAPSHOT_FILENAME "snap.bin"
 #define PMA_PAGE_DIR_FILENAME "page.bin"
+#define PMA_PAGE_DIR_TMP_FILENAME "page.tmp"
+#define PMA_JOURNAL_FILENAME  "jrnl.bin"
+#define PMA_PAGE_SUMS_FILENAME  "sums.bin"
+#define PMA_EXTENTS_FILENAME  "extn.bin"
 #define PMA_DEFAULT_DIR_NAME  ".bin"
 #define PMA_FILE_FLAGS        (O_RDWR | O_CREAT)
 #define PMA_DIR_PERMISSIONS   (S_IRWXU | S_IRWXG | S_IRWXO)
 #define PMA_FILE_PERMISSIONS  (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
 #define PMA_INIT_SNAP_SIZE    1073741824
-#define PMA_INIT_DIR_SIZE     4194304
+#define PMA_INIT_DIR_SIZE     2097152
+
+/**
+ * Share of the page directory entries which should be left unused by the arena
+ * after a sync, as a right shift of the directory size (i.e. 1/4). If fewer are
+ * left, the directory file is doubled. See _pma_reserve_page_dir.
+ */
+#define PMA_DIR_HEADROOM_SHIFT  2
 
 /**
  * Maximum possible size of the page directory. This is how big the page
  * directory would need to be to reach all addressable virtual memory in Linux.
  */
-#define PMA_MAXIMUM_DIR_SIZE  365072220160
+#define PMA_MAXIMUM_DIR_SIZE  182536110080
 
 /**
  * Base address for the PMA. Lowest address not reserved by Linux.
@@ -197,9 +363,16 @@
 #define PMA_SNAPSHOT_ADDR     0x10000
 
 /**
- * Increment block size for resizing the snapshot backing file (4 GiB in bytes).
- * This is just the default increment; the backing file is extended by the
- * smallest multiple of this value sufficient to fit the new allocation.
+ * Default amount of address space reserved for the arena by pma_init and
+ * pma_load (16 TiB). The reservation is inaccessible and uses no memory until
+ * pages of the arena are mapped into it. See pma_set_arena_reserve.
+ */
+#define PMA_ARENA_RESERVE_SIZE  17592186044416
+
+/**
+ * Default increment for resizing the snapshot backing file (4 GiB in bytes).
+ * The backing file is extended by the smallest multiple of the increment
+ * sufficient to fit the new allocation. See PMAGrowthPolicy.
  */
 #define PMA_SNAP_RESIZE_INC   4294967296
 
@@ -227,6 +400,22 @@
  */
 #define WARNING(foo)  _pma_warning(foo, address, __LINE__)
 
+/**
+ * Count trailing zero bits of a non-zero 64-bit word
+ */
+#if defined(__GNUC__)
+#define PMA_CTZ64(foo)  ((uint8_t)__builtin_ctzll(foo))
+#else
+#define PMA_CTZ64(foo)  _pma_ctz64(foo)
+#endif
+
+/**
+ * Next node of a free page run in its bin, and in address order, at a skip list
+ * level below the number of levels of the node
+ */
+#define RUN_NEXT(foo, level)      ((foo)->links[2 * (level)])
+#define RUN_NEXT_PAGE(foo, level) ((foo)->links[(2 * (level)) + 1])
+
 //==============================================================================
 // TYPES
 //==============================================================================
@@ -243,12 +432,28 @@ typedef enum _pma_page_status_t {
 } PageStatus;
 
 /**
- * Directory entry for a page in virtual memory
+ * Algorithms used for the checksums in a metadata page. Snapshots written before
+ * the algorithm was recorded have PMA_CHECKSUM_CRC32.
+ */
+typedef enum _pma_checksum_type_t {
+  PMA_CHECKSUM_CRC32  = 0,  // CRC-32 (src/includes/checksum.c)
+  PMA_CHECKSUM_CRC32C = 1,  // CRC-32C (src/includes/crc32c.c); used for all new checksums
+} ChecksumType;
+
+/**
+ * Directory entry for a page in virtual memory: offset for page in backing file,
+ * with the status of the page in the low bits. See DIR_ENTRY.
  */
-typedef struct _pma_page_dir_entry_t {
+typedef uint64_t PageDirEntry;
+
+/**
+ * Directory entry for a page in virtual memory, as written by PMA_DATA_VERSION
+ * 1. Only read when migrating the page directory; see _pma_migrate_page_dir.
+ */
+typedef struct _pma_page_dir_entry_v1_t {
   uint64_t    offset; // Offset for page in backing file
   PageStatus  status; // Status of page
-} PageDirEntry;
+} PageDirEntryV1;
 
 /**
  * Directory of pages in virtual memory
@@ -309,67 +514,187 @@ typedef struct _pma_dirty_page_entry_t {
 } DirtyPageEntry;
 
 /**
- * Free page cache node
- *
- * Nodes form a linked list of single free pages. A free page is an allocated
- * pages already backed by disk, but available for use (their old values were
- * freed).
+ * Partial shared page cache node
  *
- * Free pages are purposely not merged into runs, because two pages being
- * adjacent in virtual memory does not mean that they are adjacent on disk, and
- * disk locality is preferable for multi-page allocations.
+ * Nodes form a linked list of shared pages which have at least one free slot.
+ * There is one such list per bucket. The lists are volatile: they are derived
+ * from the shared page headers, and rebuilt when the page directory is scanned
+ * by pma_load.
  *
- * The caches for free single pages and free multi-page runs are split to save
- * time: any free page will do for a shared page or single page allocation, but
- * exact ranges are preferable for multi-page allocations.
+ * Full pages are removed from the list as soon as their last slot is allocated,
+ * and pushed back onto it as soon as one of their slots is freed. This way,
+ * finding a shared page with free slots is O(1), regardless of how many full
+ * shared pages exist.
  */
-typedef struct _pma_single_page_cache_t {
-  struct _pma_single_page_cache_t  *next; // Next node in list
-  void                             *page; // Pointer to free page
-} SinglePageCache;
+typedef struct _pma_partial_page_cache_t {
+  struct _pma_partial_page_cache_t *next; // Next node in list
+  SharedPageHeader                 *page; // Pointer to shared page with free slots
+} PartialPageCache;
 
 /**
  * Free page run cache node
  *
- * Nodes form a linked list of free multi-page runs. A free page is an allocated
- * pages already backed by disk, but available for use (their old values were
- * freed).
+ * Nodes form an index of free page runs; see PageRunIndex. A free page is an
+ * allocated page already backed by disk, but available for use (its old value
+ * was freed). A single free page is a run of length one.
  *
- * Free pages are purposely not merged into runs, because two pages being
- * adjacent in virtual memory does not mean that they are adjacent on disk, and
- * disk locality is preferable for multi-page allocations.
+ * Two pages being adjacent in virtual memory does not mean that they are
+ * adjacent on disk, and disk locality is preferable for multi-page allocations.
+ * Free pages are therefore only merged into a run if they're adjacent both in
+ * memory and on disk.
  *
- * The caches for free single pages and free multi-page runs are split to save
- * time: any free page will do for a shared page or single page allocation, but
- * exact ranges are preferable for multi-page allocations.
+ * Nodes only have links for their own skip list levels, so most nodes are
+ * small; nodes of each height come from a separate pool. Use RUN_NEXT and
+ * RUN_NEXT_PAGE to follow the links.
  */
 typedef struct _pma_page_run_cache_t {
-  struct _pma_page_run_cache_t *next;   // Next node in list
-  void                         *page;   // Pointer to start of page run
-  uint64_t                      length; // Number of pages in run
+  void                         *page;       // Pointer to start of page run
+  uint64_t                      length;     // Number of pages in run
+  uint8_t                       num_levels; // Number of skip list levels of node
+  struct _pma_page_run_cache_t *links[];    // Next node in bin and next node by address, for each level of the node
 } PageRunCache;
 
 /**
- * Free dpage run node
+ * Index of free page runs
+ *
+ * Runs are segregated into bins by the power of two of their length. Each bin
+ * is a skip list ordered by length, then by address, so the smallest run which
+ * fits an allocation (best fit) is found in O(log n) time: it's either the
+ * first run in the bin of the allocation which is long enough, or the first run
+ * of the next non-empty bin. Single free pages are bin 0.
+ *
+ * All runs are also linked into one skip list ordered by address, so that
+ * freed pages can be merged with the runs on either side of them; see
+ * _pma_coalesce_page_run.
+ */
+typedef struct _pma_page_run_index_t {
+  PageRunCache *bins[PMA_RUN_BINS][PMA_RUN_LEVELS]; // Skip list heads of each bin
+  PageRunCache *pages[PMA_RUN_LEVELS];              // Skip list heads by address
+  uint64_t      nonempty;                           // Bitmap of bins which contain runs
+  uint64_t      seed;                               // State of generator for skip list levels
+} PageRunIndex;
+
+/**
+ * Header of a block of nodes in a NodePool; nodes follow it
+ */
+typedef struct _pma_node_block_t {
+  struct _pma_node_block_t *next;     // Next block of pool
+} NodeBlock;
+
+/**
+ * Unused node of a NodePool
+ */
+typedef struct _pma_free_node_t {
+  struct _pma_free_node_t  *next;     // Next unused node
+} FreeNode;
+
+/**
+ * Pool of fixed-size nodes for the volatile caches and indexes
+ *
+ * Nodes are carved in order out of blocks of PMA_NODE_POOL_BLOCK_SIZE bytes.
+ * Freed nodes are kept on an intrusive list and handed out again before any new
+ * node is carved. Blocks are never returned to libc individually: they're all
+ * released at once when the PMA is closed.
+ *
+ * Pools aren't thread safe; threads which build caches in parallel use their
+ * own pools, which are merged afterwards.
+ */
+typedef struct _pma_node_pool_t {
+  size_t            node_size;        // Size of each node in bytes
+  FreeNode         *free;             // Nodes which were freed, available for reuse
+  NodeBlock        *blocks;           // All blocks of pool
+  char             *fresh;            // Next node never handed out in the newest block
+  char             *fresh_end;        // End of newest block
+} NodePool;
+
+/**
+ * Kinds of extent in the extent table
+ */
+typedef enum _pma_extent_type_t {
+  PMA_EXTENT_MAPPED,        // Pages which are adjacent both in the arena and on disk
+  PMA_EXTENT_FREE_PAGE,     // Node of the free page run cache with a single page
+  PMA_EXTENT_FREE_RUN,      // Node of the free page run cache with multiple pages
+  PMA_EXTENT_PARTIAL_PAGE,  // Node of a partial shared page cache
+} ExtentType;
+
+/**
+ * Entry of the extent table
+ *
+ * The extent table is a compact summary of the page directory and the free page
+ * caches, written by pma_close so that pma_load doesn't have to scan the whole
+ * page directory. See _pma_write_extents.
+ */
+typedef struct _pma_extent_t {
+  uint64_t    index;      // Index in page directory of first page
+  uint64_t    num_pages;  // Number of pages
+  uint64_t    offset;     // Offset on disk of first page (PMA_EXTENT_MAPPED only)
+  uint32_t    type;       // ExtentType
+  uint32_t    bucket;     // Bucket of shared page (PMA_EXTENT_PARTIAL_PAGE only)
+} Extent;
+
+/**
+ * Header of the extent table
+ */
+typedef struct _pma_extent_header_t {
+  uint64_t    magic_code;   // PMA_MAGIC_CODE
+  uint32_t    checksum;     // CRC-32C of header (with checksum as 0) and extents
+  uint32_t    version;      // PMA_DATA_VERSION
+  uint64_t    epoch;        // Epoch of the snapshot which the table describes
+  uint64_t    event;        // Event of the snapshot which the table describes
+  uint64_t    num_extents;  // Number of extents following the header
+} ExtentHeader;
+
+/**
+ * Run of free dpages which are contiguous in the backing file
  *
  * A dpage is a page-sized block already allocated to the snapshot file on disk
  * but without memory mapped to it. Reusing free dpages allows allocations
  * without growing the backing file.
  *
- * It's possible to simplify this cache by turning it into a stack of individual
- * free dpages. However, since multi-page allocations will *never* move,
- * allocating them in a single block not only simplifies the malloc algorithm,
- * but also allows us to take advantage of locality caching: typically, when the
- * OS experiences a page miss, the OS/hardware will fetch not just the missing
- * page, but also several of the following (nearby?) pages.
+ * Since multi-page allocations will *never* move, allocating them in a single
+ * block not only simplifies the malloc algorithm, but also allows us to take
+ * advantage of locality caching: typically, when the OS experiences a page
+ * miss, the OS/hardware will fetch not just the missing page, but also several
+ * of the following (nearby?) pages. Keeping free dpages as runs lets
+ * multi-page allocations reuse them.
+ */
+typedef struct _pma_dpage_run_t {
+  uint64_t  offset;   // Offset of first dpage in backing file
+  uint64_t  length;   // Number of dpages in run
+} DPageRun;
+
+/**
+ * Cache of free dpages
+ *
+ * The runs of the cache are stored in three consecutive groups:
+ *  - Reusable runs, sorted by offset, with adjacent runs merged
+ *  - Held runs, freed before the most recent sync, which can't be reused until
+ *    that sync is durable
+ *  - Freed runs, freed since the most recent sync
+ *
+ * Held and freed runs are merged into the reusable runs on sync; see
+ * _pma_settle_dpage_cache.
  */
 typedef struct _pma_free_dpage_cache_t {
+  uint8_t   dirty;      // Has dpage cache already been copied to a new page with PROT_WRITE
+  uint16_t  size;       // Number of reusable runs
+  uint16_t  num_held;   // Number of held runs, following the reusable runs
+  uint16_t  num_freed;  // Number of freed runs, following the held runs
+  DPageRun  runs[];     // Runs of free dpages; array of size PMA_DPAGE_CACHE_SIZE
+} DPageCache;
+
+/**
+ * Cache of free dpages as written by PMA_DATA_VERSION 2 and earlier: a queue
+ * of single dpages. Only read when migrating the dpage cache; see
+ * _pma_migrate_dpage_cache.
+ */
+typedef struct _pma_free_dpage_cache_v2_t {
   uint8_t   dirty;    // Has dpage cache already been copied to a new page with PROT_WRITE
-  uint16_t  size;     // Number of entries in queue
+  uint16_t  size;     // Number of reusable entries in queue
   uint16_t  head;     // Index of front of queue
   uint16_t  tail;     // Index of back of queue
-  uint64_t  queue[];  // Cache of free dpages as queue; array of size PMA_DPAGE_CACHE_SIZE
-} DPageCache;
+  uint64_t  queue[];  // Cache of free dpages as queue; array of size PMA_DPAGE_CACHE_SIZE_V2
+} DPageCacheV2;
 
 /**
  * Persistent Memory Arena/event snapshot metadata
@@ -377,19 +702,127 @@ typedef struct _pma_free_dpage_cache_t {
 typedef struct _pma_metadata_t {
   uint64_t          magic_code;       // Stamp identifying a file as a New Mars PMA file
   uint32_t          checksum;         // Checksum value to detect corruption
-  uint32_t          version;          // Version of Vere (New Mars?) used to produce the backing file
+  uint16_t          version;          // Version of Vere (New Mars?) used to produce the backing file
+  uint16_t          checksum_type;    // ChecksumType of checksum and journal_checksum
   uint64_t          epoch;            // Epoch ID of the most recently processed event
   uint64_t          event;            // ID of the most recently processed event
   void             *arena_start;      // Beginning of mapped address space
   void             *arena_end;        // End of mapped address space (first address beyond mapped range)
   SharedPageHeader *shared_pages[PMA_MAX_SHARED_SHIFT]; // Shared allocation pages
-  DPageCache       *dpage_cache;      // Cache of free dpges as queue
+  DPageCache       *dpage_cache;      // Cache of free dpages as runs
   uint64_t          snapshot_size;    // Size of the backing file
   uint64_t          next_offset;      // Next open dpage in the backing file
+  uint64_t          journal_offset;   // Offset in the journal file of the overflow dirty page entries
+  uint64_t          journal_entries;  // Number of overflow dirty page entries in the journal file
+  uint32_t          journal_checksum; // Checksum of the overflow dirty page entries
   uint8_t           num_dirty_pages;  // Counter of dirty page entries
+  uint8_t           flags;            // PMA_FLAG_* options
   DirtyPageEntry    dirty_pages[];    // Queue of changes not yet synced to page directory
 } Metadata;
 
+/**
+ * Persistent Memory Arena/event snapshot metadata as written by
+ * PMA_DATA_VERSION 1, before the overflow journal, checksum type, and flags
+ * were added. Only read when migrating the metadata; see _pma_migrate_metadata.
+ */
+typedef struct _pma_metadata_v1_t {
+  uint64_t          magic_code;       // Stamp identifying a file as a New Mars PMA file
+  uint32_t          checksum;         // CRC-32 checksum value to detect corruption
+  uint32_t          version;          // Version of Vere (New Mars?) used to produce the backing file
+  uint64_t          epoch;            // Epoch ID of the most recently processed event
+  uint64_t          event;            // ID of the most recently processed event
+  void             *arena_start;      // Beginning of mapped address space
+  void             *arena_end;        // End of mapped address space (first address beyond mapped range)
+  SharedPageHeader *shared_pages[PMA_MAX_SHARED_SHIFT]; // Shared allocation pages
+  DPageCacheV2     *dpage_cache;      // Cache of free dpages as queue
+  uint64_t          snapshot_size;    // Size of the backing file
+  uint64_t          next_offset;      // Next open dpage in the backing file
+  uint8_t           num_dirty_pages;  // Counter of dirty page entries
+  DirtyPageEntry    dirty_pages[];    // Queue of changes not yet synced to page directory
+} MetadataV1;
+
+#if defined(PMA_IO_URING)
+/**
+ * io_uring used to commit syncs, set up using the raw system call interface
+ */
+typedef struct _pma_uring_t {
+  int                   fd;           // io_uring file descriptor (-1 if io_uring isn't available)
+  unsigned             *sq_head;      // Submission queue head (advanced by kernel)
+  unsigned             *sq_tail;      // Submission queue tail (advanced by PMA)
+  unsigned             *sq_mask;      // Submission queue index mask
+  unsigned             *sq_array;     // Submission queue; indices into sqes
+  unsigned             *cq_head;      // Completion queue head (advanced by PMA)
+  unsigned             *cq_tail;      // Completion queue tail (advanced by kernel)
+  unsigned             *cq_mask;      // Completion queue index mask
+  struct io_uring_sqe  *sqes;         // Submission queue entries
+  struct io_uring_cqe  *cqes;         // Completion queue entries
+  void                 *sq_ring;      // Mapping of submission queue ring
+  void                 *cq_ring;      // Mapping of completion queue ring (may be same as sq_ring)
+  size_t                sq_ring_bytes;  // Size of submission queue ring mapping
+  size_t                cq_ring_bytes;  // Size of completion queue ring mapping
+  unsigned              num_entries;  // Size of submission queue
+  unsigned              num_pending;  // Entries submitted but not yet completed
+} URing;
+#endif
+
+/**
+ * Sync which has been frozen by pma_sync_async and is being committed to disk
+ * by the writer thread
+ */
+typedef struct _pma_commit_t {
+  Metadata         *metadata;         // Copy of metadata at the time of the freeze; written to disk once the dirty pages are durable
+  uint64_t          meta_page_offset; // Offset on disk of metadata page to replace
+  DirtyPageEntry   *journal_pages;    // Overflow dirty page entries at the time of the freeze
+  uint64_t          num_journal_pages;  // Counter of overflow dirty page entries
+  PageDirEntry     *entries;          // Directory entries of the pages changed by the sync, by run; see _pma_build_page_entries
+  uint64_t         *run_indices;      // Index in page directory of the first page of each run
+  uint64_t         *run_lengths;      // Number of pages in each run
+  uint64_t         *run_starts;       // Position in entries of the first page of each run
+  uint64_t          num_runs;         // Number of runs of changed pages
+  uint64_t          ticket;           // Ticket returned by pma_sync_async
+  PMADurability     durability;       // Durability level at the time of the freeze
+  int               flush_page_dir;   // Page directory must be flushed before the metadata is written
+  int               done;             // Set by writer thread when finished (protected by commit_lock)
+  int               err;              // Error code if the commit failed, otherwise 0
+} Commit;
+
+/**
+ * Chunk of the page directory scanned by one thread of pma_load
+ *
+ * A run of pages belongs to the chunk in which it starts, even if it extends
+ * into the next chunk. The free page caches are built in address order, and the
+ * partial shared page caches in reverse address order, so that the caches of
+ * consecutive chunks can simply be concatenated.
+ */
+typedef struct _pma_load_chunk_t {
+  uint64_t          start;            // Index of first entry
+  uint64_t          end;              // Index beyond last entry at which a run can start
+  uint64_t          map_index;        // Index of first page of pending mapping
+  uint64_t          map_pages;        // Number of pages in pending mapping
+  uint64_t          map_offset;       // Offset on disk of pending mapping
+  PageRunCache     *free_page_runs;   // Free page runs, as a list linked by their first level
+  PageRunCache    **free_page_runs_end; // Next pointer of last free page run
+  NodePool          page_run_pools[PMA_RUN_LEVELS]; // Pools of free page run nodes of chunk, by height
+  uint64_t          seed;             // State of generator for skip list levels of chunk
+  PartialPageCache *shared_pages;     // Shared pages of chunk, in reverse address order, until they're mapped
+  PartialPageCache *partial_pages[PMA_MAX_SHARED_SHIFT];  // Shared pages with free slots, by bucket
+  PartialPageCache **partial_pages_end[PMA_MAX_SHARED_SHIFT]; // Next pointer of last shared page of each bucket
+  NodePool          partial_page_pool;  // Pool of shared page nodes of chunk
+  int               err;              // Error code if the scan failed, otherwise 0
+} LoadChunk;
+
+/**
+ * Range of page directory entries verified by one thread of pma_scrub
+ */
+typedef struct _pma_scrub_range_t {
+  uint64_t          start;            // Index of first entry
+  uint64_t          end;              // Index beyond last entry
+  uint32_t         *sums;             // Mapped dpage checksum file
+  uint64_t          num_sums;         // Number of dpages in checksum file
+  uint64_t          num_bad;          // Number of pages which failed verification
+  int               err;              // Error code if verification couldn't be completed, otherwise 0
+} ScrubRange;
+
 /**
  * Struct containing global data used by PMA
  *
@@ -404,8 +837,45 @@ typedef struct _pma_global_state_t {
   PageDir           page_directory;   // Page directory; maps virtual memory addresses to pages on disk
   int               snapshot_fd;      // File descriptor for PMA backing file
   int               page_dir_fd;      // File descriptor for page directory
-  SinglePageCache  *free_pages;       // Cache of free single pages
-  PageRunCache     *free_page_runs;   // Cache of free multi-page runs
+  int               journal_fd;       // File descriptor for overflow journal
+  int               page_sums_fd;     // File descriptor for dpage checksums
+  int               extents_fd;       // File descriptor for extent table
+  DirtyPageEntry   *journal_pages;    // Dirty page entries that didn't fit in the metadata page
+  uint64_t          num_journal_pages;  // Counter of overflow dirty page entries
+  uint64_t          journal_capacity; // Number of entries which fit in journal_pages
+  uint64_t          older_journal_offset;   // Offset in the journal file of the overflow dirty page entries of the older metadata page
+  uint64_t          older_journal_entries;  // Number of overflow dirty page entries of the older metadata page
+  int               held_unflushed;   // Metadata of the sync which held the held dpages may not be on disk yet
+  int               dir_unflushed;    // Page directory has been written since it was last flushed
+  PageRunIndex     free_page_runs;   // Cache of free pages and page runs
+  PartialPageCache *partial_pages[PMA_MAX_SHARED_SHIFT];  // Caches of shared pages with free slots, by bucket
+  PartialPageCache *empty_pages;      // Shared pages emptied since last sync; candidates for release
+  NodePool          page_run_pools[PMA_RUN_LEVELS]; // Pools of PageRunCache nodes, by height
+  NodePool          partial_page_pool;  // Pool of PartialPageCache nodes
+  PMAStats          stats;            // Counters exposed through pma_get_stats
+  PMACommitMode     commit_mode;      // How pma_sync makes dirty pages durable
+  PMADurability     durability;       // How much of a sync is flushed before it completes
+  uint64_t          end_offset;       // Offset on disk which would continue the mapping of the last page of the arena
+  uint64_t          arena_reserve;    // Bytes of address space reserved for the arena, starting at arena_start
+  Commit           *commit;           // Sync being committed by the writer thread (NULL if none)
+  pthread_t         writer;           // Writer thread for asynchronous syncs
+  pthread_mutex_t   commit_lock;      // Protects commit and writer_stop
+  pthread_cond_t    commit_cond;      // Signals new commits, finished commits, and writer shutdown
+  int               writer_running;   // Has the writer thread been started
+  int               writer_stop;      // Tells the writer thread to exit
+  uint64_t          last_ticket;      // Ticket of most recent asynchronous sync
+  uint64_t          failed_ticket;    // Ticket of most recent failed asynchronous sync
+  int               failed_errno;     // Error code of most recent failed asynchronous sync
+  PMAGrowthPolicy   growth_policy;    // How the snapshot file grows
+  pthread_t         grower;           // Thread which preallocates space for the next snapshot file extension
+  pthread_mutex_t   grow_lock;        // Protects grow_target and grower_stop
+  pthread_cond_t    grow_cond;        // Signals new preallocation targets and grower shutdown
+  int               grower_running;   // Has the grower thread been started
+  int               grower_stop;      // Tells the grower thread to exit
+  uint64_t          grow_target;      // Size of snapshot file up to which the grower should preallocate space
+#if defined(PMA_IO_URING)
+  URing             uring;            // io_uring used to commit syncs
+#endif
 } State;
 
 //==============================================================================
@@ -413,28 +883,116 @@ typedef struct _pma_global_state_t {
 //==============================================================================
 
 int       _pma_verify_checksum(Metadata *meta_page);
-int       _pma_sync_dirty_pages(int fd, uint8_t num_dirty_pages, DirtyPageEntry *dirty_pages);
-int       _pma_write_page_status(int fd, uint64_t index, PageStatus status);
-int       _pma_write_page_offset(int fd, uint64_t index, uint64_t offset);
-int       _pma_update_free_pages(uint8_t num_dirty_pages, DirtyPageEntry *dirty_pages);
-void     *_pma_malloc_bytes(size_t size);
+uint32_t  _pma_checksum(uint16_t checksum_type, const void *data, size_t num_bytes);
+uint32_t  _pma_checksum_metadata(const Metadata *metadata);
+int       _pma_sync_dirty_pages(int fd, uint64_t num_dirty_pages, DirtyPageEntry *dirty_pages);
+int       _pma_msync_dirty_pages(int flags);
+int       _pma_compare_dirty_pages(const void *a, const void *b);
+int       _pma_commit_sync(void);
+int       _pma_write_journal(Metadata *metadata, uint64_t num_journal_pages, DirtyPageEntry *journal_pages);
+uint64_t  _pma_get_journal_offset(Metadata *metadata, uint64_t num_entries);
+int       _pma_replay_journal(int journal_fd, int page_dir_fd);
+void      _pma_migrate_metadata(const MetadataV1 *old_metadata, Metadata *metadata);
+int       _pma_migrate_page_dir(int *page_dir_fd, const char *dir_path);
+int       _pma_load_pages(void);
+void     *_pma_load_chunk(void *arg);
+int       _pma_load_map_pages(LoadChunk *chunk, uint64_t index, uint64_t num_pages, uint64_t offset);
+int       _pma_load_continues_run(uint64_t index);
+int       _pma_write_extents(void);
+int       _pma_append_extent(Extent **extents, uint64_t *num_extents, uint64_t *capacity, Extent *extent);
+int       _pma_read_extents(Extent **extents, uint64_t *num_extents);
+int       _pma_load_extents(Extent *extents, uint64_t num_extents);
+int       _pma_write_page_entries(int fd, uint64_t index, uint64_t num_entries, PageDirEntry *entries);
+int       _pma_write_page_sums(uint64_t num_dirty_pages, DirtyPageEntry *dirty_pages);
+int       _pma_write_page_sums_run(uint64_t dpage, uint64_t num_sums, uint32_t *sums);
+void     *_pma_scrub_range(void *arg);
+int       _pma_update_free_pages(uint64_t num_dirty_pages, DirtyPageEntry *dirty_pages);
+PageRunCache *_pma_alloc_page_run(NodePool *pools, uint64_t *seed);
+void      _pma_free_page_run(NodePool *pools, PageRunCache *page_run);
+void      _pma_init_page_run_pools(NodePool *pools);
+void      _pma_release_page_run_pools(NodePool *pools);
+int       _pma_push_page_run(void *page, uint64_t length);
+int       _pma_coalesce_page_run(void *page, uint64_t length);
+void      _pma_link_page_run(PageRunCache *page_run);
+void      _pma_unlink_page_run(PageRunCache *page_run);
+void      _pma_insert_page_run(PageRunCache *page_run);
+void      _pma_remove_page_run(PageRunCache *page_run);
+PageRunCache *_pma_find_page_run(uint64_t num_pages);
+void      _pma_find_page_run_links(uint8_t bin, uint64_t length, void *page, PageRunCache ***links);
+PageRunCache *_pma_find_page_run_address_links(void *page, PageRunCache ***links);
+uint8_t   _pma_get_page_run_bin(uint64_t length);
+void      _pma_init_node_pool(NodePool *pool, size_t node_size);
+void     *_pma_alloc_node(NodePool *pool);
+void      _pma_free_node(NodePool *pool, void *node);
+void      _pma_merge_node_pool(NodePool *pool, NodePool *other);
+void      _pma_release_node_pool(NodePool *pool);
+size_t    _pma_malloc_bytes(size_t size, size_t count, void **results);
+uint16_t  _pma_reserve_slots(SharedPageHeader *shared_page, uint16_t count, uint16_t *slots);
+uint8_t   _pma_ctz64(uint64_t word);
 int       _pma_malloc_shared_page(uint8_t bucket);
+int       _pma_push_partial_page(SharedPageHeader *shared_page, uint8_t bucket);
+void      _pma_pop_partial_page(uint8_t bucket);
+SharedPageHeader *_pma_select_partial_page(uint8_t bucket);
+int       _pma_release_empty_pages(void);
+int       _pma_unlink_shared_page(SharedPageHeader *shared_page, uint8_t bucket);
 void     *_pma_malloc_pages(size_t size);
 void     *_pma_malloc_single_page(PageStatus status);
 void     *_pma_malloc_multi_pages(uint64_t num_pages);
-void     *_pma_get_cached_pages(uint64_t num_pages);
+void     *_pma_get_cached_pages(uint64_t num_pages, PageStatus status);
 void     *_pma_get_new_page(PageStatus status);
 void     *_pma_get_new_pages(uint64_t num_pages);
 int       _pma_free_pages(void *address);
 int       _pma_free_bytes(void *address);
 int       _pma_copy_shared_page(void *address);
 uint64_t  _pma_get_single_dpage(void);
+uint64_t  _pma_get_linear_dpage(uint64_t index);
+uint64_t  _pma_take_cached_dpage(uint64_t offset);
 uint64_t  _pma_get_cached_dpage(void);
+uint64_t  _pma_get_cached_dpages(uint64_t num_dpages);
+uint16_t  _pma_find_dpage_run(uint64_t num_dpages);
+uint64_t  _pma_use_dpage_run(uint16_t i, uint64_t num_dpages);
+void      _pma_free_dpage(uint64_t offset);
+uint16_t  _pma_merge_dpage_runs(DPageRun *runs, uint16_t num_runs);
+int       _pma_compare_dpage_runs(const void *a, const void *b);
+int       _pma_settle_dpage_cache(int durable);
+int       _pma_migrate_dpage_cache(void);
 int       _pma_copy_dpage_cache(void);
 uint64_t  _pma_get_disk_dpage(void);
 void      _pma_copy_page(void *address, uint64_t offset, PageStatus status, int fd);
 void      _pma_mark_page_dirty(uint64_t index, uint64_t offset, PageStatus status, uint32_t num_pages);
-int       _pma_extend_snapshot_file(uint64_t multiplier);
+int       _pma_merge_dirty_page(DirtyPageEntry *dirty_page, uint64_t index, uint64_t offset, PageStatus status, uint32_t num_pages);
+DirtyPageEntry *_pma_get_dirty_page(uint64_t i);
+DirtyPageEntry *_pma_find_dirty_page(uint64_t index);
+uint64_t  _pma_get_page_offset(uint64_t index);
+PageStatus _pma_get_page_status(uint64_t index);
+PageDirEntry _pma_get_page_entry(uint64_t index);
+int       _pma_build_page_entries(PageDirEntry **entries, uint64_t **run_indices, uint64_t **run_lengths, uint64_t **run_starts, uint64_t *num_runs);
+int       _pma_init_commit_state(void);
+int       _pma_start_commit(Commit *commit);
+int       _pma_wait_commit(void);
+int       _pma_reap_commit(void);
+void      _pma_free_commit(Commit *commit);
+void     *_pma_commit_writer(void *arg);
+int       _pma_write_commit(Commit *commit);
+#if defined(PMA_IO_URING)
+void      _pma_uring_init(void);
+void      _pma_uring_close(void);
+int       _pma_uring_commit(void);
+int       _pma_uring_probe(int fd);
+struct io_uring_sqe *_pma_uring_get_sqe(void);
+struct io_uring_sqe *_pma_uring_write(int fd, const void *buf, uint64_t bytes, uint64_t offset);
+int       _pma_uring_submit(void);
+#endif
+int       _pma_extend_snapshot_file(uint64_t min_size);
+void      _pma_reserve_arena(void);
+void     *_pma_map_arena(void *address, uint64_t bytes, int prot, uint64_t offset);
+uint64_t  _pma_get_snapshot_increment(uint64_t size);
+int       _pma_init_growth_state(void);
+int       _pma_start_grower(void);
+void      _pma_stop_grower(void);
+void     *_pma_snapshot_grower(void *arg);
+int       _pma_reserve_page_dir(void);
+int       _pma_extend_page_dir(uint64_t num_entries);
 void      _pma_warning(const char *p, void *a, int l);
 
 //==============================================================================
@@ -443,6 +1001,8 @@ void      _pma_warning(const char *p, void *a, int l);
 
 State *_pma_state = NULL;
 
+uint64_t _pma_arena_reserve_size = PMA_ARENA_RESERVE_SIZE;
+
 //==============================================================================
 // PUBLIC FUNCTIONS
 //==============================================================================
@@ -460,7 +1020,12 @@ pma_init(const char *path) {
   uint64_t  meta_bytes;
   int       err;
   int       err_line;
+  int       commit_state = 0;
+  int       growth_state = 0;
+  int       journal_fd = 0;
   int       page_dir_fd = 0;
+  int       page_sums_fd = 0;
+  int       extents_fd = 0;
   int       snapshot_fd = 0;
 
   //
@@ -476,7 +1041,7 @@ pma_init(const char *path) {
   meta_bytes = 2 * PMA_PAGE_SIZE;
 
   // Allocate memory for state
-  _pma_state = malloc(sizeof(State));
+  _pma_state = calloc(1, sizeof(State));
 
   //
   // Create backing files
@@ -514,6 +1079,21 @@ pma_init(const char *path) {
   page_dir_fd = open(filepath, PMA_FILE_FLAGS, PMA_FILE_PERMISSIONS);
   if (page_dir_fd == -1) INIT_ERROR;
 
+  // Create backing file for overflow journal
+  sprintf(filepath, "%s/%s/%s", path, PMA_DEFAULT_DIR_NAME, PMA_JOURNAL_FILENAME);
+  journal_fd = open(filepath, PMA_FILE_FLAGS, PMA_FILE_PERMISSIONS);
+  if (journal_fd == -1) INIT_ERROR;
+
+  // Create backing file for dpage checksums
+  sprintf(filepath, "%s/%s/%s", path, PMA_DEFAULT_DIR_NAME, PMA_PAGE_SUMS_FILENAME);
+  page_sums_fd = open(filepath, PMA_FILE_FLAGS, PMA_FILE_PERMISSIONS);
+  if (page_sums_fd == -1) INIT_ERROR;
+
+  // Create backing file for extent table
+  sprintf(filepath, "%s/%s/%s", path, PMA_DEFAULT_DIR_NAME, PMA_EXTENTS_FILENAME);
+  extents_fd = open(filepath, PMA_FILE_FLAGS, PMA_FILE_PERMISSIONS);
+  if (extents_fd == -1) INIT_ERROR;
+
   //
   // Set initial sizes for backing files
   //
@@ -563,8 +1143,8 @@ pma_init(const char *path) {
    *      pages than it actually occupies and have it grow into the space). Doing so on eliminates the need to ever
    *      resize the mapping using mremap.
    *  3.  mmap the page directory without a location hint. How big is this mmap? Given the above estimate of virtual
-   *      memory available to the snapshot (85 TiB) and the ratio of snapshot size to page directory size (256:1), this
-   *      mapping would be 340 GiB in size. Even assuming the kernel were not smart enough to work around the linked
+   *      memory available to the snapshot (85 TiB) and the ratio of snapshot size to page directory size (512:1), this
+   *      mapping would be 170 GiB in size. Even assuming the kernel were not smart enough to work around the linked
    *      libs, this is still small enough to fit into the stack, according to the above memory section size estimates.
    */
 
@@ -594,11 +1174,13 @@ pma_init(const char *path) {
 
   _pma_state->metadata = malloc(PMA_PAGE_SIZE);
   if (!_pma_state->metadata) INIT_ERROR;
+  memset(_pma_state->metadata, 0, PMA_PAGE_SIZE);
 
   // Initialize simple metadata state
   _pma_state->metadata->magic_code = PMA_MAGIC_CODE;
   _pma_state->metadata->checksum   = 0;
   _pma_state->metadata->version    = PMA_DATA_VERSION;
+  _pma_state->metadata->checksum_type = PMA_CHECKSUM_CRC32C;
   _pma_state->metadata->epoch      = 0;
   _pma_state->metadata->event      = 0;
 
@@ -615,20 +1197,28 @@ pma_init(const char *path) {
   }
   _pma_state->metadata->num_dirty_pages = 0;
 
+  // Initialize overflow journal info
+  _pma_state->metadata->journal_offset   = 0;
+  _pma_state->metadata->journal_entries  = 0;
+  _pma_state->metadata->journal_checksum = 0;
+
   // Initialize snapshot page info
   _pma_state->metadata->snapshot_size  = PMA_INIT_SNAP_SIZE;
-  _pma_state->metadata->next_offset    = meta_bytes;
+  _pma_state->metadata->next_offset    = (meta_bytes + PMA_PAGE_SIZE);  // First dpage used by dpage cache
 
   // Initialize arena start pointer
   _pma_state->metadata->arena_start  = (void *)PMA_SNAPSHOT_ADDR;
 
-  // Manually allocate a page for the dpage cache
-  _pma_state->metadata->dpage_cache = mmap(
+  // Reserve address space for the arena
+  _pma_reserve_arena();
+
+  // Manually allocate a page for the dpage cache. Arena pages are mapped from
+  // the snapshot file of the global state.
+  _pma_state->snapshot_fd = snapshot_fd;
+  _pma_state->metadata->dpage_cache = _pma_map_arena(
       _pma_state->metadata->arena_start,
       PMA_PAGE_SIZE,
       PROT_READ | PROT_WRITE,
-      MAP_SHARED | MAP_FIXED_NOREPLACE,
-      snapshot_fd,
       meta_bytes);
   if (_pma_state->metadata->dpage_cache == MAP_FAILED) INIT_ERROR;
 
@@ -636,21 +1226,23 @@ pma_init(const char *path) {
   _pma_state->metadata->arena_end = (void*)((char*)_pma_state->metadata->arena_start + PMA_PAGE_SIZE);
 
   // Setup initial dpage cache values
-  _pma_state->metadata->dpage_cache->dirty = 0;
-  _pma_state->metadata->dpage_cache->size  = 0;
-  _pma_state->metadata->dpage_cache->head  = 0;
-  _pma_state->metadata->dpage_cache->tail  = 0;
+  _pma_state->metadata->dpage_cache->dirty     = 0;
+  _pma_state->metadata->dpage_cache->size      = 0;
+  _pma_state->metadata->dpage_cache->num_held  = 0;
+  _pma_state->metadata->dpage_cache->num_freed = 0;
 
   //
   // Setup page directory
   //
 
-  _pma_state->page_directory.size       = PMA_INIT_DIR_SIZE;
+  _pma_state->page_directory.size       = (PMA_INIT_DIR_SIZE / sizeof(PageDirEntry));
   _pma_state->page_directory.next_index = 1;
   _pma_state->page_directory.entries    = (PageDirEntry *)page_dir;
 
   // First page used by dpage cache
-  _pma_state->page_directory.entries[0].status = FIRST;
+  _pma_state->page_directory.entries[0] = DIR_ENTRY(meta_bytes, FIRST);
+  _pma_state->dir_unflushed = 1;
+  _pma_state->end_offset = _pma_state->metadata->next_offset;
 
   //
   // Setup transient state
@@ -659,13 +1251,43 @@ pma_init(const char *path) {
   // Replace the first metadata page, since they're identical
   _pma_state->meta_page_offset = 0;
 
-  // Initialize file descriptors
-  _pma_state->snapshot_fd = snapshot_fd;
+  // Initialize file descriptors (snapshot file already set above)
   _pma_state->page_dir_fd = page_dir_fd;
+  _pma_state->journal_fd  = journal_fd;
+  _pma_state->page_sums_fd = page_sums_fd;
+  _pma_state->extents_fd  = extents_fd;
+
+  // Initialize overflow dirty page entries
+  _pma_state->journal_pages     = NULL;
+  _pma_state->num_journal_pages = 0;
+  _pma_state->journal_capacity  = 0;
+
+  // Initialize free page cache
+  memset(&(_pma_state->free_page_runs), 0, sizeof(PageRunIndex));
+  _pma_init_page_run_pools(_pma_state->page_run_pools);
+  _pma_init_node_pool(&(_pma_state->partial_page_pool), sizeof(PartialPageCache));
+
+  // Initialize partial shared page caches
+  for(uint8_t i = 0; i < PMA_MAX_SHARED_SHIFT; ++i) {
+    _pma_state->partial_pages[i] = NULL;
+  }
+  _pma_state->empty_pages = NULL;
+
+  // Initialize counters
+  memset(&(_pma_state->stats), 0, sizeof(PMAStats));
+  _pma_state->commit_mode = PMA_COMMIT_RANGES;
+  _pma_state->durability = PMA_DURABILITY_FULL;
+
+  // Initialize asynchronous sync state
+  if (_pma_init_commit_state()) INIT_ERROR;
+  commit_state = 1;
+  if (_pma_init_growth_state()) INIT_ERROR;
+  growth_state = 1;
 
-  // Initialize free page caches
-  _pma_state->free_pages      = NULL;
-  _pma_state->free_page_runs  = NULL;
+#if defined(PMA_IO_URING)
+  // Set up io_uring, if available
+  _pma_uring_init();
+#endif
 
   //
   // Sync initial PMA state to disk
@@ -686,18 +1308,16 @@ pma_init(const char *path) {
   if (err) INIT_ERROR;
 
   // Compute checksum for metadata
-  _pma_state->metadata->checksum = crc_32(
-      (const unsigned char *)(&(_pma_state->metadata)),
-      PMA_PAGE_SIZE);
+  _pma_state->metadata->checksum = _pma_checksum_metadata(_pma_state->metadata);
 
   // Copy and sync metadata to both buffers
   memcpy(
     meta_pages,
-    (const void *)(&(_pma_state->metadata)),
+    (const void *)_pma_state->metadata,
     PMA_PAGE_SIZE);
   memcpy(
-    (void *)((Metadata*)meta_pages + 1),
-    (const void *)(&(_pma_state->metadata)),
+    (void *)((char *)meta_pages + PMA_PAGE_SIZE),
+    (const void *)_pma_state->metadata,
     PMA_PAGE_SIZE);
   if (msync(meta_pages, meta_bytes, MS_SYNC)) INIT_ERROR;
 
@@ -719,28 +1339,56 @@ pma_init(const char *path) {
 init_error:
   fprintf(stderr, "(L%d) PMA initialization error: %s\n", err_line, strerror(errno));
 
+  if (commit_state) {
+    pthread_cond_destroy(&(_pma_state->commit_cond));
+    pthread_mutex_destroy(&(_pma_state->commit_lock));
+  }
+  if (growth_state) {
+    _pma_stop_grower();
+    pthread_cond_destroy(&(_pma_state->grow_cond));
+    pthread_mutex_destroy(&(_pma_state->grow_lock));
+#if defined(PMA_IO_URING)
+    // Set up right after the growth state
+    _pma_uring_close();
+#endif
+  }
   munmap(meta_pages, meta_bytes);
   munmap(page_dir, PMA_INIT_DIR_SIZE);
+  if (_pma_state->arena_reserve) munmap((void *)PMA_SNAPSHOT_ADDR, _pma_state->arena_reserve);
   if (snapshot_fd) close(snapshot_fd);
   if (page_dir_fd) close(page_dir_fd);
+  if (journal_fd) close(journal_fd);
+  if (page_sums_fd) close(page_sums_fd);
+  if (extents_fd) close(extents_fd);
   free((void*)filepath);
+  free((void*)_pma_state->metadata);
   free((void*)_pma_state);
+  _pma_state = NULL;
 
   return -1;
 }
 
 int
 pma_load(const char *path) {
+  struct stat   st;
   Metadata     *newer_page;
   Metadata     *older_page;
+  MetadataV1   *old_metadata;
   char         *filepath;
-  void         *address;
-  void         *meta_pages;
-  uint64_t      index;
+  void         *meta_pages = NULL;
+  Extent       *extents;
+  uint64_t      num_extents;
   uint64_t      meta_bytes;
+  uint64_t      magic_code;
+  uint16_t      version;
   int           err;
   int           err_line;
+  int           commit_state = 0;
+  int           growth_state = 0;
+  int           journal_fd = 0;
   int           page_dir_fd = 0;
+  int           page_sums_fd = 0;
+  int           extents_fd = 0;
   int           snapshot_fd = 0;
 
   //
@@ -756,7 +1404,8 @@ pma_load(const char *path) {
   meta_bytes = 2 * PMA_PAGE_SIZE;
 
   // Allocate memory for state
-  _pma_state = malloc(sizeof(State));
+  _pma_state = calloc(1, sizeof(State));
+  if (_pma_state == NULL) return -1;
 
   //
   // Create backing files
@@ -778,13 +1427,29 @@ pma_load(const char *path) {
   page_dir_fd = open(filepath, PMA_FILE_FLAGS, PMA_FILE_PERMISSIONS);
   if (page_dir_fd == -1) LOAD_ERROR;
 
+  // Open backing file for overflow journal
+  sprintf(filepath, "%s/%s/%s", path, PMA_DEFAULT_DIR_NAME, PMA_JOURNAL_FILENAME);
+  journal_fd = open(filepath, PMA_FILE_FLAGS, PMA_FILE_PERMISSIONS);
+  if (journal_fd == -1) LOAD_ERROR;
+
+  // Open backing file for dpage checksums
+  sprintf(filepath, "%s/%s/%s", path, PMA_DEFAULT_DIR_NAME, PMA_PAGE_SUMS_FILENAME);
+  page_sums_fd = open(filepath, PMA_FILE_FLAGS, PMA_FILE_PERMISSIONS);
+  if (page_sums_fd == -1) LOAD_ERROR;
+
+  // Open backing file for extent table
+  sprintf(filepath, "%s/%s/%s", path, PMA_DEFAULT_DIR_NAME, PMA_EXTENTS_FILENAME);
+  extents_fd = open(filepath, PMA_FILE_FLAGS, PMA_FILE_PERMISSIONS);
+  if (extents_fd == -1) LOAD_ERROR;
+
   //
   // Verify file can be loaded
   //
 
   // Read magic code
-  err = read(snapshot_fd, (void*)(&_pma_state->metadata->magic_code), sizeof(uint64_t));
-  if ((err != -1) || (_pma_state->metadata->magic_code != PMA_MAGIC_CODE)) {
+  err = read(snapshot_fd, (void*)(&magic_code), sizeof(uint64_t));
+  if (err == -1) LOAD_ERROR;
+  if ((err != sizeof(uint64_t)) || (magic_code != PMA_MAGIC_CODE)) {
     errno = EILSEQ;
     LOAD_ERROR;
   }
@@ -803,8 +1468,8 @@ pma_load(const char *path) {
   newer_page = (Metadata*)meta_pages;
   older_page = (Metadata*)((char*)meta_pages + PMA_PAGE_SIZE);
   if (
-      (newer_page->epoch > older_page->epoch) ||
-      ((newer_page->epoch == older_page->epoch) && (newer_page->event > older_page->event))) {
+      (older_page->epoch > newer_page->epoch) ||
+      ((older_page->epoch == newer_page->epoch) && (older_page->event > newer_page->event))) {
     newer_page = older_page;
     older_page = (Metadata*)meta_pages;
   }
@@ -822,16 +1487,44 @@ pma_load(const char *path) {
   // Next page replaced is the older of the two pages
   _pma_state->meta_page_offset = (newer_page == meta_pages) ? PMA_PAGE_SIZE : 0;
 
-  // Update page directory using metadata dirty page list
-  err = _pma_sync_dirty_pages(page_dir_fd, _pma_state->metadata->num_dirty_pages, _pma_state->metadata->dirty_pages);
-  if (err) LOAD_ERROR;
+  _pma_state->metadata = malloc(PMA_PAGE_SIZE);
+  if (!_pma_state->metadata) LOAD_ERROR;
 
-  _pma_state->metadata->num_dirty_pages = 0;
+  memcpy((void *)_pma_state->metadata, (const void *)newer_page, PMA_PAGE_SIZE);
+
+  if (_pma_state->metadata->version > PMA_DATA_VERSION) {
+    errno = ENOTSUP;
+    LOAD_ERROR;
+  }
+
+  // Convert metadata written by an older version
+  version = _pma_state->metadata->version;
+  if (version < 2) {
+    _pma_migrate_metadata((const MetadataV1 *)newer_page, _pma_state->metadata);
+  }
+
+  // Overflow dirty page entries referenced by the older metadata page mustn't be
+  // overwritten until it has been replaced
+  if ((older_page != newer_page) && (older_page->version >= 2) && _pma_verify_checksum(older_page)) {
+    _pma_state->older_journal_offset  = older_page->journal_offset;
+    _pma_state->older_journal_entries = older_page->journal_entries;
+  }
+
+  // The loaded metadata may still only be in the page cache, if the process
+  // which wrote it crashed
+  _pma_state->held_unflushed = 1;
 
   //
   // Load page directory
   //
 
+  // Convert page directory written by an older version
+  if (version < 2) {
+    sprintf(filepath, "%s/%s", path, PMA_DEFAULT_DIR_NAME);
+    if (_pma_migrate_page_dir(&page_dir_fd, filepath)) LOAD_ERROR;
+  }
+  _pma_state->metadata->version = PMA_DATA_VERSION;
+
   // mmap page directory
   _pma_state->page_directory.entries = mmap(
       NULL,
@@ -842,120 +1535,100 @@ pma_load(const char *path) {
       0);
   if (_pma_state->page_directory.entries == MAP_FAILED) LOAD_ERROR;
 
-  //
-  // Map pages and compute free page caches
-  //
-
-  index = 0;
-  while (1) {
-    struct stat   st;
-    uint64_t      count = 1;
-
-    switch (_pma_state->page_directory.entries[index].status) {
-      case UNALLOCATED:
-        ++index;
-        continue;
-
-      case FREE:
-        // While pages have FREE status AND are contiguous on disk, scan forward
-        ++index;
-        while (
-            _pma_state->page_directory.entries[index].status == FREE &&
-            _pma_state->page_directory.entries[index].offset == (_pma_state->page_directory.entries[index - 1].offset + PMA_PAGE_SIZE)) {
-          ++count;
-          ++index;
-        }
-
-        // Add to appropriate free page cache
-        if (count == 1) {
-          SinglePageCache *free_page = (SinglePageCache *)malloc(sizeof(SinglePageCache));
-
-          // Add it to the single-page cache
-          free_page->next = _pma_state->free_pages;
-          free_page->page = INDEX_TO_PTR(index - 1);
-          _pma_state->free_pages = free_page;
-
-        } else {
-          PageRunCache *page_run = (PageRunCache *)malloc(sizeof(SinglePageCache));
-
-          page_run->next = _pma_state->free_page_runs;
-          page_run->page = INDEX_TO_PTR(index - count);
-          page_run->length = count;
-          _pma_state->free_page_runs = page_run;
-        }
-
-        // Map free pages (they're expected to be mapped but read only)
-        address = mmap(
-            INDEX_TO_PTR(index - count),
-            (PMA_PAGE_SIZE * count),
-            PROT_READ,
-            MAP_SHARED | MAP_FIXED_NOREPLACE,
-            page_dir_fd,
-            _pma_state->page_directory.entries[index - count].offset);
-
-        continue;
+  // Update page directory using metadata dirty page list. The dirty page list
+  // of older metadata is read from the metadata page on disk, since it has a
+  // different offset in the page.
+  if (version < 2) {
+    old_metadata = (MetadataV1 *)newer_page;
+    err = _pma_sync_dirty_pages(page_dir_fd, old_metadata->num_dirty_pages, old_metadata->dirty_pages);
+  } else {
+    err = _pma_sync_dirty_pages(page_dir_fd, _pma_state->metadata->num_dirty_pages, _pma_state->metadata->dirty_pages);
+  }
+  if (err) LOAD_ERROR;
 
-      case SHARED:
-        // Map immediately
-        address = mmap(
-            INDEX_TO_PTR(index),
-            PMA_PAGE_SIZE,
-            PROT_READ,
-            MAP_SHARED | MAP_FIXED_NOREPLACE,
-            page_dir_fd,
-            _pma_state->page_directory.entries[index].offset);
-        if (address == MAP_FAILED) LOAD_ERROR;
+  // Update page directory using overflow journal
+  err = _pma_replay_journal(journal_fd, page_dir_fd);
+  if (err) LOAD_ERROR;
 
-        ++index;
+  _pma_state->dir_unflushed = 1;
 
-        continue;
+  _pma_state->metadata->num_dirty_pages = 0;
 
-      case FIRST:
-        // While pages have FOLLOW status, scan forward
-        ++index;
-        while (_pma_state->page_directory.entries[index].status == FOLLOW) {
-          assert(_pma_state->page_directory.entries[index].offset == (_pma_state->page_directory.entries[index - 1].offset + PMA_PAGE_SIZE));
+  // Checksums written from now on use the current algorithm
+  _pma_state->metadata->checksum_type = PMA_CHECKSUM_CRC32C;
 
-          ++count;
-          ++index;
-        }
+  // Dpage checksums may have been recorded by syncs which were lost, and won't
+  // be kept up to date while disabled
+  if (!(_pma_state->metadata->flags & PMA_FLAG_PAGE_SUMS)) {
+    if (ftruncate(page_sums_fd, 0)) LOAD_ERROR;
+  }
 
-        // mmap entire block
-        address = mmap(
-            INDEX_TO_PTR(index - count),
-            (count * PMA_PAGE_SIZE),
-            PROT_READ,
-            MAP_SHARED | MAP_FIXED_NOREPLACE,
-            page_dir_fd,
-            _pma_state->page_directory.entries[index - count].offset);
-        if (address == MAP_FAILED) LOAD_ERROR;
+  _pma_state->snapshot_fd       = snapshot_fd;
+  _pma_state->page_dir_fd       = page_dir_fd;
+  _pma_state->journal_fd        = journal_fd;
+  _pma_state->page_sums_fd      = page_sums_fd;
+  _pma_state->extents_fd        = extents_fd;
+  _pma_state->journal_pages     = NULL;
+  _pma_state->num_journal_pages = 0;
+  _pma_state->journal_capacity  = 0;
 
-        continue;
+  //
+  // Map pages and compute free page caches
+  //
 
-      case FOLLOW:
-        // FOLLOW pages should be passed over correctly by FIRST case
-      default:
-        fprintf(stderr, "Index %lu invalid\n", index);
-        errno = EINVAL;
-        LOAD_ERROR;
-    }
+  memset(&(_pma_state->free_page_runs), 0, sizeof(PageRunIndex));
+  _pma_init_page_run_pools(_pma_state->page_run_pools);
+  _pma_init_node_pool(&(_pma_state->partial_page_pool), sizeof(PartialPageCache));
+  for(uint8_t i = 0; i < PMA_MAX_SHARED_SHIFT; ++i) {
+    _pma_state->partial_pages[i] = NULL;
+  }
+  _pma_state->empty_pages = NULL;
+
+  memset(&(_pma_state->stats), 0, sizeof(PMAStats));
+  _pma_state->commit_mode = PMA_COMMIT_RANGES;
+  _pma_state->durability = PMA_DURABILITY_FULL;
+
+  if (_pma_init_commit_state()) LOAD_ERROR;
+  commit_state = 1;
+  if (_pma_init_growth_state()) LOAD_ERROR;
+  growth_state = 1;
+
+#if defined(PMA_IO_URING)
+  _pma_uring_init();
+#endif
+
+  // Reserve address space for the arena, into which its pages are mapped
+  _pma_reserve_arena();
+
+  // Map pages using the extent table if it describes this snapshot, otherwise
+  // scan the page directory
+  if (_pma_read_extents(&extents, &num_extents)) LOAD_ERROR;
+  if (extents) {
+    err = _pma_load_extents(extents, num_extents);
+    free((void *)extents);
+    if (err) LOAD_ERROR;
+  } else {
+    if (_pma_load_pages()) LOAD_ERROR;
+  }
 
-    // Get next free index
-    _pma_state->page_directory.next_index = index;
+  // Get next free index
+  _pma_state->page_directory.next_index = PTR_TO_INDEX(_pma_state->metadata->arena_end);
+  _pma_state->end_offset =
+    ENTRY_OFFSET(_pma_state->page_directory.entries[_pma_state->page_directory.next_index - 1]) + PMA_PAGE_SIZE;
 
-    // Get total number of indices
-    fstat(page_dir_fd, &st);
-    _pma_state->page_directory.size = ((st.st_size / sizeof(PageDirEntry)) - 1);
+  // Get total number of indices
+  if (fstat(page_dir_fd, &st)) LOAD_ERROR;
+  _pma_state->page_directory.size = (st.st_size / sizeof(PageDirEntry));
 
-    break;
+  // Convert dpage cache written by an older version
+  if (version < 3) {
+    if (_pma_migrate_dpage_cache()) LOAD_ERROR;
   }
 
   //
   // Done
   //
 
-  // TODO: check version number, possibly upgrade
-
   // Clean up
   munmap(meta_pages, meta_bytes);
   free((void*)filepath);
@@ -965,13 +1638,38 @@ pma_load(const char *path) {
 load_error:
   fprintf(stderr, "(L%d) Error loading PMA from %s: %s\n", err_line, path, strerror(errno));
 
-  munmap(meta_pages, meta_bytes);
-  munmap(_pma_state->page_directory.entries, PMA_MAXIMUM_DIR_SIZE);
-  munmap(_pma_state->metadata->arena_start, ((uint64_t)_pma_state->metadata->arena_end - (uint64_t)_pma_state->metadata->arena_start));
+  if (commit_state) {
+    pthread_cond_destroy(&(_pma_state->commit_cond));
+    pthread_mutex_destroy(&(_pma_state->commit_lock));
+  }
+  if (growth_state) {
+    _pma_stop_grower();
+    pthread_cond_destroy(&(_pma_state->grow_cond));
+    pthread_mutex_destroy(&(_pma_state->grow_lock));
+#if defined(PMA_IO_URING)
+    // Set up right after the growth state
+    _pma_uring_close();
+#endif
+  }
+  if (meta_pages && (meta_pages != MAP_FAILED)) munmap(meta_pages, meta_bytes);
+  if (_pma_state->page_directory.entries && (_pma_state->page_directory.entries != MAP_FAILED)) {
+    munmap(_pma_state->page_directory.entries, PMA_MAXIMUM_DIR_SIZE);
+  }
+  if (_pma_state->metadata) {
+    munmap(_pma_state->metadata->arena_start, ((uint64_t)_pma_state->metadata->arena_end - (uint64_t)_pma_state->metadata->arena_start));
+    if (_pma_state->arena_reserve) munmap(_pma_state->metadata->arena_start, _pma_state->arena_reserve);
+    free((void*)_pma_state->metadata);
+  }
+  _pma_release_page_run_pools(_pma_state->page_run_pools);
+  _pma_release_node_pool(&(_pma_state->partial_page_pool));
   if (snapshot_fd) close(snapshot_fd);
   if (page_dir_fd) close(page_dir_fd);
+  if (journal_fd) close(journal_fd);
+  if (page_sums_fd) close(page_sums_fd);
+  if (extents_fd) close(extents_fd);
   free((void*)filepath);
   free((void*)_pma_state);
+  _pma_state = NULL;
 
   return -1;
 }
@@ -983,18 +1681,59 @@ pma_close(uint64_t epoch, uint64_t event) {
     return -1;
   }
 
+  // Stop writer thread
+  if (_pma_state->writer_running) {
+    pthread_mutex_lock(&(_pma_state->commit_lock));
+    _pma_state->writer_stop = 1;
+    pthread_cond_broadcast(&(_pma_state->commit_cond));
+    pthread_mutex_unlock(&(_pma_state->commit_lock));
+
+    pthread_join(_pma_state->writer, NULL);
+  }
+  pthread_cond_destroy(&(_pma_state->commit_cond));
+  pthread_mutex_destroy(&(_pma_state->commit_lock));
+
+  // Stop grower thread
+  _pma_stop_grower();
+  pthread_cond_destroy(&(_pma_state->grow_cond));
+  pthread_mutex_destroy(&(_pma_state->grow_lock));
+
+#if defined(PMA_IO_URING)
+  _pma_uring_close();
+#endif
+
+  // Summarize page directory and free page caches for the next load. The extent
+  // table is only an optimization: if it can't be written in full, the next
+  // load rejects it and scans the page directory instead.
+  if (_pma_write_extents()) {
+    fprintf(stderr, "Error writing PMA extent table: %s\n", strerror(errno));
+  }
+
   // Unmap page directory
   munmap(_pma_state->page_directory.entries, PMA_MAXIMUM_DIR_SIZE);
 
-  // Unmap snapshot
+  // Unmap snapshot, and release the rest of the address space reserved for it
   munmap(_pma_state->metadata->arena_start, _pma_state->metadata->snapshot_size);
+  if (_pma_state->arena_reserve) munmap(_pma_state->metadata->arena_start, _pma_state->arena_reserve);
 
   // Close file descriptors
+  close(_pma_state->journal_fd);
+  close(_pma_state->page_sums_fd);
+  close(_pma_state->extents_fd);
   close(_pma_state->page_dir_fd);
   close(_pma_state->snapshot_fd);
 
+  // Free overflow dirty page entries
+  free((void*)_pma_state->journal_pages);
+
+  // Free nodes of volatile caches
+  _pma_release_page_run_pools(_pma_state->page_run_pools);
+  _pma_release_node_pool(&(_pma_state->partial_page_pool));
+
   // Free PMA state
+  free((void*)_pma_state->metadata);
   free((void*)_pma_state);
+  _pma_state = NULL;
 
   return 0;
 }
@@ -1011,7 +1750,7 @@ pma_malloc(size_t size) {
   } else if ((size + PMA_PAGE_SIZE) < size) {   // Check for overflow
     errno = ENOMEM;
   } else if (size <= PMA_MAX_SHARED_ALLOC) {
-    result = _pma_malloc_bytes(size);
+    _pma_malloc_bytes(size, 1, &result);
   } else {
     result = _pma_malloc_pages(size);
   }
@@ -1021,9 +1760,36 @@ pma_malloc(size_t size) {
   return result;
 }
 
-int
-pma_free(void *address) {
-  uint64_t  index;
+size_t
+pma_malloc_batch(size_t size, size_t count, void **results) {
+  size_t num_allocated = 0;
+
+  /* MALLOC_LOCK */
+
+  if (!size) {
+    /* MALLOC_UNLOCK */
+    return num_allocated;
+  } else if ((size + PMA_PAGE_SIZE) < size) {   // Check for overflow
+    errno = ENOMEM;
+  } else if (size <= PMA_MAX_SHARED_ALLOC) {
+    num_allocated = _pma_malloc_bytes(size, count, results);
+  } else {
+    while (num_allocated < count) {
+      results[num_allocated] = _pma_malloc_pages(size);
+      if (results[num_allocated] == NULL) break;
+
+      ++num_allocated;
+    }
+  }
+
+  /* MALLOC_UNLOCK */
+
+  return num_allocated;
+}
+
+int
+pma_free(void *address) {
+  uint64_t  index;
 
   // TODO: This is legal for POSIX free, but would this ever happen for pma_free?
   if (address == NULL) return 0;
@@ -1045,7 +1811,7 @@ pma_free(void *address) {
   }
 
   index = PTR_TO_INDEX(address);
-  switch (_pma_state->page_directory.entries[index].status) {
+  switch (_pma_get_page_status(index)) {
     case UNALLOCATED:
       // Something has definitely gone wrong if an address between arena_start
       // and arena_end, with an index between 0 and next_free_index is
@@ -1076,10 +1842,9 @@ pma_free(void *address) {
 
 int
 pma_sync(uint64_t epoch, uint64_t event) {
-  DPageCache *dpage_cache = _pma_state->metadata->dpage_cache;
-  ssize_t     bytes_out;
-  int         err;
-  int         err_line;
+  int msync_flags;
+  int err;
+  int err_line;
 
   // Epoch & event may only increase
   if (
@@ -1089,59 +1854,64 @@ pma_sync(uint64_t epoch, uint64_t event) {
     return -1;
   }
 
-  // Clear dpage cache dirty bit and compute new size
-  if (dpage_cache->dirty) {
-    dpage_cache->dirty = 0;
-    dpage_cache->size = (dpage_cache->tail - dpage_cache->head);
-  }
+  // Finish asynchronous sync, if there is one in progress
+  if (_pma_wait_commit()) SYNC_ERROR;
 
-  // Sync dirty pages
-  for (uint8_t i = 0; i < _pma_state->metadata->num_dirty_pages; ++i) {
-    void     *address = INDEX_TO_PTR(_pma_state->metadata->dirty_pages[i].index);
-    uint64_t  bytes = (_pma_state->metadata->dirty_pages[i].num_pages * PMA_PAGE_SIZE);
+  // Release empty shared pages. This may copy other shared pages, so it must
+  // happen before the dirty pages are synced.
+  if (_pma_release_empty_pages()) SYNC_ERROR;
 
-    // Clear dirty bit for shared pages
-    if (_pma_state->metadata->dirty_pages[i].status == SHARED) {
-      ((SharedPageHeader*)address)->dirty = 0;
-    }
+  // Grow the page directory ahead of the arena, so that allocations don't
+  // have to
+  if (_pma_reserve_page_dir()) SYNC_ERROR;
 
-    err = msync(address, bytes, MS_SYNC);
-    if (err) SYNC_ERROR;
+  // Clear dpage cache dirty bit, and make dpages freed before this sync
+  // reusable once it's durable
+  if (_pma_settle_dpage_cache(_pma_state->durability == PMA_DURABILITY_FULL)) SYNC_ERROR;
 
-    if (mprotect(address, bytes, PROT_READ)) SYNC_ERROR;
+  // Sync dirty pages. In group commit mode, only start writeback here; the
+  // snapshot file is flushed all at once when committing. Without durability,
+  // only make them read-only.
+  if (_pma_state->durability == PMA_DURABILITY_NONE) {
+    msync_flags = 0;
+  } else if (_pma_state->commit_mode == PMA_COMMIT_GROUP) {
+    msync_flags = MS_ASYNC;
+  } else {
+    msync_flags = MS_SYNC;
+  }
+  if (_pma_msync_dirty_pages(msync_flags)) SYNC_ERROR;
+
+  // Record checksums of the dpages written by this sync
+  if (_pma_state->metadata->flags & PMA_FLAG_PAGE_SUMS) {
+    err = _pma_write_page_sums(_pma_state->metadata->num_dirty_pages, _pma_state->metadata->dirty_pages);
+    if (err) SYNC_ERROR;
+    err = _pma_write_page_sums(_pma_state->num_journal_pages, _pma_state->journal_pages);
+    if (err) SYNC_ERROR;
   }
 
-  // Compute checksum
   _pma_state->metadata->epoch = epoch;
   _pma_state->metadata->event = event;
-  _pma_state->metadata->checksum = 0;
-  _pma_state->metadata->checksum = crc_32(
-      (const unsigned char *)(&(_pma_state->metadata)),
-      PMA_PAGE_SIZE);
 
-  // Sync metadata
-  bytes_out = pwrite(
-      _pma_state->snapshot_fd,
-      (const void *)(_pma_state->metadata),
-      PMA_PAGE_SIZE,
-      _pma_state->meta_page_offset);
-  if (bytes_out != PMA_PAGE_SIZE) SYNC_ERROR;
-
-  _pma_state->meta_page_offset = _pma_state->meta_page_offset ? 0 : PMA_PAGE_SIZE;
-
-  // Sync dirty pages in page directory
-  err = _pma_sync_dirty_pages(
-      _pma_state->page_dir_fd,
-      _pma_state->metadata->num_dirty_pages,
-      _pma_state->metadata->dirty_pages);
-  if (err) SYNC_ERROR;
+  // Write overflow dirty page entries, metadata, and page directory
+#if defined(PMA_IO_URING)
+  if (_pma_state->uring.fd != -1) {
+    if (_pma_uring_commit()) SYNC_ERROR;
+  } else {
+    if (_pma_commit_sync()) SYNC_ERROR;
+  }
+#else
+  if (_pma_commit_sync()) SYNC_ERROR;
+#endif
 
   // Update free page caches
   err = _pma_update_free_pages(_pma_state->metadata->num_dirty_pages, _pma_state->metadata->dirty_pages);
   if (err) SYNC_ERROR;
+  err = _pma_update_free_pages(_pma_state->num_journal_pages, _pma_state->journal_pages);
+  if (err) SYNC_ERROR;
 
-  // Reset dirty page array
+  // Reset dirty page arrays
   _pma_state->metadata->num_dirty_pages = 0;
+  _pma_state->num_journal_pages = 0;
 
   return 0;
 
@@ -1151,6 +1921,336 @@ sync_error:
   return -1;
 }
 
+void
+pma_get_stats(PMAStats *stats) {
+  FILE     *maps;
+  uint64_t  start;
+  uint64_t  end;
+  uint64_t  arena_start = (uint64_t)_pma_state->metadata->arena_start;
+  uint64_t  arena_end = (uint64_t)_pma_state->metadata->arena_end;
+  int       c;
+
+  memcpy(stats, &(_pma_state->stats), sizeof(PMAStats));
+
+  // Measure the free page cache and the partial shared page caches
+  stats->free_page_runs = 0;
+  stats->free_pages = 0;
+  for (PageRunCache *node = _pma_state->free_page_runs.pages[0]; node != NULL; node = RUN_NEXT_PAGE(node, 0)) {
+    ++(stats->free_page_runs);
+    stats->free_pages += node->length;
+  }
+
+  stats->partial_pages = 0;
+  for (uint8_t bucket = 0; bucket < PMA_MAX_SHARED_SHIFT; ++bucket) {
+    for (PartialPageCache *node = _pma_state->partial_pages[bucket]; node != NULL; node = node->next) {
+      ++(stats->partial_pages);
+    }
+  }
+
+  // Count the mappings of the kernel which overlap the arena
+  stats->num_vmas = 0;
+  maps = fopen("/proc/self/maps", "r");
+  if (maps == NULL) return;
+
+  while (fscanf(maps, "%" SCNx64 "-%" SCNx64, &start, &end) == 2) {
+    if ((start < arena_end) && (end > arena_start)) ++(stats->num_vmas);
+
+    // Skip rest of line
+    do {
+      c = fgetc(maps);
+    } while ((c != '\n') && (c != EOF));
+  }
+
+  fclose(maps);
+}
+
+uint64_t
+pma_sync_async(uint64_t epoch, uint64_t event) {
+  Commit   *commit;
+  uint64_t  ticket;
+  int       err_line;
+
+  // Epoch & event may only increase
+  if (
+      (epoch < _pma_state->metadata->epoch) ||
+      ((epoch == _pma_state->metadata->epoch) && (event <= _pma_state->metadata->event))) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  // Only one sync can be in progress at a time
+  if (_pma_wait_commit()) SYNC_ERROR;
+
+  // Release empty shared pages. This may copy other shared pages, so it must
+  // happen before the dirty pages are frozen.
+  if (_pma_release_empty_pages()) SYNC_ERROR;
+
+  // Grow the page directory ahead of the arena, so that allocations don't
+  // have to
+  if (_pma_reserve_page_dir()) SYNC_ERROR;
+
+  // Clear dpage cache dirty bit. Until this sync is durable, the snapshot of
+  // the previous sync is the one which would be loaded after a crash, so only
+  // dpages freed before the previous sync can be reused.
+  if (_pma_settle_dpage_cache(0)) SYNC_ERROR;
+
+  // Start writeback of dirty pages and make them read-only. Any of them which
+  // are modified by the next event are copied-on-write, so the dirty pages
+  // keep the contents they had at the time of the freeze.
+  if (_pma_msync_dirty_pages((_pma_state->durability == PMA_DURABILITY_NONE) ? 0 : MS_ASYNC)) SYNC_ERROR;
+
+  // Record checksums of the dpages written by this sync, while their contents
+  // are still visible through the arena
+  if (_pma_state->metadata->flags & PMA_FLAG_PAGE_SUMS) {
+    if (_pma_write_page_sums(_pma_state->metadata->num_dirty_pages, _pma_state->metadata->dirty_pages)) SYNC_ERROR;
+    if (_pma_write_page_sums(_pma_state->num_journal_pages, _pma_state->journal_pages)) SYNC_ERROR;
+  }
+
+  _pma_state->metadata->epoch = epoch;
+  _pma_state->metadata->event = event;
+
+  // Freeze metadata and dirty page entries
+  commit = (Commit *)malloc(sizeof(Commit));
+  if (commit == NULL) SYNC_ERROR;
+
+  commit->metadata = (Metadata *)malloc(PMA_PAGE_SIZE);
+  if (commit->metadata == NULL) {
+    free((void *)commit);
+    SYNC_ERROR;
+  }
+
+  // Directory entries which the sync will write, so that the page directory
+  // as of the sync can be looked up until they're applied
+  if (_pma_build_page_entries(
+      &(commit->entries),
+      &(commit->run_indices),
+      &(commit->run_lengths),
+      &(commit->run_starts),
+      &(commit->num_runs))) {
+    free((void *)commit->metadata);
+    free((void *)commit);
+    SYNC_ERROR;
+  }
+
+  memcpy(commit->metadata, _pma_state->metadata, PMA_PAGE_SIZE);
+  commit->meta_page_offset  = _pma_state->meta_page_offset;
+  commit->journal_pages     = _pma_state->journal_pages;
+  commit->num_journal_pages = _pma_state->num_journal_pages;
+  commit->ticket            = ++(_pma_state->last_ticket);
+  commit->durability        = _pma_state->durability;
+  commit->flush_page_dir    = (commit->durability != PMA_DURABILITY_NONE) && _pma_state->dir_unflushed;
+  commit->done              = 0;
+  commit->err               = 0;
+  ticket = commit->ticket;
+
+  // Hand off to writer thread. The dirty page entries stay with the PMA until
+  // the writer thread has been started, so that they're synced by the next
+  // sync instead if it can't be.
+  if (_pma_start_commit(commit)) {
+    _pma_free_commit(commit);
+    SYNC_ERROR;
+  }
+
+  _pma_state->meta_page_offset = _pma_state->meta_page_offset ? 0 : PMA_PAGE_SIZE;
+  if (commit->flush_page_dir) _pma_state->dir_unflushed = 0;
+
+  // Reset dirty page arrays
+  _pma_state->metadata->num_dirty_pages = 0;
+  _pma_state->journal_pages     = NULL;
+  _pma_state->num_journal_pages = 0;
+  _pma_state->journal_capacity  = 0;
+
+  return ticket;
+
+sync_error:
+  fprintf(stderr, "(L%d) Error syncing PMA: %s\n", err_line, strerror(errno));
+
+  return 0;
+}
+
+int
+pma_sync_wait(uint64_t ticket) {
+  if ((ticket == 0) || (ticket > _pma_state->last_ticket)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if ((_pma_state->commit != NULL) && (_pma_state->commit->ticket == ticket)) {
+    return _pma_wait_commit();
+  }
+
+  if (ticket == _pma_state->failed_ticket) {
+    errno = _pma_state->failed_errno;
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+pma_sync_poll(uint64_t ticket) {
+  int done;
+
+  if ((ticket == 0) || (ticket > _pma_state->last_ticket)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if ((_pma_state->commit != NULL) && (_pma_state->commit->ticket == ticket)) {
+    pthread_mutex_lock(&(_pma_state->commit_lock));
+    done = _pma_state->commit->done;
+    pthread_mutex_unlock(&(_pma_state->commit_lock));
+
+    if (!done) return 0;
+
+    return _pma_reap_commit() ? -1 : 1;
+  }
+
+  if (ticket == _pma_state->failed_ticket) {
+    errno = _pma_state->failed_errno;
+    return -1;
+  }
+
+  return 1;
+}
+
+int
+pma_set_commit_mode(PMACommitMode mode) {
+  if ((mode != PMA_COMMIT_RANGES) && (mode != PMA_COMMIT_GROUP)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  _pma_state->commit_mode = mode;
+
+  return 0;
+}
+
+int
+pma_set_durability(PMADurability durability) {
+  if (
+      (durability != PMA_DURABILITY_FULL) &&
+      (durability != PMA_DURABILITY_META_ASYNC) &&
+      (durability != PMA_DURABILITY_NONE)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  _pma_state->durability = durability;
+
+  return 0;
+}
+
+void
+pma_set_arena_reserve(uint64_t bytes) {
+  _pma_arena_reserve_size = bytes;
+}
+
+int
+pma_set_growth_policy(const PMAGrowthPolicy *policy) {
+  if ((policy->increment < PMA_PAGE_SIZE) || (policy->sparse && policy->background)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  _pma_state->growth_policy = *policy;
+
+  if (policy->background) return _pma_start_grower();
+
+  _pma_stop_grower();
+
+  return 0;
+}
+
+int
+pma_set_page_sums(int enable) {
+  // Checksums recorded before disabling would go stale as their dpages are
+  // reused, so they're discarded
+  if (!enable && (_pma_state->metadata->flags & PMA_FLAG_PAGE_SUMS)) {
+    if (_pma_wait_commit()) return -1;
+    if (ftruncate(_pma_state->page_sums_fd, 0)) return -1;
+  }
+
+  if (enable) {
+    _pma_state->metadata->flags |= PMA_FLAG_PAGE_SUMS;
+  } else {
+    _pma_state->metadata->flags &= ~PMA_FLAG_PAGE_SUMS;
+  }
+
+  return 0;
+}
+
+int
+pma_scrub(unsigned int num_threads) {
+  ScrubRange  *ranges = NULL;
+  pthread_t   *threads = NULL;
+  uint32_t    *sums = NULL;
+  struct stat  st;
+  uint64_t     num_entries;
+  uint64_t     num_sums;
+  uint64_t     num_bad = 0;
+  unsigned int num_started = 0;
+  int          err = 0;
+
+  if (!num_threads) num_threads = 1;
+
+  // Only pages committed by a finished sync have checksums
+  if (_pma_wait_commit()) return -1;
+
+  if (fstat(_pma_state->page_dir_fd, &st)) return -1;
+  num_entries = (st.st_size / sizeof(PageDirEntry));
+
+  if (fstat(_pma_state->page_sums_fd, &st)) return -1;
+  num_sums = (st.st_size / sizeof(uint32_t));
+  if (!num_sums) return 0;
+
+  sums = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, _pma_state->page_sums_fd, 0);
+  if (sums == MAP_FAILED) return -1;
+
+  ranges = (ScrubRange *)calloc(num_threads, sizeof(ScrubRange));
+  threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+  if ((ranges == NULL) || (threads == NULL)) {
+    err = errno;
+    goto scrub_done;
+  }
+
+  for (unsigned int i = 0; i < num_threads; ++i) {
+    ranges[i].start    = ((num_entries * i) / num_threads);
+    ranges[i].end      = ((num_entries * (i + 1)) / num_threads);
+    ranges[i].sums     = sums;
+    ranges[i].num_sums = num_sums;
+
+    err = pthread_create(&(threads[i]), NULL, _pma_scrub_range, &(ranges[i]));
+    if (err) break;
+
+    ++num_started;
+  }
+
+  for (unsigned int i = 0; i < num_started; ++i) {
+    pthread_join(threads[i], NULL);
+
+    num_bad += ranges[i].num_bad;
+    if (!err) err = ranges[i].err;
+  }
+
+  if (!err && num_bad) {
+    fprintf(stderr, "%lu pages failed checksum verification\n", num_bad);
+    err = EILSEQ;
+  }
+
+scrub_done:
+  munmap(sums, st.st_size);
+  free((void *)ranges);
+  free((void *)threads);
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
 //==============================================================================
 // PRIVATE FUNCTIONS
 //==============================================================================
@@ -1158,9 +2258,8 @@ sync_error:
 /**
  * Verify that the checksum of a metadata page is valid
  *
- * Corruption or malicious interference is rare, so we assume that the checksum
- * is correct and copy it into the global state in advance, then confirm its
- * correctness there.
+ * The checksum is computed using the algorithm recorded in the page itself, so
+ * that snapshots written before the current algorithm was adopted still load.
  *
  * @param meta_page  Pointer to a metadata page loaded from disk
  *
@@ -1168,26 +2267,68 @@ sync_error:
  */
 int
 _pma_verify_checksum(Metadata *meta_page) {
-  uint32_t checksum;
+  if (
+      (meta_page->checksum_type != PMA_CHECKSUM_CRC32) &&
+      (meta_page->checksum_type != PMA_CHECKSUM_CRC32C)) {
+    return 0;
+  }
 
-  // Copy metadata in advance of using it, since: 1) we expect the checksum to
-  // be valid; 2) we need to set the value of the checksum in the metadata to 0.
-  memcpy(
-      (void*)(&(_pma_state->metadata)),
-      (const void *)meta_page,
-      PMA_PAGE_SIZE);
+  return (_pma_checksum_metadata(meta_page) == meta_page->checksum);
+}
 
-  // Since we're computing the checksum on the object which itself includes the
-  // checksum, we treat the checksum as 0.
-  _pma_state->metadata->checksum = 0;
+/**
+ * Compute a checksum using the given algorithm
+ *
+ * @param checksum_type   ChecksumType to use
+ * @param data            Buffer to checksum
+ * @param num_bytes       Size of buffer in bytes
+ *
+ * @return  uint32_t  checksum
+ */
+uint32_t
+_pma_checksum(uint16_t checksum_type, const void *data, size_t num_bytes) {
+  if (checksum_type == PMA_CHECKSUM_CRC32) {
+    return crc_32((const unsigned char *)data, num_bytes);
+  }
 
-  // Compute checksum
-  checksum = crc_32(
-      (const unsigned char *)(&(_pma_state->metadata)),
-      PMA_PAGE_SIZE);
+  return crc32c(data, num_bytes);
+}
+
+/**
+ * Compute the checksum of a metadata page, using the algorithm recorded in it
+ *
+ * Since the page includes its own checksum, the checksum field is treated as 0.
+ * The page isn't modified, so this is safe to use on pages mapped read-only.
+ *
+ * @param metadata  Metadata page
+ *
+ * @return  uint32_t  checksum
+ */
+uint32_t
+_pma_checksum_metadata(const Metadata *metadata) {
+  const char     *bytes = (const char *)metadata;
+  const size_t    field = offsetof(Metadata, checksum);
+  const uint32_t  zero = 0;
+  uint32_t        checksum;
+
+  if (metadata->checksum_type == PMA_CHECKSUM_CRC32) {
+    // Legacy algorithm has no incremental interface over buffers
+    char page[PMA_PAGE_SIZE];
+
+    memcpy(page, bytes, PMA_PAGE_SIZE);
+    memcpy((page + field), &zero, sizeof(uint32_t));
 
-  // Compare checksums
-  return (checksum == _pma_state->metadata->checksum);
+    return crc_32((const unsigned char *)page, PMA_PAGE_SIZE);
+  }
+
+  checksum = crc32c(bytes, field);
+  checksum = crc32c_update(checksum, &zero, sizeof(uint32_t));
+  checksum = crc32c_update(
+      checksum,
+      (bytes + field + sizeof(uint32_t)),
+      (PMA_PAGE_SIZE - field - sizeof(uint32_t)));
+
+  return checksum;
 }
 
 /**
@@ -1210,22 +2351,24 @@ _pma_verify_checksum(Metadata *meta_page) {
  * @return  -1  failure; errno set to error code
  */
 int
-_pma_sync_dirty_pages(int fd, uint8_t num_dirty_pages, DirtyPageEntry *dirty_pages) {
-  PageStatus  cont_status;
-  uint64_t    init_offset;
-  uint64_t    index;
+_pma_sync_dirty_pages(int fd, uint64_t num_dirty_pages, DirtyPageEntry *dirty_pages) {
+  PageDirEntry  batch[PMA_DIR_BATCH_SIZE];
+  PageDirEntry *entry;
+  PageStatus    cont_status;
+  uint64_t      init_offset;
+  uint64_t      offset;
+  uint64_t      index;
+  uint64_t      batch_index = 0;
+  uint64_t      batch_size = 0;
 
-  for (uint8_t i = 0; i < num_dirty_pages; ++i) {
+  // Directory entries are built in memory and written out in runs of
+  // consecutive entries. Later dirty page entries for the same page overwrite
+  // earlier ones while they're still in the batch.
+  for (uint64_t i = 0; i < num_dirty_pages; ++i) {
     cont_status = (dirty_pages[i].status == FIRST) ? FOLLOW : dirty_pages[i].status;
     init_offset = dirty_pages[i].offset;
     index = dirty_pages[i].index;
 
-    if (_pma_write_page_status(fd, index, dirty_pages[i].status)) return -1;
-    // Offset of 0 is code for "leave it alone"
-    if (init_offset) {
-      if (_pma_write_page_offset(fd, index, init_offset)) return -1;
-    }
-
     // The offset on disk doesn't actually matter for the continuation pages of
     // a multi-page allocation, but it does matter for free page runs: just
     // because two page runs are contiguous in memory, it doesn't mean they are
@@ -1236,814 +2379,4652 @@ _pma_sync_dirty_pages(int fd, uint8_t num_dirty_pages, DirtyPageEntry *dirty_pag
     // could produce a situation where the two multi-page allocations are
     // adjacent in memory, but separated by one page on disk (because of
     // copy-on-write using a new dpage during the shared page allocation).
-    for (uint32_t j = 1; j < dirty_pages[i].num_pages; ++j) {
-      assert((dirty_pages[i].status == FIRST) || (cont_status == FREE));
+    //
+    // Runs of shared pages are the result of merging dirty page entries; see
+    // _pma_mark_page_dirty.
+    assert((dirty_pages[i].num_pages == 1) || (dirty_pages[i].status == FIRST) || (cont_status == FREE) || (cont_status == SHARED));
+
+    for (uint64_t j = 0; j < dirty_pages[i].num_pages; ++j) {
+      uint64_t page = index + j;
+
+      // Write out the current batch if this page isn't in it and can't be
+      // appended to it
+      if (
+          (page < batch_index) ||
+          (page > (batch_index + batch_size)) ||
+          ((page == (batch_index + batch_size)) && (batch_size == PMA_DIR_BATCH_SIZE))) {
+        if (_pma_write_page_entries(fd, batch_index, batch_size, batch)) return -1;
+
+        batch_index = page;
+        batch_size = 0;
+      }
 
-      if (_pma_write_page_status(fd, (index + j), cont_status)) return -1;
-      // Offset of 0 is code for "leave it alone"
-      if (init_offset) {
-        if (_pma_write_page_offset(fd, index, (init_offset + (j * PMA_PAGE_SIZE)))) return -1;
+      entry = batch + (page - batch_index);
+      if (page == (batch_index + batch_size)) {
+        ++batch_size;
+
+        // Offset of 0 is code for "leave it alone"
+        *entry = init_offset ? 0 : _pma_state->page_directory.entries[page];
       }
+
+      offset = init_offset ? (init_offset + (j * PMA_PAGE_SIZE)) : ENTRY_OFFSET(*entry);
+      *entry = DIR_ENTRY(offset, (j ? cont_status : dirty_pages[i].status));
     }
   }
 
-  return 0;
+  return _pma_write_page_entries(fd, batch_index, batch_size, batch);
 }
 
 /**
- * Update page status of entry in page directory
+ * Flush dirty pages to disk and make them read-only again
  *
- * @param fd      Page directory file descriptor
- * @param index   Directory index of entry
- * @param status  Page status
+ * The entries of both the metadata dirty page list and the overflow journal are
+ * sorted by address, so that adjacent and overlapping entries can be handled
+ * with a single msync and a single mprotect. Pages which are FREE don't need to
+ * be written back, but still need to be made read-only.
+ *
+ * @param flags   msync flags (MS_SYNC or MS_ASYNC), or 0 to skip writeback and
+ *                only make the pages read-only
  *
  * @return  0   success
  * @return  -1  failure; errno set to error code
  */
 int
-_pma_write_page_status(int fd, uint64_t index, PageStatus status) {
-  ssize_t bytes_out;
+_pma_msync_dirty_pages(int flags) {
+  DirtyPageEntry *dirty_pages;
+  uint64_t        num_meta_pages = _pma_state->metadata->num_dirty_pages;
+  uint64_t        num_dirty_pages = (num_meta_pages + _pma_state->num_journal_pages);
+  uint64_t        sync_start = 0;
+  uint64_t        sync_end = 0;
+  uint64_t        protect_start = 0;
+  uint64_t        protect_end = 0;
 
-  do {
-    bytes_out = pwrite(
-        fd,
-        (const void *)&status,
-        sizeof(PageStatus),
-        ((index * sizeof(PageDirEntry)) + sizeof(uint64_t)));
-  } while (!bytes_out);
+  if (!num_dirty_pages) return 0;
 
-  if (bytes_out == -1) {
-    return -1;
+  dirty_pages = (DirtyPageEntry *)malloc(num_dirty_pages * sizeof(DirtyPageEntry));
+  if (dirty_pages == NULL) return -1;
+
+  memcpy(dirty_pages, _pma_state->metadata->dirty_pages, (num_meta_pages * sizeof(DirtyPageEntry)));
+  memcpy(
+      (dirty_pages + num_meta_pages),
+      _pma_state->journal_pages,
+      (_pma_state->num_journal_pages * sizeof(DirtyPageEntry)));
+
+  qsort(dirty_pages, num_dirty_pages, sizeof(DirtyPageEntry), _pma_compare_dirty_pages);
+
+  // Ranges are tracked as [start, end) page indices; an empty range has
+  // start == end
+  for (uint64_t i = 0; i < num_dirty_pages; ++i) {
+    uint64_t start = dirty_pages[i].index;
+    uint64_t end = start + dirty_pages[i].num_pages;
+
+    // Clear dirty bit for shared pages
+    if (dirty_pages[i].status == SHARED) {
+      for (uint64_t j = start; j < end; ++j) {
+        ((SharedPageHeader*)INDEX_TO_PTR(j))->dirty = 0;
+      }
+    }
+
+    if ((protect_end > protect_start) && (start <= protect_end)) {
+      if (end > protect_end) protect_end = end;
+    } else {
+      if (protect_end > protect_start) {
+        if (mprotect(INDEX_TO_PTR(protect_start), ((protect_end - protect_start) * PMA_PAGE_SIZE), PROT_READ)) goto msync_error;
+      }
+
+      protect_start = start;
+      protect_end = end;
+    }
+
+    if (dirty_pages[i].status == FREE) continue;
+
+    if ((sync_end > sync_start) && (start <= sync_end)) {
+      if (end > sync_end) sync_end = end;
+    } else {
+      if (sync_end > sync_start) {
+        if (flags && msync(INDEX_TO_PTR(sync_start), ((sync_end - sync_start) * PMA_PAGE_SIZE), flags)) goto msync_error;
+      }
+
+      sync_start = start;
+      sync_end = end;
+    }
   }
 
+  if (sync_end > sync_start) {
+    if (flags && msync(INDEX_TO_PTR(sync_start), ((sync_end - sync_start) * PMA_PAGE_SIZE), flags)) goto msync_error;
+  }
+
+  if (protect_end > protect_start) {
+    if (mprotect(INDEX_TO_PTR(protect_start), ((protect_end - protect_start) * PMA_PAGE_SIZE), PROT_READ)) goto msync_error;
+  }
+
+  free((void *)dirty_pages);
+
   return 0;
+
+msync_error:
+  free((void *)dirty_pages);
+
+  return -1;
 }
 
 /**
- * Update page offset of entry in page directory
+ * Order dirty page entries by address
+ *
+ * @param a   First DirtyPageEntry
+ * @param b   Second DirtyPageEntry
+ *
+ * @return  <0  a comes before b
+ * @return  0   a and b start at the same address
+ * @return  >0  a comes after b
+ */
+int
+_pma_compare_dirty_pages(const void *a, const void *b) {
+  uint64_t a_index = ((const DirtyPageEntry *)a)->index;
+  uint64_t b_index = ((const DirtyPageEntry *)b)->index;
+
+  return (a_index > b_index) - (a_index < b_index);
+}
+
+/**
+ * Write the overflow dirty page entries, metadata, and page directory updates
+ * of a sync to disk, one step at a time
+ *
+ * The dirty pages themselves have already been flushed, unless the commit mode
+ * is PMA_COMMIT_GROUP. Flushes are skipped according to the durability level.
+ * The page directory is a separate file, so it's flushed on its own before the
+ * metadata, but only if the previous sync wrote to it.
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_commit_sync(void) {
+  PMADurability durability = _pma_state->durability;
+  ssize_t       bytes_out;
+
+  // Sync overflow dirty page entries; must be durable before the metadata
+  // which references them
+  if (_pma_write_journal(_pma_state->metadata, _pma_state->num_journal_pages, _pma_state->journal_pages)) {
+    return -1;
+  }
+
+  // Compute checksum
+  _pma_state->metadata->checksum = _pma_checksum_metadata(_pma_state->metadata);
+
+  // Dirty pages must be durable before the metadata which commits them
+  if ((_pma_state->commit_mode == PMA_COMMIT_GROUP) && (durability != PMA_DURABILITY_NONE)) {
+    if (fdatasync(_pma_state->snapshot_fd)) return -1;
+  }
+
+  // As must their checksums
+  if ((_pma_state->metadata->flags & PMA_FLAG_PAGE_SUMS) && (durability != PMA_DURABILITY_NONE)) {
+    if (fdatasync(_pma_state->page_sums_fd)) return -1;
+  }
+
+  // The page directory updates of the previous sync must be durable before the
+  // metadata which replaces it, since they won't be replayed on load anymore
+  if ((durability != PMA_DURABILITY_NONE) && _pma_state->dir_unflushed) {
+    if (fdatasync(_pma_state->page_dir_fd)) return -1;
+    _pma_state->dir_unflushed = 0;
+  }
+
+  // Sync metadata
+  bytes_out = pwrite(
+      _pma_state->snapshot_fd,
+      (const void *)(_pma_state->metadata),
+      PMA_PAGE_SIZE,
+      _pma_state->meta_page_offset);
+  if (bytes_out != PMA_PAGE_SIZE) return -1;
+
+  if (durability == PMA_DURABILITY_FULL) {
+    if (fdatasync(_pma_state->snapshot_fd)) return -1;
+  }
+
+  _pma_state->meta_page_offset = _pma_state->meta_page_offset ? 0 : PMA_PAGE_SIZE;
+
+  // Sync dirty pages in page directory
+  if (_pma_state->metadata->num_dirty_pages || _pma_state->num_journal_pages) {
+    _pma_state->dir_unflushed = 1;
+  }
+  if (_pma_sync_dirty_pages(
+      _pma_state->page_dir_fd,
+      _pma_state->metadata->num_dirty_pages,
+      _pma_state->metadata->dirty_pages)) {
+    return -1;
+  }
+
+  return _pma_sync_dirty_pages(_pma_state->page_dir_fd, _pma_state->num_journal_pages, _pma_state->journal_pages);
+}
+
+/**
+ * Write the overflow dirty page entries to the journal file
+ *
+ * Dirty page entries which don't fit into the metadata page are written to the
+ * journal file. The metadata records where they were written, how many there
+ * are, and their checksum, so that they can be replayed along with the dirty
+ * page entries in the metadata page when loading the PMA. See
+ * _pma_get_journal_offset for where they are written.
+ *
+ * @param metadata          Metadata which will reference the entries; updated
+ *                          with their location
+ * @param num_journal_pages Number of overflow dirty page entries
+ * @param journal_pages     Overflow dirty page entries as array
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_write_journal(Metadata *metadata, uint64_t num_journal_pages, DirtyPageEntry *journal_pages) {
+  uint64_t  journal_offset;
+  uint64_t  bytes = (num_journal_pages * sizeof(DirtyPageEntry));
+  uint64_t  bytes_written = 0;
+  ssize_t   bytes_out;
+
+  journal_offset = _pma_get_journal_offset(metadata, num_journal_pages);
+
+  // The metadata page being written replaces the older page, so the most
+  // recently synced metadata becomes the older page
+  _pma_state->older_journal_offset  = metadata->journal_offset;
+  _pma_state->older_journal_entries = metadata->journal_entries;
+
+  if (!num_journal_pages) {
+    metadata->journal_offset   = 0;
+    metadata->journal_entries  = 0;
+    metadata->journal_checksum = 0;
+
+    return 0;
+  }
+
+  while (bytes_written < bytes) {
+    bytes_out = pwrite(
+        _pma_state->journal_fd,
+        ((const char *)journal_pages + bytes_written),
+        (bytes - bytes_written),
+        (journal_offset + bytes_written));
+    if (bytes_out == -1) return -1;
+
+    bytes_written += bytes_out;
+  }
+
+  // Flushed regardless of durability level: metadata which references entries
+  // missing from the journal file can't be loaded at all
+  if (fdatasync(_pma_state->journal_fd)) return -1;
+
+  metadata->journal_offset   = journal_offset;
+  metadata->journal_entries  = num_journal_pages;
+  metadata->journal_checksum = _pma_checksum(metadata->checksum_type, journal_pages, bytes);
+
+  return 0;
+}
+
+/**
+ * Get the offset in the journal file at which to write the next overflow dirty
+ * page entries
+ *
+ * The entries referenced by either metadata page on disk mustn't be overwritten:
+ * those of the newer page until the new metadata has been written, and those of
+ * the older page in case the newer page turns out to be corrupt when loading.
+ * The new entries are written to the first gap in which they fit: at the start
+ * of the file, or directly after the entries of either page. This reuses the
+ * space of entries which are no longer referenced, so the journal file never
+ * grows beyond a few times the size of the largest set of entries.
+ *
+ * @param metadata    Most recently synced metadata
+ * @param num_entries Number of entries to write
+ *
+ * @return  offset of next entries in journal file
+ */
+uint64_t
+_pma_get_journal_offset(Metadata *metadata, uint64_t num_entries) {
+  uint64_t  starts[2];
+  uint64_t  ends[2];
+  uint64_t  bytes = (num_entries * sizeof(DirtyPageEntry));
+  uint64_t  offset = 0;
+  int       lower;
+
+  starts[0] = metadata->journal_offset;
+  ends[0]   = starts[0] + (metadata->journal_entries * sizeof(DirtyPageEntry));
+  starts[1] = _pma_state->older_journal_offset;
+  ends[1]   = starts[1] + (_pma_state->older_journal_entries * sizeof(DirtyPageEntry));
+
+  // The two sets of entries never overlap, so a single pass in order of offset
+  // skips past each set which is in the way
+  lower = (starts[1] < starts[0]);
+  for (int i = 0; i < 2; ++i) {
+    int j = (i ^ lower);
+
+    if ((starts[j] < ends[j]) && (offset < ends[j]) && (starts[j] < (offset + bytes))) {
+      offset = ends[j];
+    }
+  }
+
+  return offset;
+}
+
+/**
+ * Convert metadata written by PMA_DATA_VERSION 1 to the current layout
+ *
+ * Version 1 metadata has no overflow journal, and its checksum is always CRC-32.
+ * Its dirty page entries aren't copied, since they may not all fit in the
+ * current layout; pma_load replays them from the old metadata page instead.
+ *
+ * @param old_metadata  Metadata page as written by version 1
+ * @param metadata      Converted metadata
+ */
+void
+_pma_migrate_metadata(const MetadataV1 *old_metadata, Metadata *metadata) {
+  memset((void *)metadata, 0, PMA_PAGE_SIZE);
+
+  metadata->magic_code    = old_metadata->magic_code;
+  metadata->checksum      = old_metadata->checksum;
+  metadata->version       = (uint16_t)old_metadata->version;
+  metadata->checksum_type = PMA_CHECKSUM_CRC32;
+  metadata->epoch         = old_metadata->epoch;
+  metadata->event         = old_metadata->event;
+  metadata->arena_start   = old_metadata->arena_start;
+  metadata->arena_end     = old_metadata->arena_end;
+  metadata->dpage_cache   = (DPageCache *)old_metadata->dpage_cache;
+  metadata->snapshot_size = old_metadata->snapshot_size;
+  metadata->next_offset   = old_metadata->next_offset;
+
+  for (uint8_t i = 0; i < PMA_MAX_SHARED_SHIFT; ++i) {
+    metadata->shared_pages[i] = old_metadata->shared_pages[i];
+  }
+}
+
+/**
+ * Convert a page directory written by PMA_DATA_VERSION 1 to 8-byte entries
+ *
+ * The converted directory is written to a temporary file, which then replaces
+ * the old directory. The metadata records the new version on the next sync, so
+ * a crash in between leaves version 1 metadata with a converted directory. The
+ * first entry (the dpage cache) always has FIRST status, so a directory which
+ * has already been converted is recognized by the low bits of its first word.
+ *
+ * @param page_dir_fd Page directory file descriptor; replaced by the
+ *                    descriptor of the converted directory
+ * @param dir_path    Directory containing the backing files
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_migrate_page_dir(int *page_dir_fd, const char *dir_path) {
+  PageDirEntryV1  old_entries[PMA_DIR_BATCH_SIZE];
+  PageDirEntry    new_entries[PMA_DIR_BATCH_SIZE];
+  struct stat     st;
+  char           *filepath = NULL;
+  char           *tmp_filepath = NULL;
+  uint64_t        first_word;
+  uint64_t        num_entries;
+  uint64_t        index = 0;
+  ssize_t         bytes_in;
+  int             tmp_fd = -1;
+  int             dir_fd;
+
+  bytes_in = pread(*page_dir_fd, &first_word, sizeof(uint64_t), 0);
+  if (bytes_in == -1) return -1;
+  if (bytes_in != sizeof(uint64_t)) {
+    errno = EILSEQ;
+    return -1;
+  }
+
+  // Already converted
+  if (ENTRY_STATUS(first_word) == FIRST) return 0;
+
+  filepath = malloc(strlen(dir_path) + 1 + strlen(PMA_PAGE_DIR_FILENAME) + 1);
+  tmp_filepath = malloc(strlen(dir_path) + 1 + strlen(PMA_PAGE_DIR_TMP_FILENAME) + 1);
+  if ((filepath == NULL) || (tmp_filepath == NULL)) goto migrate_error;
+
+  sprintf(filepath, "%s/%s", dir_path, PMA_PAGE_DIR_FILENAME);
+  sprintf(tmp_filepath, "%s/%s", dir_path, PMA_PAGE_DIR_TMP_FILENAME);
+
+  if (fstat(*page_dir_fd, &st)) goto migrate_error;
+  num_entries = (st.st_size / sizeof(PageDirEntryV1));
+
+  // Same number of entries in half the space
+  tmp_fd = open(tmp_filepath, (PMA_FILE_FLAGS | O_TRUNC), PMA_FILE_PERMISSIONS);
+  if (tmp_fd == -1) goto migrate_error;
+  if (ftruncate(tmp_fd, (num_entries * sizeof(PageDirEntry)))) goto migrate_error;
+
+  while (index < num_entries) {
+    uint64_t  batch_size = num_entries - index;
+    uint64_t  bytes_read = 0;
+
+    if (batch_size > PMA_DIR_BATCH_SIZE) batch_size = PMA_DIR_BATCH_SIZE;
+
+    while (bytes_read < (batch_size * sizeof(PageDirEntryV1))) {
+      bytes_in = pread(
+          *page_dir_fd,
+          ((char *)old_entries + bytes_read),
+          ((batch_size * sizeof(PageDirEntryV1)) - bytes_read),
+          ((index * sizeof(PageDirEntryV1)) + bytes_read));
+      if (bytes_in <= 0) {
+        if (!bytes_in) errno = EILSEQ;
+        goto migrate_error;
+      }
+
+      bytes_read += bytes_in;
+    }
+
+    for (uint64_t i = 0; i < batch_size; ++i) {
+      if ((old_entries[i].offset & PMA_PAGE_MASK) || (old_entries[i].status > FOLLOW)) {
+        errno = EILSEQ;
+        goto migrate_error;
+      }
+
+      new_entries[i] = DIR_ENTRY(old_entries[i].offset, old_entries[i].status);
+    }
+
+    if (_pma_write_page_entries(tmp_fd, index, batch_size, new_entries)) goto migrate_error;
+
+    index += batch_size;
+  }
+
+  // Replace the old directory, and make sure the replacement is durable
+  if (fsync(tmp_fd)) goto migrate_error;
+  if (rename(tmp_filepath, filepath)) goto migrate_error;
+
+  dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+  if (dir_fd == -1) goto migrate_error;
+  if (fsync(dir_fd)) {
+    close(dir_fd);
+    goto migrate_error;
+  }
+  close(dir_fd);
+
+  close(*page_dir_fd);
+  *page_dir_fd = tmp_fd;
+
+  free((void *)filepath);
+  free((void *)tmp_filepath);
+
+  return 0;
+
+migrate_error:
+  if (tmp_fd != -1) close(tmp_fd);
+  free((void *)filepath);
+  free((void *)tmp_filepath);
+
+  return -1;
+}
+
+/**
+ * Sync updates from the overflow journal to the page directory
+ *
+ * Counterpart to _pma_write_journal. Like the dirty page cache in the metadata
+ * page, applying the journal to the page directory is idempotent.
+ *
+ * @param journal_fd  Overflow journal file descriptor
+ * @param page_dir_fd Page directory file descriptor
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_replay_journal(int journal_fd, int page_dir_fd) {
+  DirtyPageEntry *journal_pages;
+  uint64_t        bytes = (_pma_state->metadata->journal_entries * sizeof(DirtyPageEntry));
+  uint64_t        bytes_read = 0;
+  ssize_t         bytes_in;
+  int             err;
+
+  if (!_pma_state->metadata->journal_entries) return 0;
+
+  journal_pages = (DirtyPageEntry *)malloc(bytes);
+  if (journal_pages == NULL) return -1;
+
+  while (bytes_read < bytes) {
+    bytes_in = pread(
+        journal_fd,
+        ((char *)journal_pages + bytes_read),
+        (bytes - bytes_read),
+        (_pma_state->metadata->journal_offset + bytes_read));
+    if (bytes_in <= 0) {
+      // Journal is shorter than the metadata claims
+      if (bytes_in == 0) errno = EILSEQ;
+      free((void *)journal_pages);
+      return -1;
+    }
+
+    bytes_read += bytes_in;
+  }
+
+  if (_pma_checksum(_pma_state->metadata->checksum_type, journal_pages, bytes) != _pma_state->metadata->journal_checksum) {
+    free((void *)journal_pages);
+    errno = EILSEQ;
+    return -1;
+  }
+
+  err = _pma_sync_dirty_pages(page_dir_fd, _pma_state->metadata->journal_entries, journal_pages);
+  free((void *)journal_pages);
+
+  return err;
+}
+
+/**
+ * Map the pages of the arena and rebuild the free page caches
+ *
+ * The page directory is split into chunks which are scanned by separate
+ * threads, each of which maps the pages of its chunk and builds its own free
+ * page caches and partial shared page caches; see _pma_load_chunk. The caches
+ * of the chunks are then joined, in the same order in which a single scan of
+ * the whole directory would have built them.
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_load_pages(void) {
+  LoadChunk         chunks[PMA_LOAD_MAX_THREADS];
+  pthread_t         threads[PMA_LOAD_MAX_THREADS];
+  PageRunCache     *free_page_runs = NULL;
+  PageRunCache    **free_page_runs_end = &free_page_runs;
+  uint64_t          num_entries = PTR_TO_INDEX(_pma_state->metadata->arena_end);
+  long              num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint64_t          num_chunks = ((num_entries + PMA_LOAD_CHUNK_SIZE - 1) / PMA_LOAD_CHUNK_SIZE);
+  uint64_t          num_started = 0;
+  int               err = 0;
+
+  if (num_cpus < 1) num_cpus = 1;
+  if (num_chunks > (uint64_t)num_cpus) num_chunks = num_cpus;
+  if (num_chunks > PMA_LOAD_MAX_THREADS) num_chunks = PMA_LOAD_MAX_THREADS;
+  if (!num_chunks) num_chunks = 1;
+
+  memset(chunks, 0, sizeof(chunks));
+  for (uint64_t i = 0; i < num_chunks; ++i) {
+    chunks[i].start = ((num_entries * i) / num_chunks);
+    chunks[i].end   = ((num_entries * (i + 1)) / num_chunks);
+    _pma_init_page_run_pools(chunks[i].page_run_pools);
+    chunks[i].seed = ((i + 1) * PMA_RUN_SEED);
+    _pma_init_node_pool(&(chunks[i].partial_page_pool), sizeof(PartialPageCache));
+  }
+
+  // The first chunk is scanned on this thread
+  for (uint64_t i = 1; i < num_chunks; ++i) {
+    err = pthread_create(&(threads[i]), NULL, _pma_load_chunk, &(chunks[i]));
+    if (err) break;
+
+    ++num_started;
+  }
+
+  if (!err) {
+    _pma_load_chunk(&(chunks[0]));
+  }
+
+  for (uint64_t i = 1; i <= num_started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (uint64_t i = 0; i < num_chunks; ++i) {
+    if (!err) err = chunks[i].err;
+
+    // Join free page caches and their pools; nodes are released along with
+    // the pools on error
+    for (uint8_t level = 0; level < PMA_RUN_LEVELS; ++level) {
+      _pma_merge_node_pool(&(_pma_state->page_run_pools[level]), &(chunks[i].page_run_pools[level]));
+    }
+    _pma_merge_node_pool(&(_pma_state->partial_page_pool), &(chunks[i].partial_page_pool));
+    if (chunks[i].free_page_runs) {
+      *free_page_runs_end = chunks[i].free_page_runs;
+      free_page_runs_end = chunks[i].free_page_runs_end;
+    }
+
+    // Partial shared page caches are in reverse address order, so the caches
+    // of each chunk go before those of the chunks preceding it
+    if (err) continue;
+    for (uint8_t bucket = 0; bucket < PMA_MAX_SHARED_SHIFT; ++bucket) {
+      if (chunks[i].partial_pages[bucket] == NULL) continue;
+
+      *(chunks[i].partial_pages_end[bucket]) = _pma_state->partial_pages[bucket];
+      _pma_state->partial_pages[bucket] = chunks[i].partial_pages[bucket];
+    }
+  }
+
+  // Index free page runs, in the order in which they were found
+  while (free_page_runs != NULL) {
+    PageRunCache *page_run = free_page_runs;
+
+    free_page_runs = RUN_NEXT(page_run, 0);
+    _pma_link_page_run(page_run);
+    _pma_insert_page_run(page_run);
+  }
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Scan a chunk of the page directory, mapping its pages and building free page
+ * caches for it
+ *
+ * Runs on a thread started by _pma_load_pages. Pages which are adjacent both in
+ * the arena and on disk are mapped all at once, regardless of their status.
+ * Shared pages are noted as they're found, and sorted into the partial shared
+ * page caches of the chunk once their headers are mapped.
+ *
+ * @param arg   LoadChunk to scan
+ *
+ * @return  NULL
+ */
+void *
+_pma_load_chunk(void *arg) {
+  LoadChunk    *chunk = (LoadChunk *)arg;
+  PageDirEntry *entries = _pma_state->page_directory.entries;
+  uint64_t      num_entries = PTR_TO_INDEX(_pma_state->metadata->arena_end);
+  uint64_t      index = chunk->start;
+
+  chunk->free_page_runs_end = &(chunk->free_page_runs);
+  for (uint8_t bucket = 0; bucket < PMA_MAX_SHARED_SHIFT; ++bucket) {
+    chunk->partial_pages_end[bucket] = &(chunk->partial_pages[bucket]);
+  }
+
+  // Skip the end of a run which started in the previous chunk
+  while ((index < chunk->end) && _pma_load_continues_run(index)) {
+    ++index;
+  }
+
+  while (index < chunk->end) {
+    uint64_t first = index;
+    uint64_t count = 1;
+
+    switch (ENTRY_STATUS(entries[index])) {
+      case UNALLOCATED:
+        ++index;
+        continue;
+
+      case FREE: {
+        PageRunCache *page_run;
+
+        // While pages have FREE status AND are contiguous on disk, scan forward
+        ++index;
+        while ((index < num_entries) && _pma_load_continues_run(index) && (ENTRY_STATUS(entries[index]) == FREE)) {
+          ++count;
+          ++index;
+        }
+
+        // Add to free page cache
+        page_run = _pma_alloc_page_run(chunk->page_run_pools, &(chunk->seed));
+        if (page_run == NULL) goto chunk_error;
+
+        RUN_NEXT(page_run, 0) = NULL;
+        page_run->page = INDEX_TO_PTR(first);
+        page_run->length = count;
+        *(chunk->free_page_runs_end) = page_run;
+        chunk->free_page_runs_end = &RUN_NEXT(page_run, 0);
+
+        break;
+      }
+
+      case SHARED: {
+        PartialPageCache *shared_page;
+
+        // Header can't be read until the page is mapped
+        shared_page = (PartialPageCache *)_pma_alloc_node(&(chunk->partial_page_pool));
+        if (shared_page == NULL) goto chunk_error;
+
+        shared_page->next = chunk->shared_pages;
+        shared_page->page = (SharedPageHeader *)INDEX_TO_PTR(first);
+        chunk->shared_pages = shared_page;
+        ++index;
+
+        break;
+      }
+
+      case FIRST:
+        // While pages have FOLLOW status, scan forward
+        ++index;
+        while ((index < num_entries) && (ENTRY_STATUS(entries[index]) == FOLLOW)) {
+          assert(ENTRY_OFFSET(entries[index]) == (ENTRY_OFFSET(entries[index - 1]) + PMA_PAGE_SIZE));
+
+          ++count;
+          ++index;
+        }
+
+        break;
+
+      case FOLLOW:
+        // FOLLOW pages should be passed over correctly by FIRST case
+      default:
+        fprintf(stderr, "Index %lu invalid\n", index);
+        chunk->err = EINVAL;
+        return NULL;
+    }
+
+    // Free pages are expected to be mapped, but read only, like all others
+    if (_pma_load_map_pages(chunk, first, count, ENTRY_OFFSET(entries[first]))) goto chunk_error;
+  }
+
+  if (_pma_load_map_pages(chunk, 0, 0, 0)) goto chunk_error;
+
+  // Add shared pages with free slots to the partial shared page caches
+  while (chunk->shared_pages != NULL) {
+    PartialPageCache *shared_page = chunk->shared_pages;
+    uint8_t           bucket = (shared_page->page->size - 1);
+
+    chunk->shared_pages = shared_page->next;
+    if (!shared_page->page->free) {
+      _pma_free_node(&(chunk->partial_page_pool), shared_page);
+      continue;
+    }
+
+    shared_page->next = NULL;
+    *(chunk->partial_pages_end[bucket]) = shared_page;
+    chunk->partial_pages_end[bucket] = &(shared_page->next);
+  }
+
+  return NULL;
+
+chunk_error:
+  chunk->err = errno;
+
+  return NULL;
+}
+
+/**
+ * Add pages to the pending mapping of a chunk, mapping the pending pages first
+ * if the new ones don't directly follow them in the arena and on disk
+ *
+ * @param chunk       LoadChunk being scanned
+ * @param index       Directory index of first page
+ * @param num_pages   Number of pages (0 to only map the pending pages)
+ * @param offset      Offset on disk of first page
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_load_map_pages(LoadChunk *chunk, uint64_t index, uint64_t num_pages, uint64_t offset) {
+  void *address;
+
+  if (
+      num_pages &&
+      chunk->map_pages &&
+      (index == (chunk->map_index + chunk->map_pages)) &&
+      (offset == (chunk->map_offset + (chunk->map_pages * PMA_PAGE_SIZE)))) {
+    chunk->map_pages += num_pages;
+
+    return 0;
+  }
+
+  if (chunk->map_pages) {
+    address = _pma_map_arena(
+        INDEX_TO_PTR(chunk->map_index),
+        (chunk->map_pages * PMA_PAGE_SIZE),
+        PROT_READ,
+        chunk->map_offset);
+    if (address == MAP_FAILED) return -1;
+  }
+
+  chunk->map_index  = index;
+  chunk->map_pages  = num_pages;
+  chunk->map_offset = offset;
+
+  return 0;
+}
+
+/**
+ * Check whether a page directory entry continues the run of the entry before
+ * it: either a FOLLOW page after a multi-page allocation, or a FREE page after
+ * another one which is directly before it on disk
  *
- * @param fd      Page directory file descriptor
  * @param index   Directory index of entry
- * @param offset  Page offset on disk
+ *
+ * @return  Boolean (as int) for whether entry continues a run
+ */
+int
+_pma_load_continues_run(uint64_t index) {
+  PageDirEntry *entries = _pma_state->page_directory.entries;
+
+  if (!index) return 0;
+
+  switch (ENTRY_STATUS(entries[index])) {
+    case FOLLOW:
+      return ((ENTRY_STATUS(entries[index - 1]) == FIRST) || (ENTRY_STATUS(entries[index - 1]) == FOLLOW));
+
+    case FREE:
+      return (
+          (ENTRY_STATUS(entries[index - 1]) == FREE) &&
+          (ENTRY_OFFSET(entries[index]) == (ENTRY_OFFSET(entries[index - 1]) + PMA_PAGE_SIZE)));
+
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Write the extent table
+ *
+ * The table holds the runs of pages which can each be mapped with a single
+ * mmap, followed by the nodes of the free page caches and the partial shared
+ * page caches, in list order. It's tagged with the epoch and event of the most
+ * recent sync, so that it's ignored by pma_load once a later sync has changed
+ * the page directory. Must be called after the final sync, with no sync in
+ * progress.
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_write_extents(void) {
+  ExtentHeader  header;
+  Extent       *extents = NULL;
+  Extent        extent;
+  PageDirEntry *entries = _pma_state->page_directory.entries;
+  uint64_t      num_entries = PTR_TO_INDEX(_pma_state->metadata->arena_end);
+  uint64_t      num_extents = 0;
+  uint64_t      capacity = 0;
+  uint64_t      bytes;
+  uint64_t      bytes_written = 0;
+  ssize_t       bytes_out;
+
+  memset(&extent, 0, sizeof(Extent));
+
+  // Mapped pages
+  extent.type = PMA_EXTENT_MAPPED;
+  for (uint64_t i = 0; i < num_entries; ++i) {
+    if (ENTRY_STATUS(entries[i]) == UNALLOCATED) continue;
+
+    if (
+        extent.num_pages &&
+        (i == (extent.index + extent.num_pages)) &&
+        (ENTRY_OFFSET(entries[i]) == (extent.offset + (extent.num_pages * PMA_PAGE_SIZE)))) {
+      ++extent.num_pages;
+      continue;
+    }
+
+    if (extent.num_pages) {
+      if (_pma_append_extent(&extents, &num_extents, &capacity, &extent)) goto extents_error;
+    }
+
+    extent.index = i;
+    extent.num_pages = 1;
+    extent.offset = ENTRY_OFFSET(entries[i]);
+  }
+  if (extent.num_pages) {
+    if (_pma_append_extent(&extents, &num_extents, &capacity, &extent)) goto extents_error;
+  }
+
+  // Free page cache, in address order
+  memset(&extent, 0, sizeof(Extent));
+  for (PageRunCache *node = _pma_state->free_page_runs.pages[0]; node != NULL; node = RUN_NEXT_PAGE(node, 0)) {
+    extent.type = (node->length == 1) ? PMA_EXTENT_FREE_PAGE : PMA_EXTENT_FREE_RUN;
+    extent.index = PTR_TO_INDEX(node->page);
+    extent.num_pages = node->length;
+    if (_pma_append_extent(&extents, &num_extents, &capacity, &extent)) goto extents_error;
+  }
+
+  // Partial shared page caches
+  extent.type = PMA_EXTENT_PARTIAL_PAGE;
+  extent.num_pages = 1;
+  for (uint32_t bucket = 0; bucket < PMA_MAX_SHARED_SHIFT; ++bucket) {
+    extent.bucket = bucket;
+    for (PartialPageCache *node = _pma_state->partial_pages[bucket]; node != NULL; node = node->next) {
+      extent.index = PTR_TO_INDEX(node->page);
+      if (_pma_append_extent(&extents, &num_extents, &capacity, &extent)) goto extents_error;
+    }
+  }
+
+  // Header
+  memset(&header, 0, sizeof(ExtentHeader));
+  header.magic_code  = PMA_MAGIC_CODE;
+  header.version     = PMA_DATA_VERSION;
+  header.epoch       = _pma_state->metadata->epoch;
+  header.event       = _pma_state->metadata->event;
+  header.num_extents = num_extents;
+
+  bytes = (num_extents * sizeof(Extent));
+  header.checksum = crc32c_update(crc32c(&header, sizeof(ExtentHeader)), extents, bytes);
+
+  if (ftruncate(_pma_state->extents_fd, 0)) goto extents_error;
+
+  bytes_out = pwrite(_pma_state->extents_fd, (const void *)&header, sizeof(ExtentHeader), 0);
+  if (bytes_out != sizeof(ExtentHeader)) goto extents_error;
+
+  while (bytes_written < bytes) {
+    bytes_out = pwrite(
+        _pma_state->extents_fd,
+        ((const char *)extents + bytes_written),
+        (bytes - bytes_written),
+        (sizeof(ExtentHeader) + bytes_written));
+    if (bytes_out == -1) goto extents_error;
+
+    bytes_written += bytes_out;
+  }
+
+  free((void *)extents);
+
+  return 0;
+
+extents_error:
+  free((void *)extents);
+
+  return -1;
+}
+
+/**
+ * Append an extent to a growable array of extents
+ *
+ * @param extents       Array of extents; reallocated as needed
+ * @param num_extents   Number of extents in array
+ * @param capacity      Number of extents which fit in array
+ * @param extent        Extent to append
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_append_extent(Extent **extents, uint64_t *num_extents, uint64_t *capacity, Extent *extent) {
+  if (*num_extents == *capacity) {
+    uint64_t  new_capacity = *capacity ? (2 * *capacity) : (PMA_PAGE_SIZE / sizeof(Extent));
+    Extent   *new_extents = (Extent *)realloc(*extents, (new_capacity * sizeof(Extent)));
+
+    if (new_extents == NULL) return -1;
+
+    *extents = new_extents;
+    *capacity = new_capacity;
+  }
+
+  (*extents)[(*num_extents)++] = *extent;
+
+  return 0;
+}
+
+/**
+ * Read the extent table, if it describes the loaded snapshot
+ *
+ * @param extents       Set to the extents of the table, or NULL if the table is
+ *                      missing, damaged, or describes a different snapshot;
+ *                      must be freed by the caller
+ * @param num_extents   Set to the number of extents
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_read_extents(Extent **extents, uint64_t *num_extents) {
+  ExtentHeader  header;
+  Extent       *buffer;
+  struct stat   st;
+  uint64_t      bytes;
+  uint64_t      bytes_read = 0;
+  uint32_t      checksum;
+  ssize_t       bytes_in;
+
+  *extents = NULL;
+  *num_extents = 0;
+
+  if (fstat(_pma_state->extents_fd, &st)) return -1;
+  if ((uint64_t)st.st_size < sizeof(ExtentHeader)) return 0;
+
+  bytes_in = pread(_pma_state->extents_fd, (void *)&header, sizeof(ExtentHeader), 0);
+  if (bytes_in == -1) return -1;
+
+  bytes = ((uint64_t)st.st_size - sizeof(ExtentHeader));
+  if (
+      (bytes_in != sizeof(ExtentHeader)) ||
+      (header.magic_code != PMA_MAGIC_CODE) ||
+      (header.version != PMA_DATA_VERSION) ||
+      (header.epoch != _pma_state->metadata->epoch) ||
+      (header.event != _pma_state->metadata->event) ||
+      (bytes != (header.num_extents * sizeof(Extent)))) {
+    return 0;
+  }
+
+  buffer = (Extent *)malloc(bytes ? bytes : sizeof(Extent));
+  if (buffer == NULL) return -1;
+
+  while (bytes_read < bytes) {
+    bytes_in = pread(
+        _pma_state->extents_fd,
+        ((char *)buffer + bytes_read),
+        (bytes - bytes_read),
+        (sizeof(ExtentHeader) + bytes_read));
+    if (bytes_in <= 0) {
+      free((void *)buffer);
+      return (bytes_in == -1) ? -1 : 0;
+    }
+
+    bytes_read += bytes_in;
+  }
+
+  checksum = header.checksum;
+  header.checksum = 0;
+  if (crc32c_update(crc32c(&header, sizeof(ExtentHeader)), buffer, bytes) != checksum) {
+    free((void *)buffer);
+    return 0;
+  }
+
+  *extents = buffer;
+  *num_extents = header.num_extents;
+
+  return 0;
+}
+
+/**
+ * Map pages and rebuild the free page caches and partial shared page caches
+ * from the extent table
+ *
+ * Counterpart to _pma_load_pages, in time proportional to the number of extents
+ * rather than the number of pages.
+ *
+ * @param extents       Extents of the table
+ * @param num_extents   Number of extents
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_load_extents(Extent *extents, uint64_t num_extents) {
+  PartialPageCache **partial_pages_end[PMA_MAX_SHARED_SHIFT];
+  void              *address;
+
+  for (uint8_t i = 0; i < PMA_MAX_SHARED_SHIFT; ++i) {
+    partial_pages_end[i] = &(_pma_state->partial_pages[i]);
+  }
+
+  for (uint64_t i = 0; i < num_extents; ++i) {
+    Extent *extent = (extents + i);
+
+    switch (extent->type) {
+      case PMA_EXTENT_MAPPED:
+        address = _pma_map_arena(
+            INDEX_TO_PTR(extent->index),
+            (extent->num_pages * PMA_PAGE_SIZE),
+            PROT_READ,
+            extent->offset);
+        if (address == MAP_FAILED) return -1;
+
+        break;
+
+      case PMA_EXTENT_FREE_PAGE:
+      case PMA_EXTENT_FREE_RUN:
+        if (!extent->num_pages) {
+          errno = EILSEQ;
+          return -1;
+        }
+
+        if (_pma_push_page_run(INDEX_TO_PTR(extent->index), extent->num_pages)) return -1;
+
+        break;
+
+
+      case PMA_EXTENT_PARTIAL_PAGE: {
+        PartialPageCache *partial_page;
+
+        if (extent->bucket >= PMA_MAX_SHARED_SHIFT) {
+          errno = EILSEQ;
+          return -1;
+        }
+
+        partial_page = (PartialPageCache *)_pma_alloc_node(&(_pma_state->partial_page_pool));
+        if (partial_page == NULL) return -1;
+
+        partial_page->next = NULL;
+        partial_page->page = (SharedPageHeader *)INDEX_TO_PTR(extent->index);
+        *(partial_pages_end[extent->bucket]) = partial_page;
+        partial_pages_end[extent->bucket] = &(partial_page->next);
+
+        break;
+      }
+
+      default:
+        errno = EILSEQ;
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Write a run of consecutive entries to the page directory
+ *
+ * @param fd          Page directory file descriptor
+ * @param index       Directory index of first entry
+ * @param num_entries Number of entries
+ * @param entries     Entries as array
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_write_page_entries(int fd, uint64_t index, uint64_t num_entries, PageDirEntry *entries) {
+  ssize_t bytes_out;
+  size_t  bytes = (num_entries * sizeof(PageDirEntry));
+  char   *buffer = (char *)entries;
+  off_t   offset = (index * sizeof(PageDirEntry));
+
+  while (bytes) {
+    bytes_out = pwrite(fd, (const void *)buffer, bytes, offset);
+    if (bytes_out == -1) {
+      return -1;
+    }
+
+    buffer += bytes_out;
+    offset += bytes_out;
+    bytes -= bytes_out;
+  }
+
+  return 0;
+}
+
+/**
+ * Record the checksums of the dpages written by a sync
+ *
+ * Checksums are stored in a file parallel to the snapshot file, one per dpage,
+ * so that a checksum stays valid for as long as its dpage is part of a
+ * snapshot: a dpage which has been synced is never modified in place. Dpages
+ * without a recorded checksum read as 0, so a dpage whose checksum happens to
+ * be 0 isn't verified. Must be called after the dirty pages have been made
+ * read-only, and before they can be copied-on-write.
+ *
+ * @param num_dirty_pages   Size of dirty page cache
+ * @param dirty_pages       Dirty page cache as array
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_write_page_sums(uint64_t num_dirty_pages, DirtyPageEntry *dirty_pages) {
+  uint32_t batch[PMA_DIR_BATCH_SIZE];
+  uint64_t batch_dpage = 0;
+  uint64_t batch_size = 0;
+
+  for (uint64_t i = 0; i < num_dirty_pages; ++i) {
+    if (dirty_pages[i].status == FREE) continue;
+
+    for (uint64_t j = 0; j < dirty_pages[i].num_pages; ++j) {
+      uint64_t page = (dirty_pages[i].index + j);
+      uint64_t offset;
+      uint64_t dpage;
+
+      // Offset of 0 is code for "leave it alone"
+      if (dirty_pages[i].offset) {
+        offset = (dirty_pages[i].offset + (j * PMA_PAGE_SIZE));
+      } else {
+        offset = ENTRY_OFFSET(_pma_get_page_entry(page));
+      }
+      dpage = (offset >> PMA_PAGE_SHIFT);
+
+      // Checksums are written out in runs of consecutive dpages
+      if ((dpage != (batch_dpage + batch_size)) || (batch_size == PMA_DIR_BATCH_SIZE)) {
+        if (_pma_write_page_sums_run(batch_dpage, batch_size, batch)) return -1;
+
+        batch_dpage = dpage;
+        batch_size = 0;
+      }
+
+      batch[batch_size++] = crc32c(INDEX_TO_PTR(page), PMA_PAGE_SIZE);
+    }
+  }
+
+  return _pma_write_page_sums_run(batch_dpage, batch_size, batch);
+}
+
+/**
+ * Write the checksums of a run of consecutive dpages
+ *
+ * @param dpage     Index of first dpage in snapshot file
+ * @param num_sums  Number of checksums
+ * @param sums      Checksums as array
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_write_page_sums_run(uint64_t dpage, uint64_t num_sums, uint32_t *sums) {
+  ssize_t bytes_out;
+  size_t  bytes = (num_sums * sizeof(uint32_t));
+  char   *buffer = (char *)sums;
+  off_t   offset = (dpage * sizeof(uint32_t));
+
+  while (bytes) {
+    bytes_out = pwrite(_pma_state->page_sums_fd, (const void *)buffer, bytes, offset);
+    if (bytes_out == -1) {
+      return -1;
+    }
+
+    buffer += bytes_out;
+    offset += bytes_out;
+    bytes -= bytes_out;
+  }
+
+  return 0;
+}
+
+/**
+ * Verify the checksums of the pages in a range of the page directory
+ *
+ * Runs on a thread started by pma_scrub. Pages are read from the snapshot file
+ * rather than the arena, since pages modified since the last sync are mapped
+ * to dpages which don't have checksums yet.
+ *
+ * @param arg   ScrubRange to verify
+ *
+ * @return  NULL
+ */
+void *
+_pma_scrub_range(void *arg) {
+  ScrubRange *range = (ScrubRange *)arg;
+  char        page[PMA_PAGE_SIZE];
+
+  for (uint64_t i = range->start; i < range->end; ++i) {
+    PageDirEntry  entry = _pma_state->page_directory.entries[i];
+    uint64_t      dpage = (ENTRY_OFFSET(entry) >> PMA_PAGE_SHIFT);
+    uint64_t      bytes_read = 0;
+    ssize_t       bytes_in;
+
+    if ((ENTRY_STATUS(entry) != SHARED) && (ENTRY_STATUS(entry) != FIRST) && (ENTRY_STATUS(entry) != FOLLOW)) continue;
+    if ((dpage >= range->num_sums) || !range->sums[dpage]) continue;
+
+    while (bytes_read < PMA_PAGE_SIZE) {
+      bytes_in = pread(
+          _pma_state->snapshot_fd,
+          (page + bytes_read),
+          (PMA_PAGE_SIZE - bytes_read),
+          (ENTRY_OFFSET(entry) + bytes_read));
+      if (bytes_in <= 0) {
+        range->err = bytes_in ? errno : EILSEQ;
+        return NULL;
+      }
+
+      bytes_read += bytes_in;
+    }
+
+    if (crc32c(page, PMA_PAGE_SIZE) != range->sums[dpage]) {
+      fprintf(stderr, "Page %lu (dpage %lu) failed checksum verification\n", i, dpage);
+      ++(range->num_bad);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Add newly freed pages and page runs to the free page cache
+ *
+ * @param num_dirty_pages   Size of dirty page cache
+ * @param dirty_pages       Dirty page cache as array
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_update_free_pages(uint64_t num_dirty_pages, DirtyPageEntry *dirty_pages) {
+  for (uint64_t i = 0; i < num_dirty_pages; ++i) {
+    if (dirty_pages[i].status != FREE) continue;
+
+    if (_pma_coalesce_page_run(INDEX_TO_PTR(dirty_pages[i].index), dirty_pages[i].num_pages)) return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Add a free page run to the free page run cache
+ *
+ * @param page    Pointer to start of page run
+ * @param length  Number of pages in run
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_push_page_run(void *page, uint64_t length) {
+  PageRunCache *page_run = _pma_alloc_page_run(_pma_state->page_run_pools, &(_pma_state->free_page_runs.seed));
+  if (page_run == NULL) return -1;
+
+  page_run->page = page;
+  page_run->length = length;
+  _pma_link_page_run(page_run);
+  _pma_insert_page_run(page_run);
+
+  return 0;
+}
+
+/**
+ * Add a newly freed page run to the free page run cache, merging it with the
+ * cached runs before and after it
+ *
+ * Runs are only merged if they're adjacent both in memory and on disk. The
+ * freed pages must already be marked FREE in the page directory, so that their
+ * offsets on disk are current.
+ *
+ * @param page    Pointer to start of page run
+ * @param length  Number of pages in run
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_coalesce_page_run(void *page, uint64_t length) {
+  PageDirEntry   *entries = _pma_state->page_directory.entries;
+  PageRunCache  **links[PMA_RUN_LEVELS];
+  PageRunCache   *prev_run;
+  PageRunCache   *next_run;
+  uint64_t        first = PTR_TO_INDEX(page);
+  uint64_t        last = (first + length - 1);
+
+  // Runs before and after the freed run in address order
+  prev_run = _pma_find_page_run_address_links(page, links);
+  next_run = *(links[0]);
+
+  // Only merge with runs which are adjacent both in memory and on disk
+  if (
+      (prev_run != NULL) &&
+      ((((char *)prev_run->page + (prev_run->length * PMA_PAGE_SIZE)) != page) ||
+       ((ENTRY_OFFSET(entries[first - 1]) + PMA_PAGE_SIZE) != ENTRY_OFFSET(entries[first])))) {
+    prev_run = NULL;
+  }
+  if (
+      (next_run != NULL) &&
+      ((next_run->page != ((char *)page + (length * PMA_PAGE_SIZE))) ||
+       ((ENTRY_OFFSET(entries[last]) + PMA_PAGE_SIZE) != ENTRY_OFFSET(entries[last + 1])))) {
+    next_run = NULL;
+  }
+
+  // Extend the run before, absorbing the run after if it's also adjacent
+  if (prev_run != NULL) {
+    _pma_remove_page_run(prev_run);
+    prev_run->length += length;
+
+    if (next_run != NULL) {
+      _pma_remove_page_run(next_run);
+      _pma_unlink_page_run(next_run);
+      prev_run->length += next_run->length;
+      _pma_free_page_run(_pma_state->page_run_pools, next_run);
+    }
+
+    _pma_insert_page_run(prev_run);
+
+  // Extend the run after downwards; its position in address order is unchanged
+  } else if (next_run != NULL) {
+    _pma_remove_page_run(next_run);
+    next_run->page = page;
+    next_run->length += length;
+    _pma_insert_page_run(next_run);
+
+  } else {
+    return _pma_push_page_run(page, length);
+  }
+
+  return 0;
+}
+
+/**
+ * Allocate a node for the free page run index, with a random number of skip
+ * list levels
+ *
+ * Each level above the first is given with probability 1/4. The node keeps its
+ * levels, in both the address order and the bins, until it's freed.
+ *
+ * @param pools   Pools of nodes, by height
+ * @param seed    State of generator for skip list levels
+ *
+ * @return  NULL            failure; errno set to error code
+ * @return  PageRunCache*   node, with num_levels set
+ */
+PageRunCache *
+_pma_alloc_page_run(NodePool *pools, uint64_t *seed) {
+  PageRunCache *page_run;
+  uint64_t      random;
+  uint8_t       num_levels = 1;
+
+  // xorshift64
+  random = *seed ? *seed : PMA_RUN_SEED;
+  random ^= (random << 13);
+  random ^= (random >> 7);
+  random ^= (random << 17);
+  *seed = random;
+
+  while ((num_levels < PMA_RUN_LEVELS) && !(random & 3)) {
+    ++num_levels;
+    random >>= 2;
+  }
+
+  page_run = (PageRunCache *)_pma_alloc_node(&(pools[num_levels - 1]));
+  if (page_run == NULL) return NULL;
+
+  page_run->num_levels = num_levels;
+
+  return page_run;
+}
+
+/**
+ * Return a node of the free page run index to the pool of its height
+ *
+ * @param pools     Pools of nodes, by height
+ * @param page_run  Node to free
+ */
+void
+_pma_free_page_run(NodePool *pools, PageRunCache *page_run) {
+  _pma_free_node(&(pools[page_run->num_levels - 1]), page_run);
+}
+
+/**
+ * Initialize the pools of nodes of the free page run index, one per height
+ *
+ * @param pools   Array of PMA_RUN_LEVELS pools
+ */
+void
+_pma_init_page_run_pools(NodePool *pools) {
+  for (uint8_t level = 0; level < PMA_RUN_LEVELS; ++level) {
+    _pma_init_node_pool(&(pools[level]), (sizeof(PageRunCache) + (2 * (level + 1) * sizeof(PageRunCache *))));
+  }
+}
+
+/**
+ * Free the pools of nodes of the free page run index, and with them every node
+ *
+ * @param pools   Array of PMA_RUN_LEVELS pools
+ */
+void
+_pma_release_page_run_pools(NodePool *pools) {
+  for (uint8_t level = 0; level < PMA_RUN_LEVELS; ++level) {
+    _pma_release_node_pool(&(pools[level]));
+  }
+}
+
+/**
+ * Link a node into the address order of the free page run index
+ *
+ * @param page_run  Node of page run; page and levels must be set
+ */
+void
+_pma_link_page_run(PageRunCache *page_run) {
+  PageRunCache  **links[PMA_RUN_LEVELS];
+
+  _pma_find_page_run_address_links(page_run->page, links);
+  for (uint8_t level = 0; level < page_run->num_levels; ++level) {
+    RUN_NEXT_PAGE(page_run, level) = *(links[level]);
+    *(links[level]) = page_run;
+  }
+}
+
+/**
+ * Unlink a node from the address order of the free page run index
+ *
+ * The node must already have been removed from the bins.
+ *
+ * @param page_run  Node of page run
+ */
+void
+_pma_unlink_page_run(PageRunCache *page_run) {
+  PageRunCache  **links[PMA_RUN_LEVELS];
+
+  _pma_find_page_run_address_links(page_run->page, links);
+  assert(*(links[0]) == page_run);
+
+  for (uint8_t level = 0; level < page_run->num_levels; ++level) {
+    if (*(links[level]) == page_run) {
+      *(links[level]) = RUN_NEXT_PAGE(page_run, level);
+    }
+  }
+}
+
+/**
+ * Insert a node into the bins of the free page run index
+ *
+ * The node must already be linked in address order; see _pma_link_page_run.
+ *
+ * @param page_run  Node of page run; page, length, and levels must be set
+ */
+void
+_pma_insert_page_run(PageRunCache *page_run) {
+  PageRunIndex   *index = &(_pma_state->free_page_runs);
+  PageRunCache  **links[PMA_RUN_LEVELS];
+  uint8_t         bin = _pma_get_page_run_bin(page_run->length);
+
+  _pma_find_page_run_links(bin, page_run->length, page_run->page, links);
+  for (uint8_t level = 0; level < page_run->num_levels; ++level) {
+    RUN_NEXT(page_run, level) = *(links[level]);
+    *(links[level]) = page_run;
+  }
+
+  index->nonempty |= (1ULL << bin);
+}
+
+/**
+ * Unlink a node from the bins of the free page run index
+ *
+ * The node stays linked in address order, so it can be reinserted after its
+ * length changes, as long as its address doesn't move past another run.
+ *
+ * @param page_run  Node of page run
+ */
+void
+_pma_remove_page_run(PageRunCache *page_run) {
+  PageRunIndex   *index = &(_pma_state->free_page_runs);
+  PageRunCache  **links[PMA_RUN_LEVELS];
+  uint8_t         bin = _pma_get_page_run_bin(page_run->length);
+
+  _pma_find_page_run_links(bin, page_run->length, page_run->page, links);
+  assert(*(links[0]) == page_run);
+
+  for (uint8_t level = 0; level < page_run->num_levels; ++level) {
+    if (*(links[level]) == page_run) {
+      *(links[level]) = RUN_NEXT(page_run, level);
+    }
+  }
+
+  if (index->bins[bin][0] == NULL) {
+    index->nonempty &= ~(1ULL << bin);
+  }
+}
+
+/**
+ * Find the smallest free page run with at least the given number of pages, and
+ * remove it from the bins of the free page run index
+ *
+ * Of runs with the same length, the one with the lowest address is used. The
+ * run stays linked in address order.
+ *
+ * @param num_pages   Minimum number of pages in run
+ *
+ * @return  NULL            no run is long enough
+ * @return  PageRunCache*   node of page run
+ */
+PageRunCache *
+_pma_find_page_run(uint64_t num_pages) {
+  PageRunIndex   *index = &(_pma_state->free_page_runs);
+  PageRunCache  **links[PMA_RUN_LEVELS];
+  PageRunCache   *page_run;
+  uint8_t         bin = _pma_get_page_run_bin(num_pages);
+  uint64_t        later_bins;
+
+  // First run in the same bin which is long enough
+  if (index->nonempty & (1ULL << bin)) {
+    _pma_find_page_run_links(bin, num_pages, NULL, links);
+    if (*(links[0]) != NULL) {
+      page_run = *(links[0]);
+      _pma_remove_page_run(page_run);
+
+      return page_run;
+    }
+  }
+
+  // Otherwise, shortest run in the next non-empty bin
+  later_bins = (index->nonempty & ~((2ULL << bin) - 1));
+  if (!later_bins) return NULL;
+
+  page_run = index->bins[PMA_CTZ64(later_bins)][0];
+  _pma_remove_page_run(page_run);
+
+  return page_run;
+}
+
+/**
+ * Find the links in each level of the skip list of a bin which point to the
+ * first page run ordered at or after the given length and address
+ *
+ * @param bin     Bin of free page run index
+ * @param length  Length of run
+ * @param page    Address of run
+ * @param links   Filled with a pointer to the link in each level
+ */
+void
+_pma_find_page_run_links(uint8_t bin, uint64_t length, void *page, PageRunCache ***links) {
+  PageRunCache  *prev = NULL;
+  PageRunCache **link;
+
+  for (int level = (PMA_RUN_LEVELS - 1); level >= 0; --level) {
+    link = prev ? &RUN_NEXT(prev, level) : &(_pma_state->free_page_runs.bins[bin][level]);
+
+    while (
+        (*link != NULL) &&
+        (((*link)->length < length) || (((*link)->length == length) && ((*link)->page < page)))) {
+      prev = *link;
+      link = &RUN_NEXT(prev, level);
+    }
+
+    links[level] = link;
+  }
+}
+
+/**
+ * Find the links in each level of the address order skip list which point to
+ * the first page run at or after the given address
+ *
+ * @param page    Address of run
+ * @param links   Filled with a pointer to the link in each level
+ *
+ * @return  NULL            no run before the address
+ * @return  PageRunCache*   last page run before the address
+ */
+PageRunCache *
+_pma_find_page_run_address_links(void *page, PageRunCache ***links) {
+  PageRunCache  *prev = NULL;
+  PageRunCache **link;
+
+  for (int level = (PMA_RUN_LEVELS - 1); level >= 0; --level) {
+    link = prev ? &RUN_NEXT_PAGE(prev, level) : &(_pma_state->free_page_runs.pages[level]);
+
+    while ((*link != NULL) && ((*link)->page < page)) {
+      prev = *link;
+      link = &RUN_NEXT_PAGE(prev, level);
+    }
+
+    links[level] = link;
+  }
+
+  return prev;
+}
+
+/**
+ * Get the bin of the free page run index for a run length
+ *
+ * @param length  Number of pages in run (non-zero)
+ *
+ * @return  uint8_t   bin (index of highest set bit of length)
+ */
+uint8_t
+_pma_get_page_run_bin(uint64_t length) {
+#if defined(__GNUC__)
+  return (uint8_t)(63 - __builtin_clzll(length));
+#else
+  uint8_t bin = 0;
+
+  while (length >>= 1) {
+    ++bin;
+  }
+
+  return bin;
+#endif
+}
+
+/**
+ * Initialize an empty node pool
+ *
+ * @param pool        Pool to initialize
+ * @param node_size   Size of each node in bytes (at least the size of a pointer)
+ */
+void
+_pma_init_node_pool(NodePool *pool, size_t node_size) {
+  assert(node_size >= sizeof(FreeNode));
+
+  // Keep every node aligned like the block header
+  pool->node_size = ((node_size + sizeof(NodeBlock) - 1) & ~(sizeof(NodeBlock) - 1));
+  pool->free = NULL;
+  pool->blocks = NULL;
+  pool->fresh = NULL;
+  pool->fresh_end = NULL;
+}
+
+/**
+ * Allocate a node from a pool
+ *
+ * @param pool  Pool from which to allocate
+ *
+ * @return  NULL    failure; errno set to error code
+ * @return  void*   address of the node
+ */
+void *
+_pma_alloc_node(NodePool *pool) {
+  void *node;
+
+  // Reuse a freed node, if any
+  if (pool->free != NULL) {
+    node = pool->free;
+    pool->free = pool->free->next;
+
+    return node;
+  }
+
+  // Start a new block if the current one is used up
+  if ((size_t)(pool->fresh_end - pool->fresh) < pool->node_size) {
+    NodeBlock *block = (NodeBlock *)malloc(PMA_NODE_POOL_BLOCK_SIZE);
+    if (block == NULL) return NULL;
+
+    block->next = pool->blocks;
+    pool->blocks = block;
+    pool->fresh = (char *)(block + 1);
+    pool->fresh_end = ((char *)block + PMA_NODE_POOL_BLOCK_SIZE);
+  }
+
+  node = pool->fresh;
+  pool->fresh += pool->node_size;
+
+  return node;
+}
+
+/**
+ * Return a node to the pool from which it was allocated
+ *
+ * @param pool  Pool of node
+ * @param node  Node to free
+ */
+void
+_pma_free_node(NodePool *pool, void *node) {
+  FreeNode *free_node = (FreeNode *)node;
+
+  free_node->next = pool->free;
+  pool->free = free_node;
+}
+
+/**
+ * Move the blocks and unused nodes of a pool into another pool
+ *
+ * Nodes allocated from the other pool belong to the pool afterwards, and the
+ * other pool is left empty.
+ *
+ * @param pool    Pool which takes over the nodes (same node size as other)
+ * @param other   Pool to empty
+ */
+void
+_pma_merge_node_pool(NodePool *pool, NodePool *other) {
+  assert(pool->node_size == other->node_size);
+
+  // Splice block lists
+  if (other->blocks != NULL) {
+    NodeBlock *last_block = other->blocks;
+
+    while (last_block->next != NULL) {
+      last_block = last_block->next;
+    }
+    last_block->next = pool->blocks;
+    pool->blocks = other->blocks;
+  }
+
+  // Freed nodes and nodes never handed out by the other pool become freed nodes
+  // of the pool
+  while (other->free != NULL) {
+    FreeNode *free_node = other->free;
+
+    other->free = free_node->next;
+    _pma_free_node(pool, free_node);
+  }
+  while ((size_t)(other->fresh_end - other->fresh) >= other->node_size) {
+    _pma_free_node(pool, other->fresh);
+    other->fresh += other->node_size;
+  }
+
+  _pma_init_node_pool(other, other->node_size);
+}
+
+/**
+ * Free all blocks of a pool, and with them every node allocated from it
+ *
+ * @param pool  Pool to release
+ */
+void
+_pma_release_node_pool(NodePool *pool) {
+  while (pool->blocks != NULL) {
+    NodeBlock *block = pool->blocks;
+
+    pool->blocks = block->next;
+    free((void *)block);
+  }
+
+  pool->free = NULL;
+  pool->fresh = NULL;
+  pool->fresh_end = NULL;
+}
+
+/**
+ * Allocate memory within shared allocation pages.
+ *
+ * All allocations are of the same size and therefore go into the same bucket.
+ * As many slots as possible are reserved in each shared page before moving on
+ * to the next one.
+ *
+ * @param size    Size in bytes to allocate (must be <= 1/4 page)
+ * @param count   Number of allocations to make
+ * @param results Array of at least count elements; filled with the addresses
+ *                of the newly allocated memory
+ *
+ * @return  size_t  number of allocations made; if less than count, errno set
+ *                  to error code
+ */
+size_t
+_pma_malloc_bytes(size_t size, size_t count, void **results)
+{
+  SharedPageHeader *shared_page;
+  size_t            num_allocated = 0;
+  uint16_t          i, num_slots;
+  uint16_t          slots[PMA_BITMAP_SIZE * PMA_BITMAP_BITS];
+  uint8_t           bucket;
+
+  assert(size <= PMA_MAX_SHARED_ALLOC);
+
+  // Don't bother with anything less than the minimum allocation size
+  if (size < PMA_MIN_ALLOC_SIZE) {
+    size = PMA_MIN_ALLOC_SIZE;
+  }
+
+  // Find the right bucket
+  bucket = 0;
+  i = size - 1;
+  while (i >>= 1) bucket++;
+
+  while (num_allocated < count) {
+    // Make a new shared page if there are no shared pages with open slots
+    if (_pma_state->partial_pages[bucket] == NULL) {
+      if (_pma_malloc_shared_page(bucket)) {
+        return num_allocated;
+      }
+
+      shared_page = _pma_state->partial_pages[bucket]->page;
+
+    } else {
+      shared_page = _pma_select_partial_page(bucket);
+
+      if (_pma_copy_shared_page((void *)shared_page)) {
+        return num_allocated;
+      }
+    }
+
+    assert(shared_page->free);
+
+    // Reserve as many slots in this page as are still needed
+    num_slots = ((count - num_allocated) < shared_page->free) ? (count - num_allocated) : shared_page->free;
+    num_slots = _pma_reserve_slots(shared_page, num_slots, slots);
+
+    // Remove page from partial shared page cache once it's full
+    if (!shared_page->free) {
+      _pma_pop_partial_page(bucket);
+    }
+
+    // Return slots
+    for (i = 0; i < num_slots; ++i) {
+      results[num_allocated++] = (void *)(
+          (char *)shared_page +
+          (sizeof(SharedPageHeader)) +
+          ((uint64_t)slots[i] << shared_page->size));
+    }
+  }
+
+  return num_allocated;
+}
+
+/**
+ * Reserve free slots in a shared allocation page
+ *
+ * The bitmap is searched one 64-bit word at a time; the free slots within a
+ * word are found using count-trailing-zeros. When compiled with AVX2 support,
+ * the entire bitmap is first checked in a single register to skip straight to
+ * the first word with a free slot.
+ *
+ * @param shared_page Shared page in which to reserve slots (must be writeable)
+ * @param count       Number of slots to reserve (must be <= free slots in page)
+ * @param slots       Array of at least count elements; filled with the indices
+ *                    of the reserved slots
+ *
+ * @return  uint16_t  number of slots reserved
+ */
+uint16_t
+_pma_reserve_slots(SharedPageHeader *shared_page, uint16_t count, uint16_t *slots)
+{
+  uint64_t  word;
+  uint16_t  num_reserved = 0;
+  uint8_t   w = 0;
+
+  assert(count <= shared_page->free);
+
+#if defined(__AVX2__)
+  {
+    __m256i   bitmap;
+    uint32_t  full_bytes;
+
+    // Find the first byte of the bitmap with a free slot (1 = empty, 0 = full)
+    bitmap = _mm256_loadu_si256((const __m256i *)shared_page->bits);
+    full_bytes = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bitmap, _mm256_setzero_si256()));
+    if (~full_bytes) {
+      w = (__builtin_ctz(~full_bytes) / sizeof(uint64_t));
+    }
+  }
+#endif
+
+  for (; (w < PMA_BITMAP_WORDS) && (num_reserved < count); ++w) {
+    // The bitmap isn't 8-byte aligned within the header
+    memcpy(&word, (shared_page->bits + (w * sizeof(uint64_t))), sizeof(uint64_t));
+    word = le64toh(word);
+    if (!word) continue;
+
+    // Mark slots full, lowest first
+    while (word && (num_reserved < count)) {
+      slots[num_reserved++] = ((w * 64U) + PMA_CTZ64(word));
+      word &= (word - 1);
+    }
+
+    word = htole64(word);
+    memcpy((shared_page->bits + (w * sizeof(uint64_t))), &word, sizeof(uint64_t));
+  }
+
+  assert(num_reserved == count);
+
+  shared_page->free -= num_reserved;
+
+  return num_reserved;
+}
+
+/**
+ * Count trailing zero bits of a 64-bit word
+ *
+ * Portable fallback for compilers without a count-trailing-zeros builtin.
+ *
+ * @param word  Non-zero word
+ *
+ * @return  uint8_t   index of lowest set bit
+ */
+uint8_t
+_pma_ctz64(uint64_t word)
+{
+  uint8_t bit = 0;
+
+  assert(word);
+
+  while (!(word & 0xFFFFFFFFU)) {
+    word >>= 32;
+    bit += 32;
+  }
+  while (!(word & 1U)) {
+    word >>= 1;
+    ++bit;
+  }
+
+  return bit;
+}
+
+/**
+ * Allocate a new shared allocation page.
+ *
+ * @param bucket  Into which bucket in the shared allocation pages array the new
+ *                page will go (which also corresponds to the size of the slots
+ *                in the page)
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_malloc_shared_page(uint8_t bucket)
+{
+  SharedPageHeader *shared_page;
+  uint16_t          num_slots;
+
+  // Get a new writeable page
+  shared_page = (SharedPageHeader *)_pma_malloc_single_page(SHARED);
+  if (shared_page == NULL) {
+    return -1;
+  }
+
+  // Initialize header for shared page
+  shared_page->dirty = 1;
+  shared_page->size = (bucket + 1);
+  num_slots = PMA_SHARED_SLOTS(shared_page->size);
+  shared_page->free = num_slots;
+
+  // Only slots which actually fit in the page are marked empty in the bitmap
+  for (uint8_t i = 0; i < PMA_BITMAP_SIZE; ++i) {
+    if (num_slots >= PMA_BITMAP_BITS) {
+      shared_page->bits[i] = PMA_EMPTY_BITMAP;
+      num_slots -= PMA_BITMAP_BITS;
+    } else {
+      shared_page->bits[i] = ((1U << num_slots) - 1);
+      num_slots = 0;
+    }
+  }
+
+  // Add new shared page to top of stack
+  shared_page->next = _pma_state->metadata->shared_pages[bucket];
+  _pma_state->metadata->shared_pages[bucket] = shared_page;
+
+  // Add new shared page to partial shared page cache
+  if (_pma_push_partial_page(shared_page, bucket)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Add a shared page with free slots to the partial shared page cache
+ *
+ * @param shared_page Shared page with at least one free slot
+ * @param bucket      Bucket of the shared page (corresponds to size of slots)
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_push_partial_page(SharedPageHeader *shared_page, uint8_t bucket) {
+  PartialPageCache *partial_page;
+
+  partial_page = (PartialPageCache *)_pma_alloc_node(&(_pma_state->partial_page_pool));
+  if (partial_page == NULL) return -1;
+
+  partial_page->next = _pma_state->partial_pages[bucket];
+  partial_page->page = shared_page;
+  _pma_state->partial_pages[bucket] = partial_page;
+
+  return 0;
+}
+
+/**
+ * Remove the top page from the partial shared page cache
+ *
+ * @param bucket  Bucket from which to remove the top shared page
+ */
+void
+_pma_pop_partial_page(uint8_t bucket) {
+  PartialPageCache *partial_page = _pma_state->partial_pages[bucket];
+
+  assert(partial_page != NULL);
+
+  _pma_state->partial_pages[bucket] = partial_page->next;
+  _pma_free_node(&(_pma_state->partial_page_pool), partial_page);
+}
+
+/**
+ * Choose a page from the partial shared page cache in which to allocate
+ *
+ * Allocating in a page which hasn't been copied yet in the current event costs
+ * a copy-on-write: a new dpage, a page copy, an msync on commit, and an entry
+ * in the dirty page list. Therefore, pages which have already been copied are
+ * preferred. Failing that, the fullest clean page is chosen, so that emptier
+ * pages have a chance to drain and be released.
+ *
+ * Newly allocated pages, pages which were just chosen, and pages which were
+ * full until a slot was freed are all at the top of the cache, and are dirty.
+ * Therefore, the search is limited to the first PMA_AFFINITY_SCAN_LIMIT pages.
+ * The chosen page is moved to the top of the cache, so that following
+ * allocations find it immediately.
+ *
+ * @param bucket  Bucket from which to choose a page (must be non-empty)
+ *
+ * @return  SharedPageHeader*   shared page with free slots
+ */
+SharedPageHeader *
+_pma_select_partial_page(uint8_t bucket) {
+  PartialPageCache *partial_page = _pma_state->partial_pages[bucket];
+  PartialPageCache *prev_partial_page = partial_page;
+  PartialPageCache *best_page = partial_page;
+  PartialPageCache *prev_best_page = NULL;
+  uint16_t          num_scanned = 1;
+
+  assert(partial_page != NULL);
+
+  // Top page already copied
+  if (partial_page->page->dirty) {
+    return partial_page->page;
+  }
+
+  while (
+      ((partial_page = prev_partial_page->next) != NULL) &&
+      (num_scanned < PMA_AFFINITY_SCAN_LIMIT)) {
+    ++num_scanned;
+
+    if (partial_page->page->dirty) {
+      best_page = partial_page;
+      prev_best_page = prev_partial_page;
+      ++(_pma_state->stats.shared_copies_avoided);
+      break;
+
+    } else if (partial_page->page->free < best_page->page->free) {
+      best_page = partial_page;
+      prev_best_page = prev_partial_page;
+    }
+
+    prev_partial_page = partial_page;
+  }
+
+  // Move chosen page to top of cache
+  if (prev_best_page != NULL) {
+    prev_best_page->next = best_page->next;
+    best_page->next = _pma_state->partial_pages[bucket];
+    _pma_state->partial_pages[bucket] = best_page;
+  }
+
+  return best_page->page;
+}
+
+/**
+ * Release shared pages which were emptied since the last sync
+ *
+ * Pages which have been reused since they were emptied are left alone, as is
+ * the last PMA_SHARED_SPARE_PAGES non-full pages of each bucket. All other
+ * empty pages are removed from the shared page stack and from the partial
+ * shared page cache, and marked FREE. They're added to the free page cache once
+ * the sync completes, so that they can be reused by any bucket or by single
+ * page allocations.
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_release_empty_pages(void) {
+  PartialPageCache *empty_page;
+  PartialPageCache *partial_page;
+  PartialPageCache *prev_partial_page;
+  SharedPageHeader *shared_page;
+  uint64_t          num_partial_pages;
+  uint8_t           bucket;
+
+  while (_pma_state->empty_pages != NULL) {
+    empty_page = _pma_state->empty_pages;
+    shared_page = empty_page->page;
+    bucket = (shared_page->size - 1);
+
+    _pma_state->empty_pages = empty_page->next;
+    _pma_free_node(&(_pma_state->partial_page_pool), empty_page);
+
+    // Skip pages which have been reused since they were emptied
+    if (shared_page->free != PMA_SHARED_SLOTS(shared_page->size)) continue;
+
+    // Find page in partial shared page cache, and count non-full pages in the
+    // bucket while we're at it. A page may be listed as empty more than once,
+    // in which case it's no longer in the cache after the first time.
+    num_partial_pages = 0;
+    prev_partial_page = NULL;
+    partial_page = _pma_state->partial_pages[bucket];
+    while (partial_page != NULL) {
+      if (partial_page->page == shared_page) break;
+
+      ++num_partial_pages;
+      prev_partial_page = partial_page;
+      partial_page = partial_page->next;
+    }
+    if (partial_page == NULL) continue;
+
+    // Keep spare pages
+    if (num_partial_pages < PMA_SHARED_SPARE_PAGES) {
+      PartialPageCache *next_partial_page = partial_page->next;
+
+      while ((next_partial_page != NULL) && (num_partial_pages < PMA_SHARED_SPARE_PAGES)) {
+        ++num_partial_pages;
+        next_partial_page = next_partial_page->next;
+      }
+      if (num_partial_pages < PMA_SHARED_SPARE_PAGES) continue;
+    }
+
+    // Remove page from shared page stack
+    if (_pma_unlink_shared_page(shared_page, bucket)) return -1;
+
+    // Remove page from partial shared page cache
+    if (prev_partial_page == NULL) {
+      _pma_state->partial_pages[bucket] = partial_page->next;
+    } else {
+      prev_partial_page->next = partial_page->next;
+    }
+    _pma_free_node(&(_pma_state->partial_page_pool), partial_page);
+
+    // Mark page free
+    _pma_mark_page_dirty(PTR_TO_INDEX(shared_page), 0, FREE, 1);
+  }
+
+  return 0;
+}
+
+/**
+ * Remove a shared page from the shared page stack of its bucket
+ *
+ * The page which points to the removed page needs to be updated, and therefore
+ * copied, unless the removed page is at the top of the stack.
+ *
+ * @param shared_page Shared page to remove
+ * @param bucket      Bucket of the shared page
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_unlink_shared_page(SharedPageHeader *shared_page, uint8_t bucket) {
+  SharedPageHeader *prev_shared_page = _pma_state->metadata->shared_pages[bucket];
+
+  if (prev_shared_page == shared_page) {
+    _pma_state->metadata->shared_pages[bucket] = shared_page->next;
+    return 0;
+  }
+
+  while (prev_shared_page->next != shared_page) {
+    prev_shared_page = prev_shared_page->next;
+    assert(prev_shared_page != NULL);
+  }
+
+  // Copy-on-write
+  if (_pma_copy_shared_page((void *)prev_shared_page)) return -1;
+
+  prev_shared_page->next = shared_page->next;
+
+  return 0;
+}
+
+/**
+ * Allocate memory for a large object in one or more pages.
+ *
+ * @param size  Size in bytes to allocate (must be > 1/4 page)
+ *
+ * @return  NULL    failure; errno set to error code
+ * @return  void*   address of the newly allocated memory
+ */
+void *
+_pma_malloc_pages(size_t size)
+{
+  void     *address;
+  uint64_t  num_pages;
+
+  assert(size > PMA_MAX_SHARED_ALLOC);
+
+  // Round size up to nearest page boundary
+  size = PAGE_ROUND_UP(size);
+  num_pages = size >> PMA_PAGE_SHIFT;
+
+  if (num_pages == 1) {
+    address = _pma_malloc_single_page(FIRST);
+  } else {
+    address = _pma_malloc_multi_pages(num_pages);
+  }
+
+  return address;
+}
+
+/**
+ * Allocate a single new page
+ *
+ * Reuse pages from the free page cache, if any are available: a single free
+ * page if there is one, otherwise the first page of the shortest free run.
+ * These pages are used for shared allocations and for "large" allocations that
+ * are between 1/4 and 1 page in size: (0.25, 1].
+ *
+ * @param status  Page status after allocation (SHARED or FIRST)
+ *
+ * @return  NULL    failure; errno set to error code
+ * @return  void*   address of the newly allocated memory
+ */
+void *
+_pma_malloc_single_page(PageStatus status) {
+  void *address;
+
+  // Get an existing free page from cache, if available
+  address = _pma_get_cached_pages(1, status);
+  if (!address) {
+    // Otherwise, allocate a new page
+    address = _pma_get_new_page(status);
+  }
+
+  assert((((uint64_t)address) % PMA_PAGE_SIZE) == 0);
+
+  return address;
+}
+
+/**
+ * Allocate a contiguous block of multiple pages
+ *
+ * Reuse pages from the free page run cache, if any are available.
+ *
+ * @param num_pages   # pages to allocate
+ *
+ * @return  NULL    failure; errno set to error code
+ * @return  void*   address of the newly allocated memory
+ */
+void *
+_pma_malloc_multi_pages(uint64_t num_pages) {
+  void *address;
+
+  address = _pma_get_cached_pages(num_pages, FIRST);
+  if (!address) {
+    address = _pma_get_new_pages(num_pages);
+  }
+
+  return address;
+}
+
+/**
+ * Pull existing free pages from the free page run cache
+ *
+ * Uses the smallest page run that can accommodate the requested allocation
+ * (an exactly-sized run, if there is one), splitting it if necessary.
+ *
+ * @param num_pages   # pages to allocate
+ * @param status      Status of first page after allocation (SHARED or FIRST)
+ *
+ * @return  void*   address of the newly allocated memory (NULL if none available)
+ */
+void *
+_pma_get_cached_pages(uint64_t num_pages, PageStatus status) {
+  PageRunCache *valid_page_run;
+  void         *address = NULL;
+
+  // Find and remove the best-fitting run
+  valid_page_run = _pma_find_page_run(num_pages);
+
+  //  If run found...
+  if (valid_page_run != NULL) {
+    // Use it
+    address = valid_page_run->page;
+
+    // If run larger than necessary...
+    if (valid_page_run->length > num_pages) {
+      // Reduce it, and put it back in the bins under its new length; its
+      // position in address order is unchanged
+      valid_page_run->page += (num_pages * PMA_PAGE_SIZE);
+      valid_page_run->length -= num_pages;
+      _pma_insert_page_run(valid_page_run);
+
+    // Otherwise, use the whole run
+    } else {
+      _pma_unlink_page_run(valid_page_run);
+      _pma_free_page_run(_pma_state->page_run_pools, valid_page_run);
+    }
+
+    // Make pages writeable
+    mprotect(address, (num_pages * PMA_PAGE_SIZE), (PROT_READ | PROT_WRITE));
+
+    // Add pages to dirty list
+    _pma_mark_page_dirty(PTR_TO_INDEX(address), 0, status, num_pages);
+  }
+
+  return address;
+}
+
+/**
+ * Allocate a single new page
+ *
+ * Allocates a new page in virtual memory. May or may not use a new dpage.
+ *
+ * @param status  Page status after allocation (SHARED or FIRST)
+ *
+ * @return  NULL    failure; errno set to error code
+ * @return  void*   address of the newly allocated memory
+ */
+void *
+_pma_get_new_page(PageStatus status) {
+  void     *address;
+  uint64_t  offset;
+
+  // Make sure the page directory has an entry for the new page
+  if (_pma_state->page_directory.next_index >= _pma_state->page_directory.size) {
+    if (_pma_extend_page_dir(_pma_state->page_directory.next_index + 1)) return NULL;
+  }
+
+  // Get a dpage to which to map the address. Prefer one which continues the
+  // mapping of the previous page, so that the kernel can merge the two.
+  if ((_pma_state->end_offset == _pma_state->metadata->next_offset) &&
+      (_pma_state->metadata->dpage_cache->size <= PMA_LINEAR_CACHE_LIMIT)) {
+    offset = _pma_get_disk_dpage();
+  } else {
+    offset = _pma_take_cached_dpage(_pma_state->end_offset);
+    if (!offset) offset = _pma_get_single_dpage();
+  }
+  if (!offset) {
+    return NULL;
+  }
+
+  // Try to map next open memory address to dpage
+  address = _pma_map_arena(_pma_state->metadata->arena_end, PMA_PAGE_SIZE, (PROT_READ | PROT_WRITE), offset);
+  if (address == MAP_FAILED) {
+    address = _pma_state->metadata->arena_end;
+    WARNING("mmap failed");
+    abort();
+  }
+
+  assert(address == _pma_state->metadata->arena_end);
+
+  // Record PMA expansion
+  _pma_state->metadata->arena_end += PMA_PAGE_SIZE;
+  _pma_state->end_offset = (offset + PMA_PAGE_SIZE);
+  ++(_pma_state->page_directory.next_index);
+
+  // Add page to dirty list
+  _pma_mark_page_dirty(PTR_TO_INDEX(address), offset, status, 1);
+
+  return address;
+}
+
+/**
+ * Allocate multiple new pages
+ *
+ * Allocate 2 or more pages in virtual memory. Uses a run of free dpages from
+ * the dpage cache if one is long enough, otherwise new dpages.
+ *
+ * @param num_pages   # pages to allocate
+ *
+ * @return  NULL    failure; errno set to error code
+ * @return  void*   address of the newly allocated memory
+ */
+void *
+_pma_get_new_pages(uint64_t num_pages) {
+  void     *address;
+  uint64_t  bytes = (num_pages * PMA_PAGE_SIZE);
+  uint64_t  offset;
+  uint64_t  new_size;
+
+  // Make sure the page directory has entries for the new pages
+  if ((_pma_state->page_directory.next_index + num_pages) > _pma_state->page_directory.size) {
+    if (_pma_extend_page_dir(_pma_state->page_directory.next_index + num_pages)) return NULL;
+  }
+
+  // Get dpages contiguous on disk, so that the pages can be mapped at once.
+  // Prefer a run from the dpage cache.
+  offset = _pma_get_cached_dpages(num_pages);
+  if (!offset) {
+    // Otherwise, get new dpages. Extend snapshot backing file first, if
+    // necessary.
+    offset = _pma_state->metadata->next_offset;
+    new_size = (offset + bytes);
+    if (new_size >= _pma_state->metadata->snapshot_size) {
+      // Fail if snapshot file couldn't be extended
+      if (_pma_extend_snapshot_file(new_size)) return NULL;
+    }
+
+    // Update offset of next open dpage
+    _pma_state->metadata->next_offset += bytes;
+  }
+
+  // Try to map dpages to address
+  address = _pma_map_arena(_pma_state->metadata->arena_end, bytes, (PROT_READ | PROT_WRITE), offset);
+  if (address == MAP_FAILED) {
+    address = _pma_state->metadata->arena_end;
+    WARNING("mmap failed");
+    abort();
+  }
+
+  assert(address == _pma_state->metadata->arena_end);
+
+  // Record PMA expansion
+  _pma_state->metadata->arena_end += bytes;
+  _pma_state->end_offset = (offset + bytes);
+  _pma_state->page_directory.next_index += num_pages;
+
+  // Add allocated pages to dirty list
+  _pma_mark_page_dirty(PTR_TO_INDEX(address), offset, FIRST, num_pages);
+
+  return address;
+}
+
+/**
+ * Deallocate one or more pages of allocated memory
+ *
+ * @param address   Address of block to deallocated
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_free_pages(void *address) {
+  DirtyPageEntry *dirty_page;
+  uint64_t        index = PTR_TO_INDEX(address);
+  uint32_t        num_pages = 0;
+
+  if ((uint64_t)address & PMA_PAGE_MASK) {
+    WARNING("address does not point to the root of a page");
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (ENTRY_STATUS(_pma_get_page_entry(index)) == FIRST) {
+    // Count number of pages in allocation
+    do {
+      ++num_pages;
+    } while (ENTRY_STATUS(_pma_get_page_entry(index + num_pages)) == FOLLOW);
+
+  } else {
+    // Allocation was made since the last sync, so it's not in the page
+    // directory yet
+    dirty_page = _pma_find_dirty_page(index);
+
+    assert((dirty_page != NULL) && (dirty_page->index == index) && (dirty_page->status == FIRST));
+
+    num_pages = dirty_page->num_pages;
+  }
+
+  // Mark pages dirty
+  _pma_mark_page_dirty(index, 0, FREE, num_pages);
+
+  return 0;
+}
+
+/**
+ * Deallocate a block of memory in a shared allocation page.
+ *
+ * @param address   Address of block to deallocated
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_free_bytes(void *address) {
+  SharedPageHeader *header = (SharedPageHeader *)((uint64_t)address & (~PMA_PAGE_MASK));
+  uint8_t           slot = ((((uint64_t)address & PMA_PAGE_MASK) - sizeof(SharedPageHeader)) / (1 << header->size));
+  uint8_t           byte = slot / PMA_BITMAP_BITS;
+  uint8_t           bit = slot % PMA_BITMAP_BITS;
+
+  // Copy-on-write
+  _pma_copy_shared_page((void *)header);
+
+  if (header->bits[byte] & (1 << bit)) {
+    WARNING("bucketized address already free");
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Page is about to have a free slot again, so return it to the partial
+  // shared page cache
+  if (!header->free) {
+    if (_pma_push_partial_page(header, (header->size - 1))) return -1;
+  }
+
+  // Page is about to be empty, so it's a candidate for release on next sync
+  if ((header->free + 1U) == PMA_SHARED_SLOTS(header->size)) {
+    PartialPageCache *empty_page = (PartialPageCache *)_pma_alloc_node(&(_pma_state->partial_page_pool));
+    if (empty_page == NULL) return -1;
+
+    empty_page->next = _pma_state->empty_pages;
+    empty_page->page = header;
+    _pma_state->empty_pages = empty_page;
+  }
+
+  header->bits[byte] += (1 << bit);
+  ++header->free;
+
+  return 0;
+}
+
+/**
+ * Copy a shared allocation page
+ *
+ * @param address   Virtual memory address of shared allocation page
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_copy_shared_page(void *address) {
+  SharedPageHeader *shared_page;
+  uint64_t          offset;
+
+  // Check if page has already been copied
+  shared_page = (SharedPageHeader*)address;
+  if (shared_page->dirty) {
+    return 0;
+  }
+
+  offset = _pma_get_linear_dpage(PTR_TO_INDEX(address));
+  if (!offset) offset = _pma_get_single_dpage();
+  if (!offset) {
+    return -1;
+  }
+
+  // Make sure dpage cache is writeable
+  if (!_pma_state->metadata->dpage_cache->dirty) {
+    if (_pma_copy_dpage_cache()) {
+      WARNING("dpage cache copy failed");
+      abort();
+    }
+  }
+
+  // Copy page
+  _pma_copy_page(address, offset, SHARED, _pma_state->snapshot_fd);
+
+  // Mark page dirty so it isn't copied again
+  shared_page->dirty = 1;
+
+  ++(_pma_state->stats.shared_copies);
+
+  return 0;
+}
+
+/**
+ * Allocate a new dpage (disk page)
+ *
+ * Reuse a page from the free dpage cache, if any are available.
+ *
+ * @return  0         failure; errno set to error code
+ * @return  uint64_t  offset of new page in backing file
+ */
+uint64_t
+_pma_get_single_dpage(void) {
+  uint64_t offset;
+
+  // Get a cached dpage, if one is available
+  offset = _pma_get_cached_dpage();
+  if (!offset) {
+    // Otherwise, get a new dpage from disk
+    offset = _pma_get_disk_dpage();
+  }
+
+  assert((offset % PMA_PAGE_SIZE) == 0);
+
+  return offset;
+}
+
+/**
+ * Pull a free dpage from the dpage cache which is adjacent on disk to the dpage
+ * of a neighbouring page
+ *
+ * Mapping a page to such a dpage lets the kernel merge its mapping with the
+ * mapping of the neighbour, which keeps the number of VMAs in the arena low.
+ *
+ * @param index   Index of page which needs a new dpage
+ *
+ * @return  offset of new page in backing file (0 if none available)
+ */
+uint64_t
+_pma_get_linear_dpage(uint64_t index) {
+  PageDirEntry  entry;
+  uint64_t      offset;
+
+  if (index > 0) {
+    entry = _pma_get_page_entry(index - 1);
+    if (ENTRY_OFFSET(entry)) {
+      offset = _pma_take_cached_dpage(ENTRY_OFFSET(entry) + PMA_PAGE_SIZE);
+      if (offset) return offset;
+    }
+  }
+
+  if ((index + 1) < PTR_TO_INDEX(_pma_state->metadata->arena_end)) {
+    entry = _pma_get_page_entry(index + 1);
+    if (ENTRY_OFFSET(entry) > PMA_PAGE_SIZE) {
+      return _pma_take_cached_dpage(ENTRY_OFFSET(entry) - PMA_PAGE_SIZE);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Pull a specific free dpage from the dpage cache
+ *
+ * Only reusable dpages are considered. If the dpage is in the middle of a run,
+ * the run is split in two, unless the cache is full.
+ *
+ * @param offset  Offset of dpage in backing file
+ *
+ * @return  offset of dpage in backing file (0 if it isn't in the cache)
+ */
+uint64_t
+_pma_take_cached_dpage(uint64_t offset) {
+  DPageCache *dpage_cache = _pma_state->metadata->dpage_cache;
+  DPageRun   *run;
+  uint16_t    num_runs;
+  uint16_t    low;
+  uint16_t    high;
+  uint16_t    i;
+
+  if (!offset) return 0;
+
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    // Binary search for the last reusable run which starts at or before the
+    // dpage
+    low = 0;
+    high = dpage_cache->size;
+    while (low < high) {
+      i = ((low + high) / 2);
+      if (dpage_cache->runs[i].offset <= offset) {
+        low = (i + 1);
+      } else {
+        high = i;
+      }
+    }
+    if (!low) return 0;
+
+    i = (low - 1);
+    run = (dpage_cache->runs + i);
+    if (offset >= (run->offset + (run->length * PMA_PAGE_SIZE))) return 0;
+
+    if (dpage_cache->dirty) break;
+
+    // Copying the cache uses up a dpage, which may be the one we were looking
+    // for, so search again afterwards
+    if (_pma_copy_dpage_cache()) return 0;
+  }
+
+  if (offset == run->offset) return _pma_use_dpage_run(i, 1);
+
+  // Last dpage of run
+  if (offset == (run->offset + ((run->length - 1) * PMA_PAGE_SIZE))) {
+    --(run->length);
+
+    return offset;
+  }
+
+  // Split run, if there's room for another one
+  num_runs = (dpage_cache->size + dpage_cache->num_held + dpage_cache->num_freed);
+  if (num_runs == PMA_DPAGE_CACHE_SIZE) return 0;
+
+  memmove(run + 2, run + 1, ((num_runs - i - 1) * sizeof(DPageRun)));
+  run[1].offset = (offset + PMA_PAGE_SIZE);
+  run[1].length = (run->length - ((run[1].offset - run->offset) / PMA_PAGE_SIZE));
+  run->length = ((offset - run->offset) / PMA_PAGE_SIZE);
+  ++(dpage_cache->size);
+
+  return offset;
+}
+
+/**
+ * Pull a free dpage from the dpage cache
+ *
+ * Dpages are taken from the shortest run first, leaving longer runs for
+ * multi-page allocations.
+ *
+ * @return  offset of new page in backing file (0 if cache empty)
+ */
+uint64_t
+_pma_get_cached_dpage(void) {
+  DPageCache *dpage_cache = _pma_state->metadata->dpage_cache;
+
+  // If the cache is empty, or there's only one dpage in the cache and the cache
+  // hasn't been touched yet, then exit early. If the cache hasn't been touched
+  // yet, we'll need to copy-on-write the cache as well, so if there's only one
+  // dpage, don't even bother.
+  if (
+      (dpage_cache->size == 0) ||
+      ((dpage_cache->size == 1) && (dpage_cache->runs[0].length == 1) && !dpage_cache->dirty)) {
+    return 0;
+  }
+
+  // Special copy-on-write for dpage cache. Copying the cache uses up a dpage
+  // from it.
+  if (!dpage_cache->dirty) {
+    if (_pma_copy_dpage_cache()) {
+      return 0;
+    }
+  }
+
+  return _pma_use_dpage_run(_pma_find_dpage_run(1), 1);
+}
+
+/**
+ * Pull a run of free dpages which are contiguous on disk from the dpage cache
+ *
+ * Uses the shortest run which is long enough.
+ *
+ * @param num_dpages  Number of dpages
+ *
+ * @return  offset of first dpage in backing file (0 if no run is long enough)
+ */
+uint64_t
+_pma_get_cached_dpages(uint64_t num_dpages) {
+  DPageCache *dpage_cache = _pma_state->metadata->dpage_cache;
+  uint16_t    i;
+
+  i = _pma_find_dpage_run(num_dpages);
+  if (i == dpage_cache->size) return 0;
+
+  // Copying the cache uses up a dpage from the shortest run, which may be the
+  // one we found
+  if (!dpage_cache->dirty) {
+    if (_pma_copy_dpage_cache()) return 0;
+
+    i = _pma_find_dpage_run(num_dpages);
+    if (i == dpage_cache->size) return 0;
+  }
+
+  return _pma_use_dpage_run(i, num_dpages);
+}
+
+/**
+ * Find the shortest reusable run in the dpage cache with at least the given
+ * number of dpages
+ *
+ * Of runs with the same length, the one with the lowest offset is used.
+ *
+ * @param num_dpages  Minimum number of dpages in run
+ *
+ * @return  index of run in dpage cache (size of cache if no run is long enough)
+ */
+uint16_t
+_pma_find_dpage_run(uint64_t num_dpages) {
+  DPageCache *dpage_cache = _pma_state->metadata->dpage_cache;
+  uint16_t    best = dpage_cache->size;
+
+  for (uint16_t i = 0; i < dpage_cache->size; ++i) {
+    if (dpage_cache->runs[i].length < num_dpages) continue;
+    if ((best == dpage_cache->size) || (dpage_cache->runs[i].length < dpage_cache->runs[best].length)) {
+      best = i;
+      if (dpage_cache->runs[i].length == num_dpages) break;
+    }
+  }
+
+  return best;
+}
+
+/**
+ * Take dpages from the front of a reusable run in the dpage cache
+ *
+ * The dpage cache must be writeable. The run is removed if it's used up.
+ *
+ * @param i           Index of run in dpage cache
+ * @param num_dpages  Number of dpages to take (at most the length of the run)
+ *
+ * @return  offset of first dpage in backing file
+ */
+uint64_t
+_pma_use_dpage_run(uint16_t i, uint64_t num_dpages) {
+  DPageCache *dpage_cache = _pma_state->metadata->dpage_cache;
+  DPageRun   *run = (dpage_cache->runs + i);
+  uint64_t    offset = run->offset;
+  uint16_t    num_runs = (dpage_cache->size + dpage_cache->num_held + dpage_cache->num_freed);
+
+  assert(dpage_cache->dirty);
+  assert(i < dpage_cache->size);
+  assert(num_dpages <= run->length);
+
+  run->offset += (num_dpages * PMA_PAGE_SIZE);
+  run->length -= num_dpages;
+
+  if (!run->length) {
+    memmove(run, run + 1, ((num_runs - i - 1) * sizeof(DPageRun)));
+    --(dpage_cache->size);
+  }
+
+  return offset;
+}
+
+/**
+ * Add a dpage which was freed by a copy-on-write to the dpage cache
+ *
+ * The dpage cache must be writeable. The dpage can't be reused until it's no
+ * longer referenced by the most recent durable snapshot; see
+ * _pma_settle_dpage_cache. If the cache is full, even after merging the runs
+ * freed since the most recent sync, the dpage is dropped: it's never reused.
+ *
+ * @param offset  Offset of dpage in backing file
+ */
+void
+_pma_free_dpage(uint64_t offset) {
+  DPageCache *dpage_cache = _pma_state->metadata->dpage_cache;
+  DPageRun   *freed_runs = (dpage_cache->runs + dpage_cache->size + dpage_cache->num_held);
+  DPageRun   *last_run = (freed_runs + dpage_cache->num_freed - 1);
+
+  // Extend the most recently freed run, if adjacent. Consecutive copies often
+  // free consecutive dpages.
+  if (dpage_cache->num_freed) {
+    if ((last_run->offset + (last_run->length * PMA_PAGE_SIZE)) == offset) {
+      ++(last_run->length);
+      return;
+    }
+    if ((offset + PMA_PAGE_SIZE) == last_run->offset) {
+      last_run->offset = offset;
+      ++(last_run->length);
+      return;
+    }
+  }
+
+  if ((dpage_cache->size + dpage_cache->num_held + dpage_cache->num_freed) == PMA_DPAGE_CACHE_SIZE) {
+    dpage_cache->num_freed = _pma_merge_dpage_runs(freed_runs, dpage_cache->num_freed);
+
+    if ((dpage_cache->size + dpage_cache->num_held + dpage_cache->num_freed) == PMA_DPAGE_CACHE_SIZE) {
+      ++(_pma_state->stats.dpages_dropped);
+      return;
+    }
+  }
+
+  freed_runs[dpage_cache->num_freed].offset = offset;
+  freed_runs[dpage_cache->num_freed].length = 1;
+  ++(dpage_cache->num_freed);
+}
+
+/**
+ * Sort runs of dpages by offset, and merge runs which are adjacent on disk
+ *
+ * @param runs      Array of runs
+ * @param num_runs  Number of runs in array
+ *
+ * @return  number of runs after merging
+ */
+uint16_t
+_pma_merge_dpage_runs(DPageRun *runs, uint16_t num_runs) {
+  uint16_t num_merged = 0;
+
+  if (!num_runs) return 0;
+
+  qsort(runs, num_runs, sizeof(DPageRun), _pma_compare_dpage_runs);
+
+  for (uint16_t i = 1; i < num_runs; ++i) {
+    DPageRun *last_run = (runs + num_merged);
+
+    if ((last_run->offset + (last_run->length * PMA_PAGE_SIZE)) == runs[i].offset) {
+      last_run->length += runs[i].length;
+    } else {
+      ++num_merged;
+      runs[num_merged] = runs[i];
+    }
+  }
+
+  return (num_merged + 1);
+}
+
+/**
+ * Compare two runs of dpages by offset (for qsort)
+ *
+ * @param a   First run
+ * @param b   Second run
+ *
+ * @return  -1  a before b
+ * @return  0   same offset
+ * @return  1   a after b
+ */
+int
+_pma_compare_dpage_runs(const void *a, const void *b) {
+  uint64_t offset_a = ((const DPageRun *)a)->offset;
+  uint64_t offset_b = ((const DPageRun *)b)->offset;
+
+  return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+/**
+ * Make dpages which were freed before a sync reusable, and clear the dpage
+ * cache dirty bit
+ *
+ * Held runs become reusable, and so do freed runs if the sync is durable as
+ * soon as it completes. Otherwise, freed runs are held until the next sync.
+ * Does nothing if the dpage cache wasn't touched since the most recent sync,
+ * since it isn't writeable; held runs then wait for a later sync.
+ *
+ * Held runs were freed by a sync which may not have flushed its metadata. A
+ * reused dpage can be written back by the kernel at any time, so the snapshot
+ * file is flushed before they're made reusable; otherwise, a crash of the
+ * system could leave the newest metadata on disk referencing overwritten data.
+ *
+ * @param durable   Will the sync be durable as soon as it completes
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_settle_dpage_cache(int durable) {
+  DPageCache *dpage_cache = _pma_state->metadata->dpage_cache;
+  uint16_t    num_settled = (dpage_cache->num_held + (durable ? dpage_cache->num_freed : 0));
+  uint16_t    num_freed = (durable ? 0 : dpage_cache->num_freed);
+  uint16_t    size;
+
+  if (!dpage_cache->dirty) return 0;
+
+  if (dpage_cache->num_held && _pma_state->held_unflushed) {
+    if (fdatasync(_pma_state->snapshot_fd)) return -1;
+  }
+
+  size = _pma_merge_dpage_runs(dpage_cache->runs, (dpage_cache->size + num_settled));
+  memmove(
+      dpage_cache->runs + size,
+      dpage_cache->runs + dpage_cache->size + num_settled,
+      (num_freed * sizeof(DPageRun)));
+
+  dpage_cache->dirty = 0;
+  dpage_cache->size = size;
+  dpage_cache->num_held = num_freed;
+  dpage_cache->num_freed = 0;
+  _pma_state->held_unflushed = (num_freed != 0);
+
+  return 0;
+}
+
+/**
+ * Convert a dpage cache written by PMA_DATA_VERSION 2 to runs of dpages
+ *
+ * The converted cache is written to a new dpage and remapped like any other
+ * copy-on-write, so the old cache is untouched until the next sync. Dpages
+ * which weren't reusable yet are held until then. Dpages which don't fit in the
+ * converted cache, even after merging, are dropped.
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_migrate_dpage_cache(void) {
+  DPageCacheV2 *old_cache = (DPageCacheV2 *)_pma_state->metadata->dpage_cache;
+  DPageCache   *dpage_cache;
+  DPageRun     *runs;
+  void         *address = _pma_state->metadata->dpage_cache;
+  uint64_t      old_offset = ENTRY_OFFSET(_pma_state->page_directory.entries[0]);
+  uint64_t      offset;
+  uint16_t      num_entries;
+  uint16_t      num_runs = 0;
+  ssize_t       bytes_out;
+
+  // The queue never checked for overflow, so it's full as well as empty when
+  // head and tail meet. A full queue can only be told apart by its reusable
+  // entries; without any, it's taken to be empty, which at worst leaks its
+  // dpages instead of reusing stale entries which may be in use.
+  num_entries = ((old_cache->tail + PMA_DPAGE_CACHE_SIZE_V2 - old_cache->head) % PMA_DPAGE_CACHE_SIZE_V2);
+  if (!num_entries && old_cache->size) {
+    num_entries = PMA_DPAGE_CACHE_SIZE_V2;
+  }
+  if (old_cache->size > num_entries) {
+    errno = EILSEQ;
+    return -1;
+  }
+
+  dpage_cache = (DPageCache *)calloc(1, PMA_PAGE_SIZE);
+  if (dpage_cache == NULL) return -1;
+
+  // Reusable entries become reusable runs, and the remaining entries held runs
+  runs = dpage_cache->runs;
+  for (uint16_t i = 0; i < num_entries; ++i) {
+    if (i == old_cache->size) {
+      dpage_cache->size = _pma_merge_dpage_runs(runs, num_runs);
+      runs += dpage_cache->size;
+      num_runs = 0;
+    }
+
+    if ((runs + num_runs) == (dpage_cache->runs + PMA_DPAGE_CACHE_SIZE)) {
+      num_runs = _pma_merge_dpage_runs(runs, num_runs);
+      if ((runs + num_runs) == (dpage_cache->runs + PMA_DPAGE_CACHE_SIZE)) {
+        ++(_pma_state->stats.dpages_dropped);
+        continue;
+      }
+    }
+
+    runs[num_runs].offset = old_cache->queue[(old_cache->head + i) % PMA_DPAGE_CACHE_SIZE_V2];
+    runs[num_runs].length = 1;
+    ++num_runs;
+  }
+
+  if (old_cache->size == num_entries) {
+    dpage_cache->size = _pma_merge_dpage_runs(runs, num_runs);
+  } else {
+    dpage_cache->num_held = _pma_merge_dpage_runs(runs, num_runs);
+  }
+  dpage_cache->dirty = 1;
+
+  // Write converted cache to a new dpage and map it in place of the old one
+  offset = _pma_get_disk_dpage();
+  if (!offset) {
+    free((void *)dpage_cache);
+    return -1;
+  }
+
+  do {
+    bytes_out = pwrite(_pma_state->snapshot_fd, dpage_cache, PMA_PAGE_SIZE, offset);
+  } while (!bytes_out);
+  free((void *)dpage_cache);
+  if (bytes_out != PMA_PAGE_SIZE) return -1;
+
+  if (mmap(
+        address,
+        PMA_PAGE_SIZE,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED,
+        _pma_state->snapshot_fd,
+        offset) == MAP_FAILED) {
+    return -1;
+  }
+
+  // The old cache dpage is free once the converted cache is durable
+  _pma_free_dpage(old_offset);
+
+  if (PTR_TO_INDEX(_pma_state->metadata->arena_end) == 1) {
+    _pma_state->end_offset = (offset + PMA_PAGE_SIZE);
+  }
+
+  _pma_mark_page_dirty(0, offset, FIRST, 1);
+
+  return 0;
+}
+
+/**
+ * Copy the free dpage cache
+ *
+ * Free dpage cache needs to be copied using copy-on-write semantics when pages
+ * are added or removed.
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_copy_dpage_cache(void) {
+  DPageCache *dpage_cache = _pma_state->metadata->dpage_cache;
+  uint64_t    offset;
+  uint16_t    i;
+
+  assert(!dpage_cache->dirty);
+
+  // If pages available in cache...
+  if (dpage_cache->size) {
+    // Use a dpage from the shortest run, and record that it was used afterwards
+    i = _pma_find_dpage_run(1);
+    offset = dpage_cache->runs[i].offset;
+
+    _pma_copy_page((void *)dpage_cache, offset, FIRST, _pma_state->snapshot_fd);
+
+    // Copying may have merged the old cache dpage into the freed runs, but
+    // never into the reusable ones, so the run is still at the same index
+    dpage_cache->dirty = 1;
+    _pma_use_dpage_run(i, 1);
+
+  } else {
+    // Otherwise, get a brand new page from disk
+    offset = _pma_get_disk_dpage();
+    if (!offset) return -1;
+
+    _pma_copy_page((void *)dpage_cache, offset, FIRST, _pma_state->snapshot_fd);
+  }
+
+  // Mark dpage cache dirty (aka writeable)
+  dpage_cache->dirty = 1;
+
+  return 0;
+}
+
+/**
+ * Get a new free dpage on disk
+ *
+ * May require extending the snapshot backing file on disk.
+ *
+ * @return  offset of new page in backing file (0 if failure)
+ */
+uint64_t
+_pma_get_disk_dpage(void) {
+  uint64_t offset = _pma_state->metadata->next_offset;
+  uint64_t size = _pma_state->metadata->snapshot_size;
+
+  // Get a new dpage. Extend snapshot backing file first, if necessary.
+  if (offset == size) {
+    // Fail if snapshot file couldn't be extended
+    if (_pma_extend_snapshot_file(offset + PMA_PAGE_SIZE)) return 0;
+  }
+
+  // Update offset of next open dpage
+  _pma_state->metadata->next_offset += PMA_PAGE_SIZE;
+
+  return offset;
+}
+
+/**
+ * Copy an existing page to a new dpage
+ *
+ * Core copy-on-write implementation.
+ *
+ * @param address   Virtual memory address of existing page
+ * @param offset    Offset of dpage in backing file to which to copy
+ * @param status    Page status after copy (SHARED or FIRST)
+ * @param fd        PMA file descriptor
+ */
+void
+_pma_copy_page(void *address, uint64_t offset, PageStatus status, int fd) {
+  void     *new_address;
+  uint64_t  index = PTR_TO_INDEX(address);
+  ssize_t   bytes_out;
+
+  // Copy contents of existing page to new dpage
+  do {
+    bytes_out = pwrite(fd, address, PMA_PAGE_SIZE, offset);
+  } while (!bytes_out);
+  if (bytes_out != PMA_PAGE_SIZE) {
+    WARNING(strerror(errno));
+    abort();
+  }
+
+  new_address = mmap(
+      address,
+      PMA_PAGE_SIZE,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_FIXED,
+      fd,
+      offset);
+  if (new_address == MAP_FAILED) {
+    WARNING(strerror(errno));
+    abort();
+  }
+
+  assert(new_address == address);
+
+  // Add previous dpage to cache
+  // Note: the dpage cache should always be writeable here, either because the dpage cache is the page we just copied,
+  // or because it was made writeable in advance by _pma_copy_shared_page
+  _pma_free_dpage(ENTRY_OFFSET(_pma_get_page_entry(index)));
+
+  // Track the end of the arena on disk
+  if ((index + 1) == PTR_TO_INDEX(_pma_state->metadata->arena_end)) {
+    _pma_state->end_offset = (offset + PMA_PAGE_SIZE);
+  }
+
+  // Add page to dirty page list
+  _pma_mark_page_dirty(index, offset, status, 1);
+}
+
+/**
+ * Add entry to the dirty page store
+ *
+ * Before adding a new entry, tries to fold it into an existing one:
+ *  - An entry for exactly the same pages within the last PMA_DIRTY_FOLD_WINDOW
+ *    entries is superseded by the new entry (e.g. pages allocated and freed
+ *    during the same event). Since the superseded entry may have moved the
+ *    pages to a new offset on disk, that offset is kept unless the new entry
+ *    has one of its own.
+ *  - Pages directly adjacent to those of the most recent entry are merged into
+ *    it, if possible (see _pma_merge_dirty_page).
+ *
+ * @param index       Index of page in page directory
+ * @param offset      Offset of page in PMA file
+ * @param status      Status of pages
+ * @param num_pages   Number of pages represented by this entry
+ */
+void
+_pma_mark_page_dirty(uint64_t index, uint64_t offset, PageStatus status, uint32_t num_pages) {
+  DirtyPageEntry *dirty_page;
+  uint64_t        num_dirty_pages = (_pma_state->metadata->num_dirty_pages + _pma_state->num_journal_pages);
+  uint64_t        window = (num_dirty_pages < PMA_DIRTY_FOLD_WINDOW) ? num_dirty_pages : PMA_DIRTY_FOLD_WINDOW;
+
+  // Supersede entry for the same pages
+  for (uint64_t i = 1; i <= window; ++i) {
+    dirty_page = _pma_get_dirty_page(num_dirty_pages - i);
+
+    if ((dirty_page->index == index) && (dirty_page->num_pages == num_pages)) {
+      dirty_page->status = status;
+      if (offset) {
+        dirty_page->offset = offset;
+      }
+
+      return;
+    }
+
+    // Don't reorder changes to overlapping pages
+    if ((index < (dirty_page->index + dirty_page->num_pages)) && (dirty_page->index < (index + num_pages))) {
+      break;
+    }
+  }
+
+  // Merge with most recent entry
+  if (num_dirty_pages) {
+    dirty_page = _pma_get_dirty_page(num_dirty_pages - 1);
+
+    if (_pma_merge_dirty_page(dirty_page, index, offset, status, num_pages)) {
+      return;
+    }
+  }
+
+  if (_pma_state->metadata->num_dirty_pages < PMA_DIRTY_PAGE_LIMIT) {
+    dirty_page = (DirtyPageEntry *)_pma_state->metadata->dirty_pages;
+    dirty_page += _pma_state->metadata->num_dirty_pages++;
+
+  } else {
+    // Metadata page is full; overflow into the journal
+    if (_pma_state->num_journal_pages == _pma_state->journal_capacity) {
+      uint64_t  capacity = _pma_state->journal_capacity ? (2 * _pma_state->journal_capacity) : PMA_DIRTY_PAGE_LIMIT;
+      void     *address = realloc(_pma_state->journal_pages, (capacity * sizeof(DirtyPageEntry)));
+
+      if (address == NULL) {
+        WARNING("overflow journal allocation failed");
+        abort();
+      }
+
+      _pma_state->journal_pages = (DirtyPageEntry *)address;
+      _pma_state->journal_capacity = capacity;
+    }
+
+    dirty_page = _pma_state->journal_pages + _pma_state->num_journal_pages++;
+  }
+
+  dirty_page->index     = index;
+  dirty_page->offset    = offset;
+  dirty_page->status    = status;
+  dirty_page->num_pages = num_pages;
+}
+
+/**
+ * Try to extend a dirty page entry with the pages directly adjacent to it
+ *
+ * Only runs of SHARED or FREE pages can be merged: each page of a multi-page
+ * allocation except the first has a different status. Offsets must either both
+ * be given and contiguous, or both be 0 ("leave it alone"). In the latter case,
+ * FREE pages are only merged if the page directory shows them as parts of older
+ * allocations, and they are currently contiguous on disk (shared pages may have
+ * been copied-on-write since the most recent sync): free page runs are reused
+ * as multi-page allocations, which need to be contiguous on disk (see
+ * pma_load). Shared pages are mapped one at a time, so it doesn't matter for
+ * them.
+ *
+ * @param dirty_page  Existing dirty page entry
+ * @param index       Index of first new page in page directory
+ * @param offset      Offset of first new page in PMA file
+ * @param status      Status of new pages
+ * @param num_pages   Number of new pages
+ *
+ * @return  Boolean (as int) for whether the new pages were merged or not
+ */
+int
+_pma_merge_dirty_page(DirtyPageEntry *dirty_page, uint64_t index, uint64_t offset, PageStatus status, uint32_t num_pages) {
+  uint64_t  low_index, high_index, low_offset, high_offset, low_pages;
+  int       before = (index < dirty_page->index);
+
+  if ((status != SHARED) && (status != FREE)) return 0;
+  if (dirty_page->status != status) return 0;
+  if ((dirty_page->num_pages + (uint64_t)num_pages) > UINT32_MAX) return 0;
+
+  // Order the two runs of pages
+  if (before) {
+    low_index   = index;
+    low_offset  = offset;
+    low_pages   = num_pages;
+    high_index  = dirty_page->index;
+    high_offset = dirty_page->offset;
+  } else {
+    low_index   = dirty_page->index;
+    low_offset  = dirty_page->offset;
+    low_pages   = dirty_page->num_pages;
+    high_index  = index;
+    high_offset = offset;
+  }
+
+  if (high_index != (low_index + low_pages)) return 0;
+
+  if (low_offset || high_offset) {
+    if (!low_offset || (high_offset != (low_offset + (low_pages * PMA_PAGE_SIZE)))) return 0;
+
+  } else if (status == FREE) {
+    PageDirEntry low_entry  = _pma_get_page_entry(high_index - 1);
+    PageDirEntry high_entry = _pma_get_page_entry(high_index);
+
+    if ((ENTRY_STATUS(low_entry) != SHARED) && (ENTRY_STATUS(low_entry) != FIRST) && (ENTRY_STATUS(low_entry) != FOLLOW)) return 0;
+    if ((ENTRY_STATUS(high_entry) != SHARED) && (ENTRY_STATUS(high_entry) != FIRST)) return 0;
+    if (_pma_get_page_offset(high_index) != (_pma_get_page_offset(high_index - 1) + PMA_PAGE_SIZE)) return 0;
+  }
+
+  if (before) {
+    dirty_page->index  = index;
+    dirty_page->offset = offset;
+  }
+  dirty_page->num_pages += num_pages;
+
+  return 1;
+}
+
+/**
+ * Get a dirty page entry by position
+ *
+ * Dirty page entries are stored in the metadata page first, then in the
+ * overflow journal.
+ *
+ * @param i   Position of entry in dirty page store
+ *
+ * @return  DirtyPageEntry*   dirty page entry
+ */
+DirtyPageEntry *
+_pma_get_dirty_page(uint64_t i) {
+  if (i < _pma_state->metadata->num_dirty_pages) {
+    return (_pma_state->metadata->dirty_pages + i);
+  }
+
+  return (_pma_state->journal_pages + (i - _pma_state->metadata->num_dirty_pages));
+}
+
+/**
+ * Find the most recent dirty page entry which covers a page
+ *
+ * @param index   Index of page in page directory
+ *
+ * @return  DirtyPageEntry*   dirty page entry (NULL if page isn't dirty)
+ */
+DirtyPageEntry *
+_pma_find_dirty_page(uint64_t index) {
+  DirtyPageEntry *dirty_page;
+  uint64_t        i = (_pma_state->metadata->num_dirty_pages + _pma_state->num_journal_pages);
+
+  while (i--) {
+    dirty_page = _pma_get_dirty_page(i);
+
+    if ((index >= dirty_page->index) && (index < (dirty_page->index + dirty_page->num_pages))) {
+      return dirty_page;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Get the current offset on disk of a page
+ *
+ * Shared pages copied-on-write since the most recent sync have already moved to
+ * a new dpage, which the page directory doesn't show until the next sync.
+ *
+ * @param index   Index of page in page directory
+ *
+ * @return  uint64_t  offset of page in PMA file
+ */
+uint64_t
+_pma_get_page_offset(uint64_t index) {
+  DirtyPageEntry *dirty_page;
+  uint64_t        i = (_pma_state->metadata->num_dirty_pages + _pma_state->num_journal_pages);
+
+  while (i--) {
+    dirty_page = _pma_get_dirty_page(i);
+
+    // Offset of 0 is code for "leave it alone"
+    if (
+        dirty_page->offset &&
+        (index >= dirty_page->index) &&
+        (index < (dirty_page->index + dirty_page->num_pages))) {
+      return (dirty_page->offset + ((index - dirty_page->index) * PMA_PAGE_SIZE));
+    }
+  }
+
+  return ENTRY_OFFSET(_pma_get_page_entry(index));
+}
+
+/**
+ * Get the current status of a page
+ *
+ * The page directory only changes on sync. Pages which are not in use according
+ * to the page directory may have been allocated since, in which case their
+ * status is found in the dirty page store.
+ *
+ * @param index   Index of page in page directory
+ *
+ * @return  PageStatus  status of page
+ */
+PageStatus
+_pma_get_page_status(uint64_t index) {
+  DirtyPageEntry *dirty_page;
+  PageStatus      status = ENTRY_STATUS(_pma_get_page_entry(index));
+
+  if ((status == SHARED) || (status == FIRST) || (status == FOLLOW)) {
+    return status;
+  }
+
+  dirty_page = _pma_find_dirty_page(index);
+  if (dirty_page == NULL) {
+    return status;
+  }
+
+  if ((dirty_page->index != index) && (dirty_page->status == FIRST)) {
+    return FOLLOW;
+  }
+
+  return dirty_page->status;
+}
+
+/**
+ * Get the page directory entry of a page as of the most recent sync
+ *
+ * While an asynchronous sync is being committed, its changes haven't been
+ * applied to the page directory yet, so they're looked up in the directory
+ * entries which it will write instead. These are ordered by index, so the run
+ * containing the page is found by binary search.
+ *
+ * @param index   Index of page in page directory
+ *
+ * @return  PageDirEntry  directory entry of page
+ */
+PageDirEntry
+_pma_get_page_entry(uint64_t index) {
+  Commit   *commit = _pma_state->commit;
+  uint64_t  low = 0;
+  uint64_t  high;
+
+  if ((commit == NULL) || !commit->num_runs || (index < commit->run_indices[0])) {
+    return _pma_state->page_directory.entries[index];
+  }
+
+  // Binary search for last run starting at or before the page
+  high = commit->num_runs;
+  while ((high - low) > 1) {
+    uint64_t mid = ((low + high) / 2);
+
+    if (commit->run_indices[mid] <= index) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+
+  if (index >= (commit->run_indices[low] + commit->run_lengths[low])) {
+    return _pma_state->page_directory.entries[index];
+  }
+
+  return commit->entries[commit->run_starts[low] + (index - commit->run_indices[low])];
+}
+
+/**
+ * Build the page directory updates of a sync
+ *
+ * Counterpart to _pma_sync_dirty_pages, for when the updates aren't applied
+ * immediately. The pages touched by the dirty page entries are grouped into
+ * disjoint runs of consecutive pages, ordered by index. The entries for the
+ * pages of all runs are stored back-to-back in a single array.
+ *
+ * @param entries     Filled with directory entries of all runs, in order
+ * @param run_indices Filled with the directory index of each run
+ * @param run_lengths Filled with the number of entries of each run
+ * @param run_starts  Filled with the position in entries of the first entry of
+ *                    each run
+ * @param num_runs    Filled with the number of runs
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_build_page_entries(PageDirEntry **entries, uint64_t **run_indices, uint64_t **run_lengths, uint64_t **run_starts, uint64_t *num_runs) {
+  DirtyPageEntry *dirty_pages;
+  uint64_t        num_meta_pages = _pma_state->metadata->num_dirty_pages;
+  uint64_t        num_dirty_pages = (num_meta_pages + _pma_state->num_journal_pages);
+  uint64_t        num_entries = 0;
+  uint64_t        n = 0;
+
+  *entries = NULL;
+  *run_indices = NULL;
+  *run_lengths = NULL;
+  *run_starts = NULL;
+  *num_runs = 0;
+
+  if (!num_dirty_pages) return 0;
+
+  // Find runs of pages
+  dirty_pages = (DirtyPageEntry *)malloc(num_dirty_pages * sizeof(DirtyPageEntry));
+  *run_indices = (uint64_t *)malloc(num_dirty_pages * sizeof(uint64_t));
+  *run_lengths = (uint64_t *)malloc(num_dirty_pages * sizeof(uint64_t));
+  *run_starts = (uint64_t *)malloc(num_dirty_pages * sizeof(uint64_t));
+  if ((dirty_pages == NULL) || (*run_indices == NULL) || (*run_lengths == NULL) || (*run_starts == NULL)) goto build_error;
+
+  memcpy(dirty_pages, _pma_state->metadata->dirty_pages, (num_meta_pages * sizeof(DirtyPageEntry)));
+  memcpy(
+      (dirty_pages + num_meta_pages),
+      _pma_state->journal_pages,
+      (_pma_state->num_journal_pages * sizeof(DirtyPageEntry)));
+  qsort(dirty_pages, num_dirty_pages, sizeof(DirtyPageEntry), _pma_compare_dirty_pages);
+
+  for (uint64_t i = 0; i < num_dirty_pages; ++i) {
+    uint64_t end = (dirty_pages[i].index + dirty_pages[i].num_pages);
+
+    if (n && (dirty_pages[i].index <= ((*run_indices)[n - 1] + (*run_lengths)[n - 1]))) {
+      if (end > ((*run_indices)[n - 1] + (*run_lengths)[n - 1])) {
+        (*run_lengths)[n - 1] = (end - (*run_indices)[n - 1]);
+      }
+    } else {
+      (*run_indices)[n] = dirty_pages[i].index;
+      (*run_lengths)[n] = dirty_pages[i].num_pages;
+      ++n;
+    }
+  }
+
+  for (uint64_t i = 0; i < n; ++i) {
+    (*run_starts)[i] = num_entries;
+    num_entries += (*run_lengths)[i];
+  }
+
+  *entries = (PageDirEntry *)malloc(num_entries * sizeof(PageDirEntry));
+  if (*entries == NULL) goto build_error;
+
+  // UINT64_MAX marks entries which haven't been initialized yet (no valid entry
+  // has every status bit set)
+  memset(*entries, 0xFF, (num_entries * sizeof(PageDirEntry)));
+
+  // Apply dirty page entries in order
+  for (uint64_t i = 0; i < num_dirty_pages; ++i) {
+    DirtyPageEntry *dirty_page = _pma_get_dirty_page(i);
+    PageDirEntry   *entry;
+    PageStatus      cont_status = (dirty_page->status == FIRST) ? FOLLOW : dirty_page->status;
+    uint64_t        low = 0;
+    uint64_t        high = n;
+
+    // Binary search for run containing the entry
+    while ((high - low) > 1) {
+      uint64_t mid = ((low + high) / 2);
+
+      if ((*run_indices)[mid] <= dirty_page->index) {
+        low = mid;
+      } else {
+        high = mid;
+      }
+    }
+
+    entry = (*entries + (*run_starts)[low] + (dirty_page->index - (*run_indices)[low]));
+    for (uint64_t j = 0; j < dirty_page->num_pages; ++j, ++entry) {
+      uint64_t offset;
+
+      // Offset of 0 is code for "leave it alone"
+      if (dirty_page->offset) {
+        offset = dirty_page->offset + (j * PMA_PAGE_SIZE);
+      } else if (*entry == UINT64_MAX) {
+        offset = ENTRY_OFFSET(_pma_state->page_directory.entries[dirty_page->index + j]);
+      } else {
+        offset = ENTRY_OFFSET(*entry);
+      }
+
+      *entry = DIR_ENTRY(offset, (j ? cont_status : dirty_page->status));
+    }
+  }
+
+  free((void *)dirty_pages);
+
+  *num_runs = n;
+
+  return 0;
+
+build_error:
+  free((void *)dirty_pages);
+  free((void *)*run_indices);
+  free((void *)*run_lengths);
+  free((void *)*run_starts);
+  *run_indices = NULL;
+  *run_lengths = NULL;
+  *run_starts = NULL;
+  errno = ENOMEM;
+
+  return -1;
+}
+/**
+ * Initialize the state used by asynchronous syncs
+ *
+ * The writer thread is only started by the first asynchronous sync.
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_init_commit_state(void) {
+  int err;
+
+  _pma_state->commit           = NULL;
+  _pma_state->writer_running   = 0;
+  _pma_state->writer_stop      = 0;
+  _pma_state->last_ticket      = 0;
+  _pma_state->failed_ticket    = 0;
+  _pma_state->failed_errno     = 0;
+
+  err = pthread_mutex_init(&(_pma_state->commit_lock), NULL);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+
+  err = pthread_cond_init(&(_pma_state->commit_cond), NULL);
+  if (err) {
+    pthread_mutex_destroy(&(_pma_state->commit_lock));
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Hand a frozen sync off to the writer thread, starting it if necessary
+ *
+ * @param commit  Frozen sync
  *
  * @return  0   success
  * @return  -1  failure; errno set to error code
  */
 int
-_pma_write_page_offset(int fd, uint64_t index, uint64_t offset) {
-  ssize_t bytes_out;
+_pma_start_commit(Commit *commit) {
+  int err;
 
-  do {
-    bytes_out = pwrite(
-        fd,
-        (const void *)&offset,
-        sizeof(uint64_t),
-        (index * sizeof(PageDirEntry)));
-  } while (!bytes_out);
+  if (!_pma_state->writer_running) {
+    err = pthread_create(&(_pma_state->writer), NULL, _pma_commit_writer, NULL);
+    if (err) {
+      errno = err;
+      return -1;
+    }
 
-  if (bytes_out == -1) {
-    return -1;
+    _pma_state->writer_running = 1;
   }
 
+  pthread_mutex_lock(&(_pma_state->commit_lock));
+  _pma_state->commit = commit;
+  pthread_cond_broadcast(&(_pma_state->commit_cond));
+  pthread_mutex_unlock(&(_pma_state->commit_lock));
+
   return 0;
 }
 
 /**
- * Add newly freed pages and page runs to the free page caches
- *
- * @param num_dirty_pages   Size of dirty page cache
- * @param dirty_pages       Dirty page cache as array
+ * Wait for the sync being committed by the writer thread, if any, to finish
  *
  * @return  0   success
  * @return  -1  failure; errno set to error code
  */
 int
-_pma_update_free_pages(uint8_t num_dirty_pages, DirtyPageEntry *dirty_pages) {
-  SinglePageCache  *free_page;
-  PageRunCache     *page_run;
+_pma_wait_commit(void) {
+  Commit *commit = _pma_state->commit;
 
-  // TODO: Pull out common code between here and pma_load
-  for (uint8_t i = 0; i < num_dirty_pages; ++i) {
-    if (dirty_pages[i].status != FREE) continue;
-
-    if (dirty_pages[i].num_pages > 1) {
-      page_run = (PageRunCache *)malloc(sizeof(PageRunCache));
-      if (page_run == NULL) return -1;
-
-      page_run->next = _pma_state->free_page_runs;
-      page_run->page = INDEX_TO_PTR(dirty_pages[i].index);
-      page_run->length = dirty_pages[i].num_pages;
-      _pma_state->free_page_runs = page_run;
-
-    } else {
-      free_page = (SinglePageCache *)malloc(sizeof(SinglePageCache));
-      if (free_page == NULL) return -1;
+  if (commit == NULL) return 0;
 
-      free_page->next = _pma_state->free_pages;
-      free_page->page = INDEX_TO_PTR(dirty_pages[i].index);
-      _pma_state->free_pages = free_page;
-    }
+  pthread_mutex_lock(&(_pma_state->commit_lock));
+  while (!commit->done) {
+    pthread_cond_wait(&(_pma_state->commit_cond), &(_pma_state->commit_lock));
   }
+  pthread_mutex_unlock(&(_pma_state->commit_lock));
 
-  return 0;
+  return _pma_reap_commit();
 }
 
 /**
- * Allocate memory within a shared allocation page.
+ * Finish a sync which has been committed by the writer thread
  *
- * @param size  Size in bytes to allocate (must be <= 1/4 page)
+ * Once the metadata is durable, the dirty page entries can be applied to the
+ * page directory, and pages freed by the sync can be reused.
  *
- * @return  NULL    failure; errno set to error code
- * @return  void*   address of the newly allocated memory
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
  */
-void *
-_pma_malloc_bytes(size_t size)
-{
-  SharedPageHeader *shared_page;
-  uint16_t          i, slot_size;
-  uint8_t           bucket, byte, bit;
+int
+_pma_reap_commit(void) {
+  Commit   *commit = _pma_state->commit;
+  Metadata *metadata = commit->metadata;
+  int       err = commit->err;
+
+  pthread_mutex_lock(&(_pma_state->commit_lock));
+  _pma_state->commit = NULL;
+  pthread_mutex_unlock(&(_pma_state->commit_lock));
+
+  // The page directory may still need flushing if the commit failed before
+  // flushing it, and needs it again once this commit's updates are written
+  if (err || metadata->num_dirty_pages || commit->num_journal_pages) {
+    _pma_state->dir_unflushed = 1;
+  }
 
-  assert(size <= PMA_MAX_SHARED_ALLOC);
+  if (!err) {
+    // Next overflow journal is appended after this one
+    _pma_state->metadata->journal_offset   = metadata->journal_offset;
+    _pma_state->metadata->journal_entries  = metadata->journal_entries;
+    _pma_state->metadata->journal_checksum = metadata->journal_checksum;
+
+    if (
+        _pma_sync_dirty_pages(_pma_state->page_dir_fd, metadata->num_dirty_pages, metadata->dirty_pages) ||
+        _pma_sync_dirty_pages(_pma_state->page_dir_fd, commit->num_journal_pages, commit->journal_pages) ||
+        _pma_update_free_pages(metadata->num_dirty_pages, metadata->dirty_pages) ||
+        _pma_update_free_pages(commit->num_journal_pages, commit->journal_pages)) {
+      err = errno;
+    }
+  }
 
-  // Don't bother with anything less than the minimum allocation size
-  if (size < PMA_MIN_ALLOC_SIZE) {
-    size = PMA_MIN_ALLOC_SIZE;
+  if (err) {
+    _pma_state->failed_ticket = commit->ticket;
+    _pma_state->failed_errno  = err;
   }
 
-  // Find the right bucket
-  bucket = 0;
-  i = size - 1;
-  while (i >>= 1) bucket++;
-  slot_size = (1 << (bucket + 1));
+  free((void *)commit->journal_pages);
+  _pma_free_commit(commit);
 
-  // Search for a shared page with open slots
-  shared_page = _pma_state->metadata->shared_pages[bucket];
-  while ((shared_page != NULL) && (shared_page->free == 0)) {
-    shared_page = shared_page->next;
+  if (err) {
+    errno = err;
+    return -1;
   }
 
-  // Make a new shared page if necessary
-  if (shared_page == NULL) {
-    if (_pma_malloc_shared_page(bucket)) {
-      return NULL;
-    }
+  return 0;
+}
+
+/**
+ * Free a frozen sync, except for its overflow dirty page entries
+ *
+ * @param commit  Frozen sync
+ */
+void
+_pma_free_commit(Commit *commit) {
+  free((void *)commit->entries);
+  free((void *)commit->run_indices);
+  free((void *)commit->run_lengths);
+  free((void *)commit->run_starts);
+  free((void *)commit->metadata);
+  free((void *)commit);
+}
 
-    shared_page = _pma_state->metadata->shared_pages[bucket];
+/**
+ * Writer thread for asynchronous syncs
+ *
+ * @param arg   Unused
+ *
+ * @return  NULL
+ */
+void *
+_pma_commit_writer(void *arg) {
+  Commit *commit;
+  int     err;
 
-  } else {
-    if (_pma_copy_shared_page((void *)shared_page)) {
-      return NULL;
+  pthread_mutex_lock(&(_pma_state->commit_lock));
+  while (1) {
+    while (!_pma_state->writer_stop && ((_pma_state->commit == NULL) || _pma_state->commit->done)) {
+      pthread_cond_wait(&(_pma_state->commit_cond), &(_pma_state->commit_lock));
     }
-  }
+    if ((_pma_state->commit == NULL) || _pma_state->commit->done) break;
 
-  assert(shared_page->free);
+    commit = _pma_state->commit;
+    pthread_mutex_unlock(&(_pma_state->commit_lock));
 
-  // Find first empty slot using bitmap (1 = empty, 0 = full)
-  byte = 0;
-  while (shared_page->bits[byte] == 0) {
-    assert(byte < PMA_BITMAP_SIZE);
-    ++byte;
-  }
-  i = shared_page->bits[byte];
-  bit = 0;
-  while (~i & 1U) {
-    i >>= 1;
-    ++bit;
-  }
+    err = _pma_write_commit(commit) ? errno : 0;
 
-  // Mark slot full
-  shared_page->bits[byte] -= (1 << bit);
-  --(shared_page->free);
+    pthread_mutex_lock(&(_pma_state->commit_lock));
+    commit->err  = err;
+    commit->done = 1;
+    pthread_cond_broadcast(&(_pma_state->commit_cond));
+  }
+  pthread_mutex_unlock(&(_pma_state->commit_lock));
 
-  // Return slot
-  return (void *)(
-      (char *)shared_page +
-      (sizeof(SharedPageHeader)) +
-      (slot_size * ((PMA_BITMAP_BITS * byte) + bit)));
+  return NULL;
 }
 
 /**
- * Allocate a new shared allocation page.
+ * Write a frozen sync to disk
  *
- * @param bucket  Into which bucket in the shared allocation pages array the new
- *                page will go (which also corresponds to the size of the slots
- *                in the page)
+ * Runs on the writer thread, so it mustn't touch any of the PMA state which the
+ * next event may be modifying. The dirty pages were copied-on-write if they
+ * were modified after the freeze, so their original contents are still in the
+ * page cache of the snapshot file. The whole file is flushed at once, as with
+ * PMA_COMMIT_GROUP, unless the durability level of the sync skips it.
+ *
+ * @param commit  Frozen sync
  *
  * @return  0   success
  * @return  -1  failure; errno set to error code
  */
 int
-_pma_malloc_shared_page(uint8_t bucket)
-{
-  SharedPageHeader *shared_page;
+_pma_write_commit(Commit *commit) {
+  ssize_t bytes_out;
 
-  // Get a new writeable page
-  shared_page = (SharedPageHeader *)_pma_malloc_single_page(SHARED);
-  if (shared_page == NULL) {
-    return -1;
+  // Dirty pages must be durable before the metadata which commits them. The
+  // page directory updates of the previous sync must be durable before the
+  // metadata which replaces it, since they won't be replayed on load anymore.
+  if (commit->durability != PMA_DURABILITY_NONE) {
+    if (fdatasync(_pma_state->snapshot_fd)) return -1;
+    if (commit->flush_page_dir && fdatasync(_pma_state->page_dir_fd)) return -1;
+
+    if (commit->metadata->flags & PMA_FLAG_PAGE_SUMS) {
+      if (fdatasync(_pma_state->page_sums_fd)) return -1;
+    }
   }
 
-  // Initialize header for shared page
-  shared_page->dirty = 1;
-  shared_page->size = (bucket + 1);
-  shared_page->free = ((PMA_PAGE_SIZE - sizeof(SharedPageHeader)) / (1 << bucket));
-  for (uint8_t i = 0; i < PMA_BITMAP_SIZE; ++i) {
-    shared_page->bits[i] = PMA_EMPTY_BITMAP;
+  // Sync overflow dirty page entries
+  if (_pma_write_journal(commit->metadata, commit->num_journal_pages, commit->journal_pages)) {
+    return -1;
   }
 
-  // Add new shared page to top of stack
-  shared_page->next = _pma_state->metadata->shared_pages[bucket];
-  _pma_state->metadata->shared_pages[bucket] = shared_page;
+  // Compute checksum
+  commit->metadata->checksum = _pma_checksum_metadata(commit->metadata);
+
+  // Sync metadata
+  bytes_out = pwrite(
+      _pma_state->snapshot_fd,
+      (const void *)commit->metadata,
+      PMA_PAGE_SIZE,
+      commit->meta_page_offset);
+  if (bytes_out != PMA_PAGE_SIZE) return -1;
+
+  // The dpages held when the sync was frozen can be reused as soon as the next
+  // sync settles the dpage cache. Read by the main thread only after it has
+  // waited for this commit.
+  if (commit->durability == PMA_DURABILITY_FULL) {
+    if (fdatasync(_pma_state->snapshot_fd)) return -1;
+    _pma_state->held_unflushed = 0;
+  }
 
   return 0;
 }
 
+#if defined(PMA_IO_URING)
 /**
- * Allocate memory for a large object in one or more pages.
+ * Set up the io_uring used to commit syncs
  *
- * @param size  Size in bytes to allocate (must be > 1/4 page)
- *
- * @return  NULL    failure; errno set to error code
- * @return  void*   address of the newly allocated memory
+ * Falls back to committing syncs one step at a time if io_uring isn't available
+ * (e.g. old kernel, or disabled by seccomp), or doesn't support the operations
+ * used to commit syncs.
  */
-void *
-_pma_malloc_pages(size_t size)
-{
-  void     *address;
-  uint64_t  num_pages;
+void
+_pma_uring_init(void) {
+  struct io_uring_params  params;
+  URing                  *uring = &(_pma_state->uring);
+  int                     fd;
 
-  assert(size > PMA_MAX_SHARED_ALLOC);
+  uring->fd = -1;
+  uring->num_pending = 0;
 
-  // Round size up to nearest page boundary
-  size = PAGE_ROUND_UP(size);
-  num_pages = size >> PMA_PAGE_SHIFT;
+  memset(&params, 0, sizeof(struct io_uring_params));
+  fd = (int)syscall(__NR_io_uring_setup, PMA_URING_ENTRIES, &params);
+  if (fd == -1) return;
 
-  if (num_pages == 1) {
-    address = _pma_malloc_single_page(FIRST);
+  if (!_pma_uring_probe(fd)) goto uring_error;
+
+  uring->sq_ring_bytes = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+  uring->cq_ring_bytes = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (uring->cq_ring_bytes > uring->sq_ring_bytes) {
+      uring->sq_ring_bytes = uring->cq_ring_bytes;
+    }
+    uring->cq_ring_bytes = uring->sq_ring_bytes;
+  }
+
+  uring->sq_ring = mmap(
+      NULL,
+      uring->sq_ring_bytes,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      fd,
+      IORING_OFF_SQ_RING);
+  if (uring->sq_ring == MAP_FAILED) goto uring_error;
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    uring->cq_ring = uring->sq_ring;
   } else {
-    address = _pma_malloc_multi_pages(num_pages);
+    uring->cq_ring = mmap(
+        NULL,
+        uring->cq_ring_bytes,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        fd,
+        IORING_OFF_CQ_RING);
+    if (uring->cq_ring == MAP_FAILED) {
+      munmap(uring->sq_ring, uring->sq_ring_bytes);
+      goto uring_error;
+    }
   }
 
-  return address;
+  uring->sqes = mmap(
+      NULL,
+      (params.sq_entries * sizeof(struct io_uring_sqe)),
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE,
+      fd,
+      IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED) {
+    if (uring->cq_ring != uring->sq_ring) munmap(uring->cq_ring, uring->cq_ring_bytes);
+    munmap(uring->sq_ring, uring->sq_ring_bytes);
+    goto uring_error;
+  }
+
+  uring->sq_head  = (unsigned *)((char *)uring->sq_ring + params.sq_off.head);
+  uring->sq_tail  = (unsigned *)((char *)uring->sq_ring + params.sq_off.tail);
+  uring->sq_mask  = (unsigned *)((char *)uring->sq_ring + params.sq_off.ring_mask);
+  uring->sq_array = (unsigned *)((char *)uring->sq_ring + params.sq_off.array);
+  uring->cq_head  = (unsigned *)((char *)uring->cq_ring + params.cq_off.head);
+  uring->cq_tail  = (unsigned *)((char *)uring->cq_ring + params.cq_off.tail);
+  uring->cq_mask  = (unsigned *)((char *)uring->cq_ring + params.cq_off.ring_mask);
+  uring->cqes     = (struct io_uring_cqe *)((char *)uring->cq_ring + params.cq_off.cqes);
+
+  uring->num_entries = params.sq_entries;
+  uring->fd = fd;
+
+  return;
+
+uring_error:
+  close(fd);
 }
 
 /**
- * Allocate a single new page
- *
- * Reuse pages from the free page cache, if any are available. These pages are
- * used for shared allocations and for "large" allocations that are between 1/4
- * and 1 page in size: (0.25, 1].
+ * Check whether an io_uring supports the operations used to commit syncs
  *
- * @param status  Page status after allocation (SHARED or FIRST)
+ * @param fd  io_uring file descriptor
  *
- * @return  NULL    failure; errno set to error code
- * @return  void*   address of the newly allocated memory
+ * @return  Boolean (as int) for whether the operations are supported or not
  */
-void *
-_pma_malloc_single_page(PageStatus status) {
-  void             *address;
-  SinglePageCache  *free_page = _pma_state->free_pages;
-
-  // Get an existing free page from cache, if available
-  if (free_page != NULL) {
-    address = free_page->page;
-    _pma_state->free_pages = free_page->next;
-    free((void *)free_page);
-
-    // Make the page writeable
-    mprotect(address, PMA_PAGE_SIZE, (PROT_READ | PROT_WRITE));
-
-    // Add page to dirty list
-    _pma_mark_page_dirty(PTR_TO_INDEX(address), 0, status, 1);
-  } else {
-    // Otherwise, allocate a new page
-    address = _pma_get_new_page(status);
+int
+_pma_uring_probe(int fd) {
+  struct io_uring_probe *probe;
+  size_t                 bytes = sizeof(struct io_uring_probe) + (IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+  int                    supported = 0;
+
+  probe = (struct io_uring_probe *)calloc(1, bytes);
+  if (probe == NULL) return 0;
+
+  // Kernels which can't probe (before 5.6) can't write either
+  if (!syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST)) {
+    supported =
+      (probe->ops_len > IORING_OP_WRITE) &&
+      (probe->ops_len > IORING_OP_FSYNC) &&
+      (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+      (probe->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED);
   }
 
-  assert((((uint64_t)address) % PMA_PAGE_SIZE) == 0);
+  free((void *)probe);
 
-  return address;
+  return supported;
 }
 
 /**
- * Allocate a contiguous block of multiple pages
- *
- * Reuse pages from the free page run cache, if any are available.
- *
- * @param num_pages   # pages to allocate
- *
- * @return  NULL    failure; errno set to error code
- * @return  void*   address of the newly allocated memory
+ * Tear down the io_uring used to commit syncs
  */
-void *
-_pma_malloc_multi_pages(uint64_t num_pages) {
-  void *address;
+void
+_pma_uring_close(void) {
+  URing *uring = &(_pma_state->uring);
 
-  address = _pma_get_cached_pages(num_pages);
-  if (!address) {
-    address = _pma_get_new_pages(num_pages);
-  }
+  if (uring->fd == -1) return;
 
-  return address;
+  munmap(uring->sqes, (uring->num_entries * sizeof(struct io_uring_sqe)));
+  if (uring->cq_ring != uring->sq_ring) munmap(uring->cq_ring, uring->cq_ring_bytes);
+  munmap(uring->sq_ring, uring->sq_ring_bytes);
+  close(uring->fd);
+
+  uring->fd = -1;
 }
 
 /**
- * Pull existing free pages from the free page run cache
+ * Commit a sync using io_uring
  *
- * Does a pass over the entire cache to see if there is an exactly-sized page
- * run. If so, it's used immediately. Otherwise, keeps track of the smallest
- * page run that can be split to accommodate the requested allocation.
+ * Counterpart to _pma_commit_sync. The sync is submitted in two steps:
  *
- * @param num_pages   # pages to allocate
+ *    [journal write] -> [journal fsync]   [snapshot fsync]   [page directory fsync]   [checksum fsync]
  *
- * @return  void*   address of the newly allocated memory (NULL if none available)
+ *    [metadata write] -> [snapshot fsync] -> [page directory write] -> ...
+ *
+ * Arrows are links; a failure cancels the rest of the chain, so the page
+ * directory isn't updated unless the metadata is durable. The metadata isn't
+ * submitted until everything in the first step has completed successfully, so
+ * it never references an incomplete journal. The dirty pages are flushed by the
+ * first snapshot fsync, so the commit mode doesn't apply. Fsyncs which the
+ * durability level skips are left out of the chains, as is the page directory
+ * fsync if it hasn't been written since it was last flushed. Writes which don't fit
+ * into the ring are submitted once everything before them has completed
+ * successfully.
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
  */
-void *
-_pma_get_cached_pages(uint64_t num_pages) {
-  PageRunCache *page_run_cache = _pma_state->free_page_runs;
-  PageRunCache *prev_page_run  = NULL;
-  PageRunCache *valid_page_run = NULL;
-  void         *address = NULL;
+int
+_pma_uring_commit(void) {
+  struct io_uring_sqe *sqe;
+  PageDirEntry        *entries = NULL;
+  uint64_t            *run_indices = NULL;
+  uint64_t            *run_lengths = NULL;
+  uint64_t            *run_starts = NULL;
+  uint64_t             num_runs = 0;
+  uint64_t             num_journal_pages = _pma_state->num_journal_pages;
+  uint64_t             journal_bytes = (num_journal_pages * sizeof(DirtyPageEntry));
+  uint64_t             journal_offset;
+  int                  snapshot_fd = _pma_state->snapshot_fd;
+  PMADurability        durability = _pma_state->durability;
+  int                  flush_page_dir = (durability != PMA_DURABILITY_NONE) && _pma_state->dir_unflushed;
+  int                  err = 0;
+
+  // Page directory updates are built in advance, since they're written
+  // asynchronously
+  if (_pma_build_page_entries(&entries, &run_indices, &run_lengths, &run_starts, &num_runs)) return -1;
+
+  // Overflow dirty page entries (see _pma_write_journal)
+  journal_offset = _pma_get_journal_offset(_pma_state->metadata, num_journal_pages);
+  _pma_state->older_journal_offset  = _pma_state->metadata->journal_offset;
+  _pma_state->older_journal_entries = _pma_state->metadata->journal_entries;
+
+  if (num_journal_pages) {
+    sqe = _pma_uring_write(_pma_state->journal_fd, _pma_state->journal_pages, journal_bytes, journal_offset);
+    if (sqe == NULL) {
+      err = errno;
+      goto commit_done;
+    }
 
-  // Do a pass looking for an exactly-sized run. While doing this, also record the smallest run still big enough to fit
-  // our data.
-  while (page_run_cache != NULL) {
-    uint64_t run_length = page_run_cache->length;
+    _pma_state->metadata->journal_offset   = journal_offset;
+    _pma_state->metadata->journal_entries  = num_journal_pages;
+    _pma_state->metadata->journal_checksum = _pma_checksum(
+        _pma_state->metadata->checksum_type,
+        _pma_state->journal_pages,
+        journal_bytes);
 
-    if (run_length == num_pages) {
-      valid_page_run = page_run_cache;
-      break;
+    // Flushed regardless of durability level; see _pma_write_journal
+    sqe->flags |= IOSQE_IO_LINK;
 
-    } else if (run_length > num_pages ) {
-      if ((valid_page_run == NULL) || (valid_page_run->length > run_length)) {
-        valid_page_run = page_run_cache;
+    if (_pma_state->uring.num_pending == _pma_state->uring.num_entries) {
+      if (_pma_uring_submit()) {
+        err = errno;
+        goto commit_done;
       }
     }
 
-    prev_page_run = page_run_cache;
-    page_run_cache = page_run_cache->next;
-  }
-
-  //  If run found...
-  if (valid_page_run != NULL) {
-    // Use it
-    address = valid_page_run->page;
+    sqe = _pma_uring_get_sqe();
+    sqe->opcode      = IORING_OP_FSYNC;
+    sqe->fd          = _pma_state->journal_fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
 
-    // If run larger than necessary by two pages...
-    if (valid_page_run->length > (num_pages + 1)) {
-      // Reduce it
-      valid_page_run->page += (num_pages * PMA_PAGE_SIZE);
-      valid_page_run->length -= num_pages;
+  } else {
+    _pma_state->metadata->journal_offset   = 0;
+    _pma_state->metadata->journal_entries  = 0;
+    _pma_state->metadata->journal_checksum = 0;
+  }
 
-    // Otherwise...
-    } else {
-      // Update cache pointers: we're going to use the whole run or we're going
-      // to move the remaining page to the single-page cache. Either way, we're
-      // going to free the run object.
-      prev_page_run->next = valid_page_run->next;
-
-      // If there's a page left...
-      if (valid_page_run->length == (num_pages + 1)) {
-        SinglePageCache *trailing_page = (SinglePageCache *)malloc(sizeof(SinglePageCache));
-
-        // Add it to the single-page cache
-        trailing_page->next = _pma_state->free_pages;
-        trailing_page->page = ((char *)address + (num_pages * PMA_PAGE_SIZE));
-        _pma_state->free_pages = trailing_page;
+  // Dirty pages, their checksums, and the page directory updates of the
+  // previous sync
+  if (durability != PMA_DURABILITY_NONE) {
+    if ((_pma_state->uring.num_pending + 3) > _pma_state->uring.num_entries) {
+      if (_pma_uring_submit()) {
+        err = errno;
+        goto commit_done;
       }
-
-      free((void *)valid_page_run);
     }
 
-    // Make pages writeable
-    mprotect(address, (num_pages * PMA_PAGE_SIZE), (PROT_READ | PROT_WRITE));
-
-    // Add pages to dirty list
-    _pma_mark_page_dirty(PTR_TO_INDEX(address), 0, FIRST, num_pages);
-  }
-
-  return address;
-}
+    sqe = _pma_uring_get_sqe();
+    sqe->opcode      = IORING_OP_FSYNC;
+    sqe->fd          = snapshot_fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
 
-/**
- * Allocate a single new page
- *
- * Allocates a new page in virtual memory. May or may not use a new dpage.
- *
- * @param status  Page status after allocation (SHARED or FIRST)
- *
- * @return  NULL    failure; errno set to error code
- * @return  void*   address of the newly allocated memory
- */
-void *
-_pma_get_new_page(PageStatus status) {
-  void     *address;
-  uint64_t  offset;
+    if (flush_page_dir) {
+      sqe = _pma_uring_get_sqe();
+      sqe->opcode      = IORING_OP_FSYNC;
+      sqe->fd          = _pma_state->page_dir_fd;
+      sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
 
-  // Get a dpage to which to map the address
-  offset = _pma_get_single_dpage();
-  if (!offset) {
-    return NULL;
+    if (_pma_state->metadata->flags & PMA_FLAG_PAGE_SUMS) {
+      sqe = _pma_uring_get_sqe();
+      sqe->opcode      = IORING_OP_FSYNC;
+      sqe->fd          = _pma_state->page_sums_fd;
+      sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
   }
 
-  // Try to map next open memory address to dpage
-  address = mmap(
-      _pma_state->metadata->arena_end,
-      PMA_PAGE_SIZE,
-      PROT_READ | PROT_WRITE,
-      MAP_SHARED | MAP_FIXED_NOREPLACE,
-      _pma_state->snapshot_fd,
-      offset);
-  if (address == MAP_FAILED) {
-    address = _pma_state->metadata->arena_end;
-    WARNING("mmap failed");
-    abort();
+  if (_pma_uring_submit()) {
+    err = errno;
+    goto commit_done;
   }
 
-  assert(address == _pma_state->metadata->arena_end);
+  if (flush_page_dir) _pma_state->dir_unflushed = 0;
 
-  // Record PMA expansion
-  _pma_state->metadata->arena_end += PMA_PAGE_SIZE;
+  // Compute checksum
+  _pma_state->metadata->checksum = _pma_checksum_metadata(_pma_state->metadata);
 
-  // Add page to dirty list
-  _pma_mark_page_dirty(PTR_TO_INDEX(address), offset, status, 1);
+  // Metadata
+  sqe = _pma_uring_write(snapshot_fd, _pma_state->metadata, PMA_PAGE_SIZE, _pma_state->meta_page_offset);
+  if (sqe == NULL) {
+    err = errno;
+    goto commit_done;
+  }
 
-  return address;
-}
+  if (durability == PMA_DURABILITY_FULL) {
+    sqe->flags |= IOSQE_IO_LINK;
 
-/**
- * Allocate multiple new pages
- *
- * Allocate 2 or more pages in virtual memory. May or may not use new dpages.
- *
- * @param num_pages   # pages to allocate
- *
- * @return  NULL    failure; errno set to error code
- * @return  void*   address of the newly allocated memory
- */
-void *
-_pma_get_new_pages(uint64_t num_pages) {
-  void     *address;
-  uint64_t  bytes = (num_pages * PMA_PAGE_SIZE);
-  uint64_t  offset = _pma_state->metadata->next_offset;
-  uint64_t  size = _pma_state->metadata->snapshot_size;
-  uint64_t  new_size = (offset + bytes);
+    sqe = _pma_uring_get_sqe();
+    sqe->opcode      = IORING_OP_FSYNC;
+    sqe->fd          = snapshot_fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  }
+
+  // Page directory
+  if (num_runs) _pma_state->dir_unflushed = 1;
+  for (uint64_t i = 0; i < num_runs; ++i) {
+    sqe->flags |= IOSQE_IO_LINK;
+
+    sqe = _pma_uring_write(
+        _pma_state->page_dir_fd,
+        (entries + run_starts[i]),
+        (run_lengths[i] * sizeof(PageDirEntry)),
+        (run_indices[i] * sizeof(PageDirEntry)));
+    if (sqe == NULL) {
+      err = errno;
+      break;
+    }
+  }
 
-  // Get new dpages. Extend snapshot backing file first, if necessary.
-  if (new_size >= size) {
-    // Multi-page allocations maybe larger than the snapshot resize increment
-    uint64_t multiplier = ((new_size - size) / PMA_SNAP_RESIZE_INC) + 1;
+  if (!err && _pma_uring_submit()) {
+    err = errno;
+  }
 
-    // Fail if snapshot file couldn't be extended
-    if (_pma_extend_snapshot_file(multiplier)) return NULL;
+  // The metadata page is only replaced once it's known to have been written
+  if (!err) {
+    _pma_state->meta_page_offset = _pma_state->meta_page_offset ? 0 : PMA_PAGE_SIZE;
   }
 
-  // Try to map dpages to address
-  address = mmap(
-      _pma_state->metadata->arena_end,
-      bytes,
-      PROT_READ | PROT_WRITE,
-      MAP_SHARED | MAP_FIXED_NOREPLACE,
-      _pma_state->snapshot_fd,
-      offset);
-  if (address == MAP_FAILED) {
-    address = _pma_state->metadata->arena_end;
-    WARNING("mmap failed");
-    abort();
+commit_done:
+  free((void *)entries);
+  free((void *)run_indices);
+  free((void *)run_lengths);
+  free((void *)run_starts);
+
+  if (err) {
+    errno = err;
+    return -1;
   }
 
-  assert(address == _pma_state->metadata->arena_end);
+  return 0;
+}
 
-  // Update offset of next open dpage
-  _pma_state->metadata->next_offset += bytes;
-  _pma_state->metadata->arena_end += bytes;
+/**
+ * Get the next free submission queue entry
+ *
+ * The caller needs to make sure that the ring isn't full.
+ *
+ * @return  struct io_uring_sqe*  zeroed submission queue entry
+ */
+struct io_uring_sqe *
+_pma_uring_get_sqe(void) {
+  URing               *uring = &(_pma_state->uring);
+  unsigned             tail = *(uring->sq_tail);
+  unsigned             index = (tail & *(uring->sq_mask));
+  struct io_uring_sqe *sqe = (uring->sqes + index);
 
-  // Add allocated pages to dirty list
-  _pma_mark_page_dirty(PTR_TO_INDEX(address), offset, FIRST, num_pages);
+  assert(uring->num_pending < uring->num_entries);
 
-  return address;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  uring->sq_array[index] = index;
+  __atomic_store_n(uring->sq_tail, (tail + 1), __ATOMIC_RELEASE);
+  ++(uring->num_pending);
+
+  return sqe;
 }
 
 /**
- * Deallocate one or more pages of allocated memory
+ * Queue a write, split into as many submission queue entries as its size needs
  *
- * @param address   Address of block to deallocated
+ * The entries are linked, so that a failed or short write cancels the rest of
+ * the chain. Each entry records its expected size as its user data; see
+ * _pma_uring_submit. If the ring fills up, everything queued so far is
+ * submitted first.
  *
- * @return  0   success
- * @return  -1  failure; errno set to error code
+ * @param fd      File descriptor to write to
+ * @param buf     Buffer to write
+ * @param bytes   Number of bytes to write (non-zero)
+ * @param offset  Offset in file at which to write
+ *
+ * @return  struct io_uring_sqe*  last submission queue entry of the write
+ * @return  NULL                  failure; errno set to error code
  */
-int
-_pma_free_pages(void *address) {
+struct io_uring_sqe *
+_pma_uring_write(int fd, const void *buf, uint64_t bytes, uint64_t offset) {
+  struct io_uring_sqe *sqe = NULL;
+  uint64_t             bytes_queued = 0;
 
-  uint32_t index = PTR_TO_INDEX(address);
-  uint32_t num_pages = 0;
+  while (bytes_queued < bytes) {
+    uint64_t len = bytes - bytes_queued;
 
-  if ((uint64_t)address & PMA_PAGE_MASK) {
-    WARNING("address does not point to the root of a page");
-    errno = EINVAL;
-    return -1;
-  }
+    if (len > PMA_URING_MAX_WRITE) len = PMA_URING_MAX_WRITE;
 
-  assert(_pma_state->page_directory.entries[index].status == FIRST);
+    if (sqe != NULL) sqe->flags |= IOSQE_IO_LINK;
+    if (_pma_state->uring.num_pending == _pma_state->uring.num_entries) {
+      if (_pma_uring_submit()) return NULL;
+    }
 
-  // Count number of pages in allocation
-  do {
-    ++num_pages;
-  } while (_pma_state->page_directory.entries[index + num_pages].status == FOLLOW);
+    sqe = _pma_uring_get_sqe();
+    sqe->opcode    = IORING_OP_WRITE;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t)((const char *)buf + bytes_queued);
+    sqe->len       = (uint32_t)len;
+    sqe->off       = offset + bytes_queued;
+    sqe->user_data = len;
 
-  // Mark pages dirty
-  _pma_mark_page_dirty(index, 0, FREE, num_pages);
+    bytes_queued += len;
+  }
 
-  return 0;
+  return sqe;
 }
 
 /**
- * Deallocate a block of memory in a shared allocation page.
+ * Submit all queued submission queue entries and wait for them to complete
  *
- * @param address   Address of block to deallocated
+ * Links can't span submissions, so the last entry is never linked to the next
+ * one. Writes which complete with fewer bytes than their expected size (their
+ * user data) fail with EIO; io_uring treats them as failures of their chains
+ * as well.
  *
  * @return  0   success
- * @return  -1  failure; errno set to error code
+ * @return  -1  failure; errno set to error code of first failed entry
  */
 int
-_pma_free_bytes(void *address) {
-  SharedPageHeader *header = (SharedPageHeader *)((uint64_t)address & (~PMA_PAGE_MASK));
-  uint8_t           slot = ((((uint64_t)address & PMA_PAGE_MASK) - sizeof(SharedPageHeader)) / (1 << header->size));
-  uint8_t           byte = slot / PMA_BITMAP_BITS;
-  uint8_t           bit = slot % PMA_BITMAP_BITS;
+_pma_uring_submit(void) {
+  URing    *uring = &(_pma_state->uring);
+  unsigned  to_submit = uring->num_pending;
+  unsigned  completed = 0;
+  unsigned  head;
+  int       err = 0;
+  int       ret;
+
+  if (to_submit) {
+    uring->sqes[(*(uring->sq_tail) - 1) & *(uring->sq_mask)].flags &= ~IOSQE_IO_LINK;
+  }
 
-  // Copy-on-write
-  _pma_copy_shared_page((void *)header);
+  while (completed < uring->num_pending) {
+    ret = (int)syscall(
+        __NR_io_uring_enter,
+        uring->fd,
+        to_submit,
+        (uring->num_pending - completed),
+        IORING_ENTER_GETEVENTS,
+        NULL,
+        0);
+    if (ret == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
 
-  if (header->bits[byte] & (1 << bit)) {
-    WARNING("bucketized address already free");
-    errno = EINVAL;
-    return -1;
+    to_submit -= ret;
+
+    // Reap completions
+    head = *(uring->cq_head);
+    while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = (uring->cqes + (head & *(uring->cq_mask)));
+
+      // Entries cancelled because of a failed link report -ECANCELED; keep the
+      // error of the entry which actually failed
+      if (!err || (err == ECANCELED)) {
+        if (cqe->res < 0) {
+          err = -(cqe->res);
+        } else if ((uint64_t)cqe->res < cqe->user_data) {
+          err = EIO;
+        }
+      }
+
+      ++head;
+      ++completed;
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
   }
 
-  header->bits[byte] += (1 << bit);
-  ++header->free;
+  uring->num_pending = 0;
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
 
   return 0;
 }
 
+#endif
+
 /**
- * Copy a shared allocation page
+ * Extend the size of the PMA backing file on disk
  *
- * @param address   Virtual memory address of shared allocation page
+ * The file is extended by the smallest multiple of the growth increment which
+ * is sufficient to reach the requested size. Unless the growth policy is
+ * sparse, disk blocks are allocated for the new space up front, so that the
+ * filesystem can allocate them contiguously, rather than one at a time while
+ * handling write faults. If the grower thread already preallocated them, this
+ * only updates the size of the file.
+ *
+ * @param min_size  Minimum new size of backing file in bytes
  *
  * @return  0   success
  * @return  -1  failure; errno set to error code
  */
 int
-_pma_copy_shared_page(void *address) {
-  SharedPageHeader *shared_page;
-  uint64_t          offset;
+_pma_extend_snapshot_file(uint64_t min_size) {
+  uint64_t  size = _pma_state->metadata->snapshot_size;
+  uint64_t  increment = _pma_get_snapshot_increment(size);
+  uint64_t  new_size = size + increment;
+  int       err = -1;
 
-  // Check if page has already been copied
-  shared_page = (SharedPageHeader*)address;
-  if (shared_page->dirty) {
-    return 0;
+  if (min_size > new_size) {
+    new_size = size + ((((min_size - size) + increment - 1) / increment) * increment);
   }
 
-  offset = _pma_get_single_dpage();
-  if (!offset) {
-    return -1;
+  if (!_pma_state->growth_policy.sparse) {
+    err = fallocate(_pma_state->snapshot_fd, 0, size, (new_size - size));
+    if (err && (errno != EOPNOTSUPP)) return -1;
   }
-
-  // Make sure dpage cache is writeable
-  if (!_pma_state->metadata->dpage_cache->dirty) {
-    if (_pma_copy_dpage_cache()) {
-      WARNING("dpage cache copy failed");
-      abort();
-    }
+  if (err) {
+    if (ftruncate(_pma_state->snapshot_fd, new_size)) return -1;
   }
 
-  // Copy page
-  _pma_copy_page(address, offset, SHARED, _pma_state->snapshot_fd);
-
-  // Mark page dirty so it isn't copied again
-  shared_page->dirty = 1;
+  // Update size in metadata
+  _pma_state->metadata->snapshot_size = new_size;
+
+  // Prepare the next extension
+  if (_pma_state->grower_running) {
+    pthread_mutex_lock(&(_pma_state->grow_lock));
+    _pma_state->grow_target = new_size + _pma_get_snapshot_increment(new_size);
+    pthread_cond_broadcast(&(_pma_state->grow_cond));
+    pthread_mutex_unlock(&(_pma_state->grow_lock));
+  }
 
   return 0;
 }
 
 /**
- * Allocate a new dpage (disk page)
- *
- * Reuse a page from the free dpage cache, if any are available.
+ * Reserve address space for the arena
  *
- * @return  0         failure; errno set to error code
- * @return  uint64_t  offset of new page in backing file
+ * Maps an inaccessible anonymous region at the start of the arena, so that
+ * nothing else (libraries, thread stacks, other mmap calls) can be mapped where
+ * the arena will grow. Pages of the arena are mapped over parts of it. If part
+ * of the range is already in use, a smaller range is reserved instead; arena
+ * pages beyond the reservation are mapped without it, as they would be without
+ * any reservation.
  */
-uint64_t
-_pma_get_single_dpage(void) {
-  uint64_t offset;
+void
+_pma_reserve_arena(void) {
+  void     *start = _pma_state->metadata->arena_start;
+  void     *address;
+  uint64_t  bytes = PAGE_ROUND_UP(_pma_arena_reserve_size);
 
-  // Get a cached dpage, if one is available
-  offset = _pma_get_cached_dpage();
-  if (!offset) {
-    // Otherwise, get a new dpage from disk
-    offset = _pma_get_disk_dpage();
-  }
+  _pma_state->arena_reserve = 0;
 
-  assert((offset % PMA_PAGE_SIZE) == 0);
+  while (bytes >= PMA_PAGE_SIZE) {
+    address = mmap(start, bytes, PROT_NONE, PMA_RESERVE_FLAGS, -1, 0);
+    if (address == start) {
+      _pma_state->arena_reserve = bytes;
+      return;
+    }
 
-  return offset;
+    // Kernels before 4.17 treat MAP_FIXED_NOREPLACE as a hint
+    if (address != MAP_FAILED) munmap(address, bytes);
+
+    bytes = PAGE_ROUND_DOWN(bytes / 2);
+  }
 }
 
 /**
- * Pull a free dpage from the dpage cache
+ * Map part of the snapshot file into the arena
  *
- * @return  offset of new page in backing file (0 if cache empty)
+ * The part of the range inside the reservation replaces it; the part beyond it
+ * mustn't replace anything. A range which straddles the end of the reservation
+ * is mapped in two parts, the part beyond it first, so that the reservation is
+ * left intact if that fails.
+ *
+ * @param address   Start of range to map
+ * @param bytes     Size of range to map in bytes
+ * @param prot      Memory protection of the mapping
+ * @param offset    Offset in the snapshot file of the first page
+ *
+ * @return  MAP_FAILED  failure; errno set to error code
+ * @return  void*       address of the mapping
  */
-uint64_t
-_pma_get_cached_dpage(void) {
-  uint64_t offset;
-  uint16_t dirty  = _pma_state->metadata->dpage_cache->dirty;
-  uint16_t size   = _pma_state->metadata->dpage_cache->size;
-  uint16_t head   = _pma_state->metadata->dpage_cache->head;
+void *
+_pma_map_arena(void *address, uint64_t bytes, int prot, uint64_t offset) {
+  uint64_t  reserve_end = ((uint64_t)_pma_state->metadata->arena_start + _pma_state->arena_reserve);
+  uint64_t  reserved_bytes;
+  void     *tail;
+  int       fd = _pma_state->snapshot_fd;
+
+  if (((uint64_t)address + bytes) <= reserve_end) {
+    return mmap(address, bytes, prot, PMA_MMAP_RESERVED_FLAGS, fd, offset);
+  }
 
-  // If the cache is empty, or there's only one page in the cache and the cache
-  // hasn't been touched yet, then exit early. If the cache hasn't been touched
-  // yet, we'll need to copy-on-write the cache as well, so if there's only one
-  // page, don't even bother.
-  if ((size == 0) || ((size == 1) && !dirty)) {
-    return 0;
+  if ((uint64_t)address >= reserve_end) {
+    return mmap(address, bytes, prot, PMA_MMAP_FLAGS, fd, offset);
   }
 
-  // Special copy-on-write for dpage cache
-  if (!dirty) {
-    if (_pma_copy_dpage_cache()) {
-      return 0;
-    }
+  reserved_bytes = (reserve_end - (uint64_t)address);
+  tail = mmap((void *)reserve_end, (bytes - reserved_bytes), prot, PMA_MMAP_FLAGS, fd, (offset + reserved_bytes));
+  if (tail == MAP_FAILED) return MAP_FAILED;
+
+  if (mmap(address, reserved_bytes, prot, PMA_MMAP_RESERVED_FLAGS, fd, offset) == MAP_FAILED) {
+    int err = errno;
+
+    munmap(tail, (bytes - reserved_bytes));
+    errno = err;
+
+    return MAP_FAILED;
   }
 
-  // TODO: macros for dealing with cache?
-  // Pop page off queue
-  offset = _pma_state->metadata->dpage_cache->queue[head];
-  _pma_state->metadata->dpage_cache->size -= 1;
-  _pma_state->metadata->dpage_cache->head = ((head + 1) % PMA_DPAGE_CACHE_SIZE);
+  return address;
+}
 
-  assert(_pma_state->metadata->dpage_cache->size != -1);
+/**
+ * Compute the size of the next extension of the PMA backing file
+ *
+ * @param size  Current size of backing file in bytes
+ *
+ * @return  uint64_t  increment in bytes (a multiple of the page size)
+ */
+uint64_t
+_pma_get_snapshot_increment(uint64_t size) {
+  uint64_t increment = _pma_state->growth_policy.increment;
+  uint64_t geometric = ((size / 100) * _pma_state->growth_policy.percent);
 
-  return offset;
+  if (geometric > increment) increment = geometric;
+
+  return PAGE_ROUND_UP(increment);
 }
 
 /**
- * Copy the free dpage cache
+ * Initialize the growth policy and the state of the grower thread
  *
- * Free dpage cache needs to be copied using copy-on-write semantics when pages
- * are added or removed.
+ * The grower thread is only started once a growth policy enables it.
  *
  * @return  0   success
  * @return  -1  failure; errno set to error code
  */
 int
-_pma_copy_dpage_cache(void) {
-  void     *address;
-  uint64_t  offset;
-  uint16_t  dirty  = _pma_state->metadata->dpage_cache->dirty;
-  uint16_t  size   = _pma_state->metadata->dpage_cache->size;
-  uint16_t  head   = _pma_state->metadata->dpage_cache->head;
+_pma_init_growth_state(void) {
+  int err;
 
-  assert(!dirty);
+  _pma_state->growth_policy.increment  = PMA_SNAP_RESIZE_INC;
+  _pma_state->growth_policy.percent    = 0;
+  _pma_state->growth_policy.sparse     = 0;
+  _pma_state->growth_policy.background = 0;
+  _pma_state->grower_running  = 0;
+  _pma_state->grower_stop     = 0;
+  _pma_state->grow_target     = 0;
+
+  err = pthread_mutex_init(&(_pma_state->grow_lock), NULL);
+  if (err) {
+    errno = err;
+    return -1;
+  }
 
-  address = (void *)_pma_state->metadata->dpage_cache;
+  err = pthread_cond_init(&(_pma_state->grow_cond), NULL);
+  if (err) {
+    pthread_mutex_destroy(&(_pma_state->grow_lock));
+    errno = err;
+    return -1;
+  }
 
-  // If pages available in cache...
-  if (size) {
-    // Use a page from the cache and record that it was used afterwards
-    offset = _pma_state->metadata->dpage_cache->queue[head];
+  return 0;
+}
 
-    _pma_copy_page(address, offset, FIRST, _pma_state->snapshot_fd);
+/**
+ * Start the grower thread, and have it preallocate the next extension of the
+ * PMA backing file
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+_pma_start_grower(void) {
+  uint64_t  size = _pma_state->metadata->snapshot_size;
+  int       err;
 
-    _pma_state->metadata->dpage_cache->size -= 1;
-    _pma_state->metadata->dpage_cache->head = ((head + 1) % PMA_DPAGE_CACHE_SIZE);
+  if (_pma_state->grower_running) return 0;
 
-  } else {
-    // Otherwise, get a brand new page from disk
-    offset = _pma_get_disk_dpage();
-    if (!offset) return -1;
+  _pma_state->grower_stop = 0;
+  _pma_state->grow_target = size + _pma_get_snapshot_increment(size);
 
-    _pma_copy_page(address, offset, FIRST, _pma_state->snapshot_fd);
+  err = pthread_create(&(_pma_state->grower), NULL, _pma_snapshot_grower, (void *)size);
+  if (err) {
+    errno = err;
+    return -1;
   }
 
-  // Mark dpage cache dirty (aka writeable)
-  _pma_state->metadata->dpage_cache->dirty = 1;
+  _pma_state->grower_running = 1;
 
   return 0;
 }
 
 /**
- * Get a new free dpage on disk
- *
- * May require extending the snapshot backing file on disk.
- *
- * @return  offset of new page in backing file (0 if failure)
+ * Stop the grower thread, if it's running
  */
-uint64_t
-_pma_get_disk_dpage(void) {
-  uint64_t offset = _pma_state->metadata->next_offset;
-  uint64_t size = _pma_state->metadata->snapshot_size;
-
-  // Get a new dpage. Extend snapshot backing file first, if necessary.
-  if (offset == size) {
-    // Fail if snapshot file couldn't be extended
-    if (_pma_extend_snapshot_file(1)) return 0;
-  }
+void
+_pma_stop_grower(void) {
+  if (!_pma_state->grower_running) return;
 
-  // Update offset of next open dpage
-  _pma_state->metadata->next_offset += PMA_PAGE_SIZE;
+  pthread_mutex_lock(&(_pma_state->grow_lock));
+  _pma_state->grower_stop = 1;
+  pthread_cond_broadcast(&(_pma_state->grow_cond));
+  pthread_mutex_unlock(&(_pma_state->grow_lock));
 
-  return offset;
+  pthread_join(_pma_state->grower, NULL);
+  _pma_state->grower_running = 0;
 }
 
 /**
- * Copy an existing page to a new dpage
+ * Grower thread for the PMA backing file
  *
- * Core copy-on-write implementation.
+ * Allocates disk blocks for the next extension of the backing file, without
+ * changing its size, so that the extension itself doesn't have to. Failures are
+ * ignored: the extension then allocates the blocks itself.
  *
- * @param address   Virtual memory address of existing page
- * @param offset    Offset of dpage in backing file to which to copy
- * @param status    Page status after copy (SHARED or FIRST)
- * @param fd        PMA file descriptor
+ * @param arg   Size of backing file up to which space is already allocated
+ *
+ * @return  NULL
  */
-void
-_pma_copy_page(void *address, uint64_t offset, PageStatus status, int fd) {
-  void     *new_address;
-  uint64_t  index = PTR_TO_INDEX(address);
-  uint16_t  tail = _pma_state->metadata->dpage_cache->tail;
+void *
+_pma_snapshot_grower(void *arg) {
+  uint64_t  done = (uint64_t)arg;
+  uint64_t  target;
 
-  new_address = mmap(
-      address,
-      PMA_PAGE_SIZE,
-      PROT_READ | PROT_WRITE,
-      MAP_SHARED | MAP_FIXED,
-      fd,
-      offset);
-  if (new_address == MAP_FAILED) {
-    WARNING(strerror(errno));
-    abort();
-  }
+  pthread_mutex_lock(&(_pma_state->grow_lock));
+  while (1) {
+    while (!_pma_state->grower_stop && (_pma_state->grow_target <= done)) {
+      pthread_cond_wait(&(_pma_state->grow_cond), &(_pma_state->grow_lock));
+    }
+    if (_pma_state->grower_stop) break;
 
-  assert(new_address == address);
+    target = _pma_state->grow_target;
+    pthread_mutex_unlock(&(_pma_state->grow_lock));
 
-  // Add previous dpage to cache
-  // Note: the dpage cache should always be writeable here, either because the dpage cache is the page we just copied,
-  // or because it was made writeable in advance by _pma_copy_shared_page
-  _pma_state->metadata->dpage_cache->queue[tail] = _pma_state->page_directory.entries[index].offset;
-  _pma_state->metadata->dpage_cache->tail = ((tail + 1) % PMA_DPAGE_CACHE_SIZE);
+    if (fallocate(_pma_state->snapshot_fd, FALLOC_FL_KEEP_SIZE, done, (target - done))) {
+      fprintf(stderr, "Error preallocating PMA snapshot file: %s\n", strerror(errno));
+    }
+    done = target;
 
-  // Add page to dirty page list
-  _pma_mark_page_dirty(index, offset, status, 1);
+    pthread_mutex_lock(&(_pma_state->grow_lock));
+  }
+  pthread_mutex_unlock(&(_pma_state->grow_lock));
+
+  return NULL;
 }
 
 /**
- * Add entry to the dirty page store
+ * Grow the page directory file if the arena is close to outgrowing it
  *
- * @param index       Index of page in page directory
- * @param offset      Offset of page in PMA file
- * @param status      Status of pages
- * @param num_pages   Number of pages represented by this entry
+ * Called on sync, so that the directory is grown well before an allocation
+ * needs an entry beyond its end.
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
  */
-void
-_pma_mark_page_dirty(uint64_t index, uint64_t offset, PageStatus status, uint32_t num_pages) {
-  DirtyPageEntry *dirty_page = (DirtyPageEntry *)_pma_state->metadata->dirty_pages;
-
-  dirty_page += _pma_state->metadata->num_dirty_pages++;
+int
+_pma_reserve_page_dir(void) {
+  uint64_t size = _pma_state->page_directory.size;
 
-  assert(_pma_state->metadata->num_dirty_pages <= PMA_DIRTY_PAGE_LIMIT);
+  if ((_pma_state->page_directory.next_index + (size >> PMA_DIR_HEADROOM_SHIFT)) <= size) return 0;
 
-  dirty_page->index     = index;
-  dirty_page->offset    = offset;
-  dirty_page->status    = status;
-  dirty_page->num_pages = num_pages;
+  return _pma_extend_page_dir(2 * size);
 }
 
 /**
- * Extend the size of the PMA backing file on disk
+ * Extend the page directory file on disk
  *
- * @param multiplier  New size = old size * multiplier
+ * The directory is doubled until it holds at least the requested number of
+ * entries. The new blocks are allocated up front, so that writing entries never
+ * has to allocate them. The directory is mapped at its maximum size, so the
+ * mapping doesn't change.
+ *
+ * @param num_entries Minimum number of entries
  *
  * @return  0   success
  * @return  -1  failure; errno set to error code
  */
 int
-_pma_extend_snapshot_file(uint64_t multiplier) {
-  int bytes;
-  int err;
+_pma_extend_page_dir(uint64_t num_entries) {
+  uint64_t  size = _pma_state->page_directory.size;
+  uint64_t  new_size = size;
+  uint64_t  max_size = (PMA_MAXIMUM_DIR_SIZE / sizeof(PageDirEntry));
+  int       err;
 
-  // Update size in metadata
-  _pma_state->metadata->snapshot_size += (multiplier * PMA_SNAP_RESIZE_INC);
+  while (new_size < num_entries) {
+    new_size *= 2;
+  }
 
-  // Extend snapshot file
-  err = lseek(_pma_state->snapshot_fd, (_pma_state->metadata->snapshot_size - 1), SEEK_SET);
-  if (err == -1) return -1;
-  do {
-    bytes = write(_pma_state->snapshot_fd, "", 1);
-  } while (!bytes);
-  if (bytes == -1) return -1;
+  if (new_size > max_size) {
+    if (num_entries > max_size) {
+      errno = ENOMEM;
+      return -1;
+    }
+
+    new_size = max_size;
+  }
+
+  err = fallocate(
+      _pma_state->page_dir_fd,
+      0,
+      (size * sizeof(PageDirEntry)),
+      ((new_size - size) * sizeof(PageDirEntry)));
+  if (err && (errno == EOPNOTSUPP)) {
+    err = ftruncate(_pma_state->page_dir_fd, (new_size * sizeof(PageDirEntry)));
+  }
+  if (err) return -1;
+
+  _pma_state->page_directory.size = new_size;
 
   return 0;
 }
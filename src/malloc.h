@@ -7,6 +7,67 @@
 #include <stddef.h>
 #include <stdint.h>
 
+//==============================================================================
+// TYPES
+//==============================================================================
+
+/**
+ * Counters describing the behaviour of the PMA since it was initialized or
+ * loaded
+ */
+typedef struct _pma_stats_t {
+  uint64_t  shared_copies;          // Shared pages copied-on-write
+  uint64_t  shared_copies_avoided;  // Shared page copy-on-writes avoided by the affinity scan: counts allocations which
+                                    // used an already-copied page from below the top of its partial page cache. The
+                                    // top page being already copied is not counted.
+  uint64_t  num_vmas;               // Kernel mappings (VMAs) currently backing the arena; read from /proc/self/maps
+  uint64_t  dpages_dropped;         // Freed dpages which never get reused because the dpage cache was full
+  uint64_t  free_page_runs;         // Runs of pages currently in the free page cache
+  uint64_t  free_pages;             // Pages currently in the free page cache
+  uint64_t  partial_pages;          // Shared pages currently in the partial shared page caches
+} PMAStats;
+
+/**
+ * How pma_sync makes the dirty pages of an event durable
+ */
+typedef enum _pma_commit_mode_t {
+  PMA_COMMIT_RANGES,  // Flush each range of dirty pages synchronously (default)
+  PMA_COMMIT_GROUP,   // Start writeback of all dirty pages, then flush the snapshot file once before and once after
+                      // writing the metadata. The page directory file is flushed separately before the metadata
+                      // if the previous sync updated it, so most syncs flush three times.
+} PMACommitMode;
+
+/**
+ * How much of a sync pma_sync flushes to disk before returning
+ *
+ * Weaker levels only flush less; the metadata is always checksummed and written
+ * to the alternate metadata page, so a crash of the process never loses a
+ * synced event. Crashes of the system may lose the most recent events. The
+ * journal of overflow dirty page entries is always flushed before the metadata
+ * which references it, since that metadata couldn't be loaded without it.
+ * Likewise, dpages freed by a sync are only reused once its metadata has been
+ * flushed, so weaker levels flush the snapshot file before reusing them.
+ */
+typedef enum _pma_durability_t {
+  PMA_DURABILITY_FULL,        // Flush dirty pages, journal, and metadata (default)
+  PMA_DURABILITY_META_ASYNC,  // Flush dirty pages and journal; leave metadata for the kernel to write back
+  PMA_DURABILITY_NONE,        // Flush only the journal; leave everything else for the kernel to write back
+} PMADurability;
+
+/**
+ * How the snapshot file grows when the arena runs out of space in it
+ *
+ * The file grows by the larger of increment and percent of its current size,
+ * rounded up to a whole page, or by a multiple of that if a large allocation
+ * needs more.
+ */
+typedef struct _pma_growth_policy_t {
+  uint64_t  increment;    // Minimum growth in bytes (default 4 GiB)
+  uint32_t  percent;      // Minimum growth as a percentage of the current size; 0 for fixed increments (default)
+  int       sparse;       // Extend the file without allocating disk blocks for the new space (default 0)
+  int       background;   // Preallocate disk blocks for the next extension on a background thread (default 0)
+} PMAGrowthPolicy;
+
 //==============================================================================
 // PROTOTYPES
 //==============================================================================
@@ -35,6 +96,19 @@ pma_init(const char *path);
 int
 pma_load(const char *path);
 
+/**
+ * Set how much address space pma_init and pma_load reserve for the arena
+ *
+ * The reservation keeps other mappings out of the range into which the arena
+ * grows. It's inaccessible and uses no memory. If part of the range is already
+ * in use, a smaller range is reserved. Must be called before pma_init or
+ * pma_load to take effect.
+ *
+ * @param bytes Size of reservation in bytes; 0 disables it (default 16 TiB)
+ */
+void
+pma_set_arena_reserve(uint64_t bytes);
+
 /**
  * Safely unload the PMA after syncing changes to PMA state
  *
@@ -59,6 +133,23 @@ pma_close(uint64_t epoch, uint64_t event);
 void *
 pma_malloc(size_t size);
 
+/**
+ * Allocate several new blocks of memory of the same size in the PMA
+ *
+ * Small allocations are made several at a time from each shared page, which is
+ * cheaper than making the same number of calls to pma_malloc.
+ *
+ * @param size    Size in bytes of each allocation
+ * @param count   Number of blocks to allocate
+ * @param results Array of at least count elements; filled with the addresses
+ *                of the newly allocated memory
+ *
+ * @return  size_t  number of blocks allocated; if less than count, errno set
+ *                  to error code
+ */
+size_t
+pma_malloc_batch(size_t size, size_t count, void **results);
+
 /**
  * Deallocate an existing block of memory in the PMA
  *
@@ -82,3 +173,130 @@ pma_free(void *address);
  */
 int
 pma_sync(uint64_t epoch, uint64_t event);
+
+/**
+ * Start syncing changes to PMA state without waiting for them to be durable
+ *
+ * The dirty pages of the current event are frozen and committed to disk by a
+ * writer thread, while the next event runs. Pages which are being committed
+ * are copied-on-write if the next event modifies them. Only one sync can be in
+ * progress at a time: a new sync first waits for the previous one to finish.
+ * Commit mode doesn't apply; the snapshot file is always flushed all at once.
+ *
+ * @param epoch Epoch of latest event successfully applied to state snapshot
+ * @param event Event number of latest event successfully applied to state
+ *              snapshot
+ *
+ * @return  0         failure; errno set to error code
+ * @return  uint64_t  ticket identifying the sync
+ */
+uint64_t
+pma_sync_async(uint64_t epoch, uint64_t event);
+
+/**
+ * Wait for an asynchronous sync to be durable
+ *
+ * @param ticket  Ticket returned by pma_sync_async
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+pma_sync_wait(uint64_t ticket);
+
+/**
+ * Check whether an asynchronous sync is durable, without waiting for it
+ *
+ * @param ticket  Ticket returned by pma_sync_async
+ *
+ * @return  1   sync is durable
+ * @return  0   sync is still in progress
+ * @return  -1  failure; errno set to error code
+ */
+int
+pma_sync_poll(uint64_t ticket);
+
+/**
+ * Read the PMA counters
+ *
+ * num_vmas and the sizes of the caches are counted when this is called. Each
+ * page whose dpage isn't adjacent on disk to the dpage of the page before it
+ * starts a new VMA; the kernel refuses new mappings once vm.max_map_count VMAs
+ * exist in the process.
+ *
+ * @param stats Filled with the current values of the counters
+ */
+void
+pma_get_stats(PMAStats *stats);
+
+/**
+ * Choose how pma_sync makes the dirty pages of an event durable
+ *
+ * Applies until the PMA is closed. Must be called after pma_init or pma_load.
+ *
+ * @param mode  Commit mode
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+pma_set_commit_mode(PMACommitMode mode);
+
+/**
+ * Choose how much of a sync is flushed to disk before it completes
+ *
+ * Applies to pma_sync and pma_sync_async until the PMA is closed. Must be
+ * called after pma_init or pma_load.
+ *
+ * @param durability  Durability level
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+pma_set_durability(PMADurability durability);
+
+/**
+ * Choose how the snapshot file grows
+ *
+ * Applies until the PMA is closed. Must be called after pma_init or pma_load.
+ * Sparse growth can't be combined with background preallocation.
+ *
+ * @param policy  Growth policy
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+pma_set_growth_policy(const PMAGrowthPolicy *policy);
+
+/**
+ * Enable or disable checksums of the data pages in the snapshot file
+ *
+ * While enabled, each sync records a checksum for every page it writes, which
+ * pma_scrub can later verify. The setting is saved with the next sync and
+ * persists across loads. Pages which haven't been written since checksums were
+ * enabled aren't verified. Disabling discards all recorded checksums.
+ *
+ * @param enable  Nonzero to record checksums
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+pma_set_page_sums(int enable);
+
+/**
+ * Verify the recorded checksums of all data pages committed by a sync
+ *
+ * Pages are read back from the snapshot file, in parallel. Pages which fail
+ * verification are reported on stderr.
+ *
+ * @param num_threads   Number of threads to verify pages with (0 for 1)
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code (EILSEQ if any page failed
+ *              verification)
+ */
+int
+pma_scrub(unsigned int num_threads);
@@ -1,14 +1,467 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include "../includes/checksum.h"
 #include "../malloc.h"
 
+//==============================================================================
+// Macros
+//==============================================================================
+
+/**
+ * Constants of snapshots written by PMA_DATA_VERSION 1
+ */
+#define V1_MAGIC_CODE   0xBADDECAFC0FFEE00
+#define V1_PAGE_SIZE    4096
+#define V1_ARENA_ADDR   0x10000
+#define V1_SNAP_SIZE    1073741824
+#define V1_DIR_SIZE     4194304
+#define V1_STATUS_FIRST 3
+
+/**
+ * Contents of the pages of the allocation in the version 1 snapshot
+ */
+#define V1_PATTERN      0x5A
+
+/**
+ * Layout of the dpage cache written by PMA_DATA_VERSION 2: a queue of
+ * V2_CACHE_SIZE dpages (PMA_DPAGE_CACHE_SIZE_V2). The test queue is full, and
+ * its front V2_CACHE_REUSABLE entries are reusable.
+ */
+#define V2_CACHE_SIZE     511
+#define V2_CACHE_HEAD     5
+#define V2_CACHE_REUSABLE 200
+
+/**
+ * Size of the initial page directory file (PMA_INIT_DIR_SIZE), and the size of
+ * the arena which its entries cover
+ */
+#define DIR_INIT_SIZE   2097152
+#define DIR_INIT_ARENA  1073741824
+
+/**
+ * Size of the initial snapshot file (PMA_INIT_SNAP_SIZE), and the growth
+ * increment of the policies under test
+ */
+#define GROW_INIT_SIZE  1073741824
+#define GROW_INCREMENT  16777216
+
+/**
+ * Number of large allocations made by fill_and_reload, with a sync after each
+ */
+#define FILL_NUM_ALLOCS 3
+
+/**
+ * Start of the arena (PMA_SNAPSHOT_ADDR), its page size, and the size of the
+ * small arena reservations under test
+ */
+#define ARENA_ADDR      0x10000
+#define ARENA_PAGE      4096
+#define ARENA_RESERVE   (8 * ARENA_PAGE)
+
+/**
+ * Bits of a page directory entry which hold the page status rather than the
+ * offset of its dpage (PMA_DIR_STATUS_MASK)
+ */
+#define DIR_STATUS_MASK 0x7UL
+
+/**
+ * Number of events in which the dpage reuse test rewrites its page
+ */
+#define HELD_NUM_EVENTS 6
+
+/**
+ * Number of 64 byte allocations made by the shared page release test; enough to
+ * fill two shared pages and start a third
+ */
+#define RELEASE_NUM_ALLOCS  128
+
+/**
+ * Number of separate single-page free runs made by the node pool test; their
+ * cache nodes take several pool blocks (PMA_NODE_POOL_BLOCK_SIZE) per height
+ */
+#define POOL_NUM_RUNS   8192
+
+/**
+ * Number of single-page allocations made in one event by the overflow journal
+ * test; well over the number of dirty page entries which fit in the metadata
+ * page (PMA_DIRTY_PAGE_LIMIT)
+ */
+#define JOURNAL_NUM_ALLOCS  512
+
+//==============================================================================
+// Types
+//==============================================================================
+
+/**
+ * Page directory entry, dirty page entry, and metadata as written by
+ * PMA_DATA_VERSION 1
+ */
+typedef struct {
+  uint64_t  offset;
+  uint32_t  status;
+} PageDirEntryV1;
+
+typedef struct {
+  uint64_t  index;
+  uint64_t  offset;
+  uint32_t  num_pages;
+  uint32_t  status;
+} DirtyPageEntryV1;
+
+typedef struct {
+  uint64_t          magic_code;
+  uint32_t          checksum;
+  uint32_t          version;
+  uint64_t          epoch;
+  uint64_t          event;
+  void             *arena_start;
+  void             *arena_end;
+  void             *shared_pages[10];
+  void             *dpage_cache;
+  uint64_t          snapshot_size;
+  uint64_t          next_offset;
+  uint8_t           num_dirty_pages;
+  DirtyPageEntryV1  dirty_pages[];
+} MetadataV1;
+
+/**
+ * Metadata and dpage cache as written by PMA_DATA_VERSION 2
+ */
+typedef struct {
+  uint64_t  magic_code;
+  uint32_t  checksum;
+  uint16_t  version;
+  uint16_t  checksum_type;
+  uint64_t  epoch;
+  uint64_t  event;
+  void     *arena_start;
+  void     *arena_end;
+  void     *shared_pages[10];
+  void     *dpage_cache;
+  uint64_t  snapshot_size;
+  uint64_t  next_offset;
+  uint64_t  journal_offset;
+  uint64_t  journal_entries;
+  uint32_t  journal_checksum;
+  uint8_t   num_dirty_pages;
+  uint8_t   flags;
+} MetadataV2;
+
+typedef struct {
+  uint8_t   dirty;
+  uint16_t  size;
+  uint16_t  head;
+  uint16_t  tail;
+  uint64_t  queue[];
+} DPageCacheV2;
+
 //==============================================================================
 // Functions
 //==============================================================================
 
+/**
+ * Write a snapshot in the format of PMA_DATA_VERSION 1
+ *
+ * The arena consists of the dpage cache, followed by a two-page allocation
+ * filled with V1_PATTERN. The allocation is only recorded in the dirty page
+ * list of the metadata, so loading the snapshot has to replay it.
+ *
+ * @param path  Directory in which to create the backing files
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+write_v1_snapshot(const char *path) {
+  char            filepath[256];
+  char            page[V1_PAGE_SIZE];
+  MetadataV1     *metadata = (MetadataV1 *)page;
+  PageDirEntryV1  entry = { (2 * V1_PAGE_SIZE), V1_STATUS_FIRST };
+  int             fd;
+
+  sprintf(filepath, "%s/.bin", path);
+  if (mkdir(path, 0777) || mkdir(filepath, 0777)) return -1;
+
+  // Snapshot: two metadata pages, the (empty) dpage cache, and the allocation
+  sprintf(filepath, "%s/.bin/snap.bin", path);
+  fd = open(filepath, (O_RDWR | O_CREAT), 0660);
+  if ((fd == -1) || ftruncate(fd, V1_SNAP_SIZE)) return -1;
+
+  memset(page, 0, V1_PAGE_SIZE);
+  metadata->magic_code      = V1_MAGIC_CODE;
+  metadata->version         = 1;
+  metadata->epoch           = 1;
+  metadata->event           = 1;
+  metadata->arena_start     = (void *)V1_ARENA_ADDR;
+  metadata->arena_end       = (void *)(V1_ARENA_ADDR + (3 * V1_PAGE_SIZE));
+  metadata->dpage_cache     = (void *)V1_ARENA_ADDR;
+  metadata->snapshot_size   = V1_SNAP_SIZE;
+  metadata->next_offset     = (5 * V1_PAGE_SIZE);
+  metadata->num_dirty_pages = 1;
+  metadata->dirty_pages[0].index     = 1;
+  metadata->dirty_pages[0].offset    = (3 * V1_PAGE_SIZE);
+  metadata->dirty_pages[0].num_pages = 2;
+  metadata->dirty_pages[0].status    = V1_STATUS_FIRST;
+  metadata->checksum = crc_32((const unsigned char *)page, V1_PAGE_SIZE);
+
+  if (
+      (pwrite(fd, page, V1_PAGE_SIZE, 0) != V1_PAGE_SIZE) ||
+      (pwrite(fd, page, V1_PAGE_SIZE, V1_PAGE_SIZE) != V1_PAGE_SIZE)) {
+    return -1;
+  }
+
+  memset(page, V1_PATTERN, V1_PAGE_SIZE);
+  if (
+      (pwrite(fd, page, V1_PAGE_SIZE, (3 * V1_PAGE_SIZE)) != V1_PAGE_SIZE) ||
+      (pwrite(fd, page, V1_PAGE_SIZE, (4 * V1_PAGE_SIZE)) != V1_PAGE_SIZE)) {
+    return -1;
+  }
+  close(fd);
+
+  // Page directory: only the dpage cache has an entry
+  sprintf(filepath, "%s/.bin/page.bin", path);
+  fd = open(filepath, (O_RDWR | O_CREAT), 0660);
+  if ((fd == -1) || ftruncate(fd, V1_DIR_SIZE)) return -1;
+  if (pwrite(fd, &entry, sizeof(PageDirEntryV1), 0) != sizeof(PageDirEntryV1)) return -1;
+  close(fd);
+
+  return 0;
+}
+
+/**
+ * Write a snapshot in the format of PMA_DATA_VERSION 2 with a full dpage cache
+ *
+ * The arena consists only of the dpage cache. Its queue wraps around, and head
+ * and tail meet since it's full. The dpages it lists are the V2_CACHE_SIZE
+ * dpages directly after the cache, so that the snapshot file continues at
+ * next_offset.
+ *
+ * @param path  Directory in which to create the backing files
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+write_v2_snapshot(const char *path) {
+  char          filepath[256];
+  char          page[ARENA_PAGE];
+  MetadataV2   *metadata = (MetadataV2 *)page;
+  DPageCacheV2 *dpage_cache = (DPageCacheV2 *)page;
+  uint64_t      entry = ((2 * ARENA_PAGE) | V1_STATUS_FIRST);
+  int           fd;
+
+  sprintf(filepath, "%s/.bin", path);
+  if (mkdir(path, 0777) || mkdir(filepath, 0777)) return -1;
+
+  // Snapshot: two metadata pages, the dpage cache, and the dpages it lists
+  sprintf(filepath, "%s/.bin/snap.bin", path);
+  fd = open(filepath, (O_RDWR | O_CREAT), 0660);
+  if ((fd == -1) || ftruncate(fd, GROW_INIT_SIZE)) return -1;
+
+  memset(page, 0, ARENA_PAGE);
+  metadata->magic_code    = V1_MAGIC_CODE;
+  metadata->version       = 2;
+  metadata->epoch         = 1;
+  metadata->event         = 1;
+  metadata->arena_start   = (void *)ARENA_ADDR;
+  metadata->arena_end     = (void *)(ARENA_ADDR + ARENA_PAGE);
+  metadata->dpage_cache   = (void *)ARENA_ADDR;
+  metadata->snapshot_size = GROW_INIT_SIZE;
+  metadata->next_offset   = ((3 + V2_CACHE_SIZE) * ARENA_PAGE);
+  metadata->checksum = crc_32((const unsigned char *)page, ARENA_PAGE);
+
+  if (
+      (pwrite(fd, page, ARENA_PAGE, 0) != ARENA_PAGE) ||
+      (pwrite(fd, page, ARENA_PAGE, ARENA_PAGE) != ARENA_PAGE)) {
+    return -1;
+  }
+
+  memset(page, 0, ARENA_PAGE);
+  dpage_cache->size = V2_CACHE_REUSABLE;
+  dpage_cache->head = V2_CACHE_HEAD;
+  dpage_cache->tail = V2_CACHE_HEAD;
+  for (uint64_t i = 0; i < V2_CACHE_SIZE; ++i) {
+    dpage_cache->queue[(V2_CACHE_HEAD + i) % V2_CACHE_SIZE] = ((3 + i) * ARENA_PAGE);
+  }
+
+  if (pwrite(fd, page, ARENA_PAGE, (2 * ARENA_PAGE)) != ARENA_PAGE) return -1;
+  close(fd);
+
+  // Page directory: only the dpage cache has an entry
+  sprintf(filepath, "%s/.bin/page.bin", path);
+  fd = open(filepath, (O_RDWR | O_CREAT), 0660);
+  if ((fd == -1) || ftruncate(fd, DIR_INIT_SIZE)) return -1;
+  if (pwrite(fd, &entry, sizeof(uint64_t), 0) != sizeof(uint64_t)) return -1;
+  close(fd);
+
+  return 0;
+}
+
+/**
+ * Make a few large allocations in a new PMA, syncing after each, then reload it
+ * and check their contents
+ *
+ * Only the first and last byte of each allocation are written, so that the
+ * allocations take up address space, page directory entries, and room in the
+ * snapshot file, but hardly any dirty pages.
+ *
+ * @param path    Directory in which to create the backing files
+ * @param policy  Growth policy of the snapshot file
+ * @param bytes   Size of each allocation
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+fill_and_reload(const char *path, const PMAGrowthPolicy *policy, uint64_t bytes) {
+  char     *ptrs[FILL_NUM_ALLOCS];
+  uint64_t  event = 1;
+
+  if (pma_init(path) || pma_set_growth_policy(policy)) return -1;
+
+  for (int i = 0; i < FILL_NUM_ALLOCS; ++i) {
+    ptrs[i] = (char *)pma_malloc(bytes);
+    if (ptrs[i] == NULL) return -1;
+
+    ptrs[i][0] = i;
+    ptrs[i][bytes - 1] = i;
+    if (pma_sync(1UL, event++)) return -1;
+  }
+
+  if (pma_close(1UL, event++) || pma_load(path)) return -1;
+
+  for (int i = 0; i < FILL_NUM_ALLOCS; ++i) {
+    if ((ptrs[i][0] != i) || (ptrs[i][bytes - 1] != i)) {
+      errno = EILSEQ;
+      return -1;
+    }
+
+    if (pma_free(ptrs[i])) return -1;
+  }
+
+  return pma_close(1UL, event);
+}
+
+/**
+ * Read the offset of the dpage of an arena page from the page directory file
+ *
+ * @param path      Directory of the backing files
+ * @param address   Page of the arena
+ *
+ * @return  0         failure; errno set to error code
+ * @return  uint64_t  offset of dpage in snapshot file
+ */
+uint64_t
+read_dpage_offset(const char *path, void *address) {
+  char      filepath[256];
+  uint64_t  entry;
+  ssize_t   bytes_in;
+  int       fd;
+
+  sprintf(filepath, "%s/.bin/page.bin", path);
+  fd = open(filepath, O_RDONLY);
+  if (fd == -1) return 0;
+
+  bytes_in = pread(
+      fd,
+      &entry,
+      sizeof(uint64_t),
+      ((((uint64_t)address - ARENA_ADDR) / ARENA_PAGE) * sizeof(uint64_t)));
+  close(fd);
+  if (bytes_in != sizeof(uint64_t)) return 0;
+
+  return (entry & ~DIR_STATUS_MASK);
+}
+
+/**
+ * Write a snapshot whose newest sync overflowed into the journal, as left by a
+ * process which crashed right after it
+ *
+ * A child process makes JOURNAL_NUM_ALLOCS single-page allocations in one
+ * event, each filled with the low byte of its position, syncs, and exits
+ * without closing the PMA. The page directory entries of the allocations are
+ * then cleared, so that loading the snapshot has to replay the dirty page
+ * entries of the metadata page and the journal.
+ *
+ * @param path  Directory in which to create the backing files
+ * @param ptrs  Filled with the addresses of the allocations
+ *
+ * @return  0   success
+ * @return  -1  failure; errno set to error code
+ */
+int
+write_journaled_snapshot(const char *path, char **ptrs) {
+  char      filepath[256];
+  uint64_t  entry = 0;
+  ssize_t   bytes_in;
+  pid_t     pid;
+  int       pipe_fds[2];
+  int       status;
+  int       fd;
+  struct stat st;
+
+  if (pipe(pipe_fds)) return -1;
+
+  pid = fork();
+  if (pid == -1) return -1;
+
+  if (pid == 0) {
+    close(pipe_fds[0]);
+    if (pma_init(path)) _exit(1);
+
+    for (int i = 0; i < JOURNAL_NUM_ALLOCS; ++i) {
+      ptrs[i] = (char *)pma_malloc(ARENA_PAGE);
+      if (ptrs[i] == NULL) _exit(1);
+      memset(ptrs[i], i, ARENA_PAGE);
+    }
+
+    if (pma_sync(1UL, 1UL)) _exit(1);
+
+    bytes_in = write(pipe_fds[1], ptrs, (JOURNAL_NUM_ALLOCS * sizeof(char *)));
+    _exit(bytes_in != (ssize_t)(JOURNAL_NUM_ALLOCS * sizeof(char *)));
+  }
+
+  close(pipe_fds[1]);
+  bytes_in = read(pipe_fds[0], ptrs, (JOURNAL_NUM_ALLOCS * sizeof(char *)));
+  close(pipe_fds[0]);
+  if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || WEXITSTATUS(status)) return -1;
+  if (bytes_in != (ssize_t)(JOURNAL_NUM_ALLOCS * sizeof(char *))) return -1;
+
+  // The dirty page entries must have overflowed into the journal
+  sprintf(filepath, "%s/.bin/jrnl.bin", path);
+  if (stat(filepath, &st)) return -1;
+  if (st.st_size == 0) {
+    errno = EILSEQ;
+    return -1;
+  }
+
+  sprintf(filepath, "%s/.bin/page.bin", path);
+  fd = open(filepath, O_RDWR);
+  if (fd == -1) return -1;
+
+  for (int i = 0; i < JOURNAL_NUM_ALLOCS; ++i) {
+    if (pwrite(
+        fd,
+        &entry,
+        sizeof(uint64_t),
+        ((((uint64_t)ptrs[i] - ARENA_ADDR) / ARENA_PAGE) * sizeof(uint64_t))) != sizeof(uint64_t)) {
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+
+  return 0;
+}
+
 int
 main(int argc, char** argv) {
 
@@ -23,12 +476,37 @@ main(int argc, char** argv) {
   void *ptr_9;
   void *ptr_10;
   void *ptr_11;
+  void *small_ptrs[1024];
+  char *journal_ptrs[JOURNAL_NUM_ALLOCS];
+  char *pool_ptrs[2 * POOL_NUM_RUNS];
+  PMAGrowthPolicy policy;
+  uint64_t dpages[HELD_NUM_EVENTS];
+  void *blocker;
+  void *probe;
+  PMAGrowthPolicy growth_policies[] = {
+    { GROW_INCREMENT, 0,  0, 0 },   // Fixed increments, preallocated
+    { GROW_INCREMENT, 10, 0, 0 },   // Proportional increments
+    { GROW_INCREMENT, 0,  1, 0 },   // Sparse
+    { GROW_INCREMENT, 0,  0, 1 },   // Preallocated in the background
+  };
+  char path[256];
+  uint64_t ticket;
+  PMAStats stats;
+  PMAStats loaded_stats;
+  struct stat st;
+  char byte;
+  int fd;
 
   if (pma_init(argv[1])) {
     fprintf(stderr, "init not sane:\n");
     goto test_error;
   };
 
+  if (pma_set_page_sums(1)) {
+    fprintf(stderr, "page sums not sane:\n");
+    goto test_error;
+  }
+
   ptr_1 = pma_malloc(8);
   ptr_2 = pma_malloc(16);
   ptr_3 = pma_malloc(32);
@@ -58,11 +536,757 @@ main(int argc, char** argv) {
   pma_free(ptr_10);
   pma_free(ptr_11);
 
+  if (pma_sync(1UL, 2UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  // Fill several shared pages, then free every other slot and refill them
+  for (int i = 0; i < 1024; ++i) {
+    small_ptrs[i] = pma_malloc(16);
+    if (small_ptrs[i] == NULL) {
+      fprintf(stderr, "small malloc not sane:\n");
+      goto test_error;
+    }
+  }
+
+  if (pma_sync(1UL, 3UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  for (int i = 0; i < 1024; i += 2) {
+    if (pma_free(small_ptrs[i])) {
+      fprintf(stderr, "small free not sane:\n");
+      goto test_error;
+    }
+  }
+
+  for (int i = 0; i < 1024; i += 2) {
+    small_ptrs[i] = pma_malloc(16);
+    if (small_ptrs[i] == NULL) {
+      fprintf(stderr, "small malloc not sane:\n");
+      goto test_error;
+    }
+  }
+
+  for (int i = 0; i < 1024; ++i) {
+    pma_free(small_ptrs[i]);
+  }
+
+  // Allocate slots several at a time, across multiple shared pages
+  if (pma_malloc_batch(32, 600, small_ptrs) != 600) {
+    fprintf(stderr, "batch malloc not sane:\n");
+    goto test_error;
+  }
+
+  for (int i = 0; i < 600; ++i) {
+    pma_free(small_ptrs[i]);
+  }
+
+  if (pma_malloc_batch(1024, 7, small_ptrs) != 7) {
+    fprintf(stderr, "batch malloc not sane:\n");
+    goto test_error;
+  }
+
+  for (int i = 0; i < 7; ++i) {
+    pma_free(small_ptrs[i]);
+  }
+
+  // Remaining syncs flush the snapshot file once per event
+  if (pma_set_commit_mode(PMA_COMMIT_GROUP)) {
+    fprintf(stderr, "commit mode not sane:\n");
+    goto test_error;
+  }
+
+  // Free allocations made since the last sync
+  small_ptrs[0] = pma_malloc(3 * 8192);
+  small_ptrs[1] = pma_malloc(8192);
+  if ((small_ptrs[0] == NULL) || (small_ptrs[1] == NULL)) {
+    fprintf(stderr, "large malloc not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_free(small_ptrs[0]) || pma_free(small_ptrs[1])) {
+    fprintf(stderr, "unsynced free not sane:\n");
+    goto test_error;
+  }
+
+  // Leave the metadata of remaining syncs for the kernel to write back
+  if (pma_set_durability(PMA_DURABILITY_META_ASYNC)) {
+    fprintf(stderr, "durability not sane:\n");
+    goto test_error;
+  }
+
+  // Commit an event in the background while the next one runs
+  ticket = pma_sync_async(1UL, 4UL);
+  if (!ticket) {
+    fprintf(stderr, "async sync not sane:\n");
+    goto test_error;
+  }
+
+  small_ptrs[0] = pma_malloc(64);
+  small_ptrs[1] = pma_malloc(2 * 8192);
+  if ((small_ptrs[0] == NULL) || (small_ptrs[1] == NULL)) {
+    fprintf(stderr, "malloc during async sync not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_sync_wait(ticket)) {
+    fprintf(stderr, "async sync not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_free(small_ptrs[0]) || pma_free(small_ptrs[1])) {
+    fprintf(stderr, "free after async sync not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_scrub(2)) {
+    fprintf(stderr, "scrub not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_close(1UL, 5UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  // Reload the snapshot and check the page directory scan
+  if (pma_load(argv[1])) {
+    fprintf(stderr, "load not sane:\n");
+    goto test_error;
+  };
+
+  ptr_1 = pma_malloc(8);
+  ptr_2 = pma_malloc(3 * 8192);
+  if ((ptr_1 == NULL) || (ptr_2 == NULL)) {
+    fprintf(stderr, "malloc after load not sane:\n");
+    goto test_error;
+  }
+
+  // The arena is small and mostly linear on disk, so only a few VMAs map it
+  pma_get_stats(&stats);
+  if ((stats.num_vmas == 0) || (stats.num_vmas > 64)) {
+    fprintf(stderr, "vma count not sane: %lu\n", stats.num_vmas);
+    goto test_error;
+  }
+
+  // Adjacent freed runs are merged, and can be reused by a larger allocation.
+  // These are larger than any free run, so they're new pages, adjacent both in
+  // memory and on disk. The first one stays allocated, so that no free run
+  // comes directly before the other two.
+  ptr_6 = pma_malloc(32 * 8192);
+  ptr_3 = pma_malloc(32 * 8192);
+  ptr_4 = pma_malloc(32 * 8192);
+  if ((ptr_6 == NULL) || (ptr_3 == NULL) || (ptr_4 == NULL) || pma_sync(1UL, 6UL)) {
+    fprintf(stderr, "malloc after load not sane:\n");
+    goto test_error;
+  }
+
+  // Free them in separate events, so they're separate runs until merged
+  pma_free(ptr_3);
+  if (pma_sync(1UL, 7UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  pma_free(ptr_4);
+  if (pma_sync(1UL, 8UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  if (ptr_4 != ((char *)ptr_3 + (32 * 8192))) {
+    fprintf(stderr, "adjacent malloc not sane:\n");
+    goto test_error;
+  }
+
+  // The merged run is the only one which fits, so it's reused from its start
+  ptr_5 = pma_malloc(64 * 8192);
+  if (ptr_5 != ptr_3) {
+    fprintf(stderr, "free page coalescing not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_close(1UL, 9UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  // Reload from the extent table written by the close
+  if (pma_load(argv[1])) {
+    fprintf(stderr, "load from extents not sane:\n");
+    goto test_error;
+  };
+
+  pma_get_stats(&loaded_stats);
+  if (!loaded_stats.free_page_runs || !loaded_stats.partial_pages) {
+    fprintf(stderr, "caches after load from extents not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_close(1UL, 10UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  // Corrupt the extent table, so that the page directory is scanned instead. The
+  // caches rebuilt by the scan must match those restored from the extents.
+  sprintf(path, "%s/.bin/extn.bin", argv[1]);
+  fd = open(path, O_RDWR);
+  if ((fd == -1) || fstat(fd, &st) || (pread(fd, &byte, 1, (st.st_size - 1)) != 1)) {
+    fprintf(stderr, "extent table corruption not sane:\n");
+    goto test_error;
+  }
+  byte = ~byte;
+  if (pwrite(fd, &byte, 1, (st.st_size - 1)) != 1) {
+    fprintf(stderr, "extent table corruption not sane:\n");
+    goto test_error;
+  }
+  close(fd);
+
+  if (pma_load(argv[1])) {
+    fprintf(stderr, "load from page directory not sane:\n");
+    goto test_error;
+  };
+
+  pma_get_stats(&stats);
+  if (
+      (stats.free_page_runs != loaded_stats.free_page_runs) ||
+      (stats.free_pages != loaded_stats.free_pages) ||
+      (stats.partial_pages != loaded_stats.partial_pages)) {
+    fprintf(stderr, "caches after load from page directory not sane: %lu/%lu/%lu vs. %lu/%lu/%lu\n",
+        stats.free_page_runs, stats.free_pages, stats.partial_pages,
+        loaded_stats.free_page_runs, loaded_stats.free_pages, loaded_stats.partial_pages);
+    goto test_error;
+  }
+
+  if (pma_close(1UL, 11UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  // Outgrow the initial page directory, then check that the extended directory
+  // is reloaded. The snapshot file grows sparsely, since the pages are barely
+  // touched.
+  policy.increment  = DIR_INIT_ARENA;
+  policy.percent    = 0;
+  policy.sparse     = 1;
+  policy.background = 0;
+
+  sprintf(path, "%s/dir", argv[1]);
+  if (fill_and_reload(path, &policy, (DIR_INIT_ARENA / 2))) {
+    fprintf(stderr, "allocation past page directory not sane:\n");
+    goto test_error;
+  }
+
+  sprintf(path, "%s/dir/.bin/page.bin", argv[1]);
+  if (stat(path, &st) || (st.st_size <= DIR_INIT_SIZE)) {
+    fprintf(stderr, "page directory extension not sane:\n");
+    goto test_error;
+  }
+
+  // Outgrow the initial snapshot file under each growth policy. The first two
+  // allocations fit, and the third grows the file by several increments at once.
+  for (size_t i = 0; i < (sizeof(growth_policies) / sizeof(PMAGrowthPolicy)); ++i) {
+    sprintf(path, "%s/grow_%zu", argv[1], i);
+    if (fill_and_reload(path, &(growth_policies[i]), ((GROW_INIT_SIZE / 3) + GROW_INCREMENT))) {
+      fprintf(stderr, "growth policy %zu not sane:\n", i);
+      goto test_error;
+    }
+
+    sprintf(path, "%s/grow_%zu/.bin/snap.bin", argv[1], i);
+    if (stat(path, &st) || (st.st_size <= GROW_INIT_SIZE)) {
+      fprintf(stderr, "snapshot file growth %zu not sane:\n", i);
+      goto test_error;
+    }
+  }
+
+  // Load a snapshot written by PMA_DATA_VERSION 1. Once it has been synced, it's
+  // loaded again in the current format.
+  sprintf(path, "%s/v1", argv[1]);
+  if (write_v1_snapshot(path)) {
+    fprintf(stderr, "version 1 snapshot not sane:\n");
+    goto test_error;
+  }
+
+  for (uint64_t event = 2; event < 4; ++event) {
+    if (pma_load(path)) {
+      fprintf(stderr, "version 1 load not sane:\n");
+      goto test_error;
+    };
+
+    for (int i = 0; i < (2 * V1_PAGE_SIZE); ++i) {
+      if (((unsigned char *)V1_ARENA_ADDR)[V1_PAGE_SIZE + i] != V1_PATTERN) {
+        fprintf(stderr, "version 1 allocation not sane:\n");
+        goto test_error;
+      }
+    }
+
+    ptr_1 = pma_malloc(8);
+    ptr_2 = pma_malloc(3 * 8192);
+    if ((ptr_1 == NULL) || (ptr_2 == NULL) || pma_free(ptr_2)) {
+      fprintf(stderr, "malloc after version 1 load not sane:\n");
+      goto test_error;
+    }
+
+    if (pma_close(1UL, event)) {
+      fprintf(stderr, "sync not sane:\n");
+      goto test_error;
+    };
+  }
+
+  // Load a snapshot written by PMA_DATA_VERSION 2 whose dpage cache is full. Its
+  // dpages are converted to runs, so copying a shared page reuses one of them
+  // rather than extending the snapshot file.
+  sprintf(path, "%s/v2", argv[1]);
+  if (write_v2_snapshot(path)) {
+    fprintf(stderr, "version 2 snapshot not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_load(path)) {
+    fprintf(stderr, "version 2 load not sane:\n");
+    goto test_error;
+  };
+
+  for (uint64_t event = 2; event < 4; ++event) {
+    small_ptrs[event] = pma_malloc(64);
+    if (small_ptrs[event] == NULL) {
+      fprintf(stderr, "malloc after version 2 load not sane:\n");
+      goto test_error;
+    }
+    memset(small_ptrs[event], V1_PATTERN, 64);
+
+    if (pma_sync(1UL, event)) {
+      fprintf(stderr, "sync not sane:\n");
+      goto test_error;
+    }
+  }
+
+  dpages[0] = read_dpage_offset(path, small_ptrs[3]);
+  if (
+      (((uint64_t)small_ptrs[3] / ARENA_PAGE) != ((uint64_t)small_ptrs[2] / ARENA_PAGE)) ||
+      (dpages[0] < (3 * ARENA_PAGE)) ||
+      (dpages[0] >= ((3 + V2_CACHE_SIZE) * ARENA_PAGE))) {
+    fprintf(stderr, "version 2 dpage cache conversion not sane:\n");
+    goto test_error;
+  }
+
+  if (
+      pma_close(1UL, 4UL) ||
+      pma_load(path) ||
+      (((unsigned char *)small_ptrs[2])[63] != V1_PATTERN) ||
+      (((unsigned char *)small_ptrs[3])[63] != V1_PATTERN)) {
+    fprintf(stderr, "reload after version 2 load not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_close(1UL, 5UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  // Without durability, the metadata of a sync may not reach disk before the
+  // dpages it frees are reused, so they're held for a sync longer. Each
+  // allocation copies the same shared page, which must never be copied back to
+  // the dpage it had two events before.
+  sprintf(path, "%s/held", argv[1]);
+  if (pma_init(path) || pma_set_durability(PMA_DURABILITY_NONE)) {
+    fprintf(stderr, "init not sane:\n");
+    goto test_error;
+  };
+
+  for (int i = 0; i < HELD_NUM_EVENTS; ++i) {
+    small_ptrs[i] = pma_malloc(64);
+    if (
+        (small_ptrs[i] == NULL) ||
+        (((uint64_t)small_ptrs[i] / ARENA_PAGE) != ((uint64_t)small_ptrs[0] / ARENA_PAGE))) {
+      fprintf(stderr, "small malloc not sane:\n");
+      goto test_error;
+    }
+
+    memset(small_ptrs[i], i, 64);
+    if (pma_sync(1UL, (i + 1))) {
+      fprintf(stderr, "sync not sane:\n");
+      goto test_error;
+    }
+
+    dpages[i] = read_dpage_offset(path, small_ptrs[0]);
+    if (!dpages[i] || ((i > 0) && (dpages[i] == dpages[i - 1])) || ((i > 1) && (dpages[i] == dpages[i - 2]))) {
+      fprintf(stderr, "held dpage reuse not sane:\n");
+      goto test_error;
+    }
+  }
+
+  if (pma_close(1UL, (HELD_NUM_EVENTS + 1)) || pma_load(path)) {
+    fprintf(stderr, "reload after non-durable syncs not sane:\n");
+    goto test_error;
+  }
+
+  for (int i = 0; i < HELD_NUM_EVENTS; ++i) {
+    for (int j = 0; j < 64; ++j) {
+      if (((unsigned char *)small_ptrs[i])[j] != i) {
+        fprintf(stderr, "allocation after non-durable syncs not sane:\n");
+        goto test_error;
+      }
+    }
+  }
+
+  if (pma_close(1UL, (HELD_NUM_EVENTS + 2))) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  // Replay the overflow journal of a sync with more dirty pages than fit in the
+  // metadata page, after a crash which lost its page directory updates
+  sprintf(path, "%s/jrnl", argv[1]);
+  if (write_journaled_snapshot(path, journal_ptrs)) {
+    fprintf(stderr, "journaled snapshot not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_load(path)) {
+    fprintf(stderr, "load with journal not sane:\n");
+    goto test_error;
+  }
+
+  for (int i = 0; i < JOURNAL_NUM_ALLOCS; ++i) {
+    for (int j = 0; j < ARENA_PAGE; ++j) {
+      if (journal_ptrs[i][j] != (char)i) {
+        fprintf(stderr, "allocation after journal replay not sane:\n");
+        goto test_error;
+      }
+    }
+  }
+
   if (pma_close(1UL, 2UL)) {
     fprintf(stderr, "sync not sane:\n");
     goto test_error;
   };
 
+  // A corrupted journal fails its checksum, so the load must fail rather than
+  // lose the pages it lists
+  sprintf(path, "%s/jrnl_bad", argv[1]);
+  if (write_journaled_snapshot(path, journal_ptrs)) {
+    fprintf(stderr, "journaled snapshot not sane:\n");
+    goto test_error;
+  }
+
+  sprintf(path, "%s/jrnl_bad/.bin/jrnl.bin", argv[1]);
+  fd = open(path, O_RDWR);
+  if ((fd == -1) || (pread(fd, &byte, 1, 0) != 1)) {
+    fprintf(stderr, "journal corruption not sane:\n");
+    goto test_error;
+  }
+  byte = ~byte;
+  if (pwrite(fd, &byte, 1, 0) != 1) {
+    fprintf(stderr, "journal corruption not sane:\n");
+    goto test_error;
+  }
+  close(fd);
+
+  sprintf(path, "%s/jrnl_bad", argv[1]);
+  if (!pma_load(path) || (errno != EILSEQ)) {
+    fprintf(stderr, "load with corrupted journal not sane:\n");
+    goto test_error;
+  }
+
+  // A shared page emptied by frees is released to the free page cache on the
+  // next sync, as long as its bucket still has another non-full page, and is
+  // then reused as a whole page
+  sprintf(path, "%s/release", argv[1]);
+  if (pma_init(path)) {
+    fprintf(stderr, "init not sane:\n");
+    goto test_error;
+  };
+
+  for (int i = 0; i < RELEASE_NUM_ALLOCS; ++i) {
+    small_ptrs[i] = pma_malloc(64);
+    if (small_ptrs[i] == NULL) {
+      fprintf(stderr, "small malloc not sane:\n");
+      goto test_error;
+    }
+  }
+
+  if (((uint64_t)small_ptrs[RELEASE_NUM_ALLOCS - 1] / ARENA_PAGE) == ((uint64_t)small_ptrs[0] / ARENA_PAGE)) {
+    fprintf(stderr, "small malloc not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_sync(1UL, 1UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  }
+
+  for (int i = 0; i < RELEASE_NUM_ALLOCS; ++i) {
+    if (((uint64_t)small_ptrs[i] / ARENA_PAGE) != ((uint64_t)small_ptrs[0] / ARENA_PAGE)) continue;
+
+    if (pma_free(small_ptrs[i])) {
+      fprintf(stderr, "small free not sane:\n");
+      goto test_error;
+    }
+  }
+
+  if (pma_sync(1UL, 2UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  }
+
+  pma_get_stats(&stats);
+  if ((stats.free_page_runs != 1) || (stats.free_pages != 1) || (stats.partial_pages != 1)) {
+    fprintf(stderr, "shared page release not sane: %lu/%lu/%lu\n",
+        stats.free_page_runs, stats.free_pages, stats.partial_pages);
+    goto test_error;
+  }
+
+  ptr_1 = pma_malloc(ARENA_PAGE);
+  if (((uint64_t)ptr_1 / ARENA_PAGE) != ((uint64_t)small_ptrs[0] / ARENA_PAGE)) {
+    fprintf(stderr, "released shared page reuse not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_close(1UL, 3UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  // Multi-page allocations take the smallest free run which fits, regardless of
+  // address: runs of 6, 5, 9, and 3 pages, kept apart by single pages
+  sprintf(path, "%s/fit", argv[1]);
+  if (pma_init(path)) {
+    fprintf(stderr, "init not sane:\n");
+    goto test_error;
+  };
+
+  ptr_1 = pma_malloc(6 * ARENA_PAGE);
+  ptr_2 = pma_malloc(ARENA_PAGE);
+  ptr_3 = pma_malloc(5 * ARENA_PAGE);
+  ptr_4 = pma_malloc(ARENA_PAGE);
+  ptr_5 = pma_malloc(9 * ARENA_PAGE);
+  ptr_6 = pma_malloc(ARENA_PAGE);
+  ptr_7 = pma_malloc(3 * ARENA_PAGE);
+  ptr_8 = pma_malloc(ARENA_PAGE);
+  if (!ptr_1 || !ptr_2 || !ptr_3 || !ptr_4 || !ptr_5 || !ptr_6 || !ptr_7 || !ptr_8) {
+    fprintf(stderr, "malloc not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_sync(1UL, 1UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_free(ptr_1) || pma_free(ptr_3) || pma_free(ptr_5) || pma_free(ptr_7)) {
+    fprintf(stderr, "free not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_sync(1UL, 2UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  }
+
+  pma_get_stats(&stats);
+  if ((stats.free_page_runs != 4) || (stats.free_pages != 23)) {
+    fprintf(stderr, "free page runs not sane: %lu/%lu\n", stats.free_page_runs, stats.free_pages);
+    goto test_error;
+  }
+
+  // 4 pages fit the 5 page run; the 6 page run comes first, but is larger
+  ptr_9 = pma_malloc(4 * ARENA_PAGE);
+  if (ptr_9 != ptr_3) {
+    fprintf(stderr, "best-fit within bin not sane:\n");
+    goto test_error;
+  }
+
+  // 7 pages only fit the 9 page run
+  ptr_10 = pma_malloc(7 * ARENA_PAGE);
+  if (ptr_10 != ptr_5) {
+    fprintf(stderr, "best-fit across bins not sane:\n");
+    goto test_error;
+  }
+
+  // 6 pages fit the 6 page run exactly
+  ptr_11 = pma_malloc(6 * ARENA_PAGE);
+  if (ptr_11 != ptr_1) {
+    fprintf(stderr, "exact fit not sane:\n");
+    goto test_error;
+  }
+
+  if (pma_close(1UL, 3UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  // Free enough separate pages that the free page cache needs several blocks of
+  // nodes, use them all up again, and free them again, so that the nodes are
+  // returned to their pools and reused. Every other page stays allocated, so
+  // that no two free pages merge into a run.
+  sprintf(path, "%s/pool", argv[1]);
+  if (pma_init(path)) {
+    fprintf(stderr, "init not sane:\n");
+    goto test_error;
+  };
+
+  for (int i = 0; i < (2 * POOL_NUM_RUNS); ++i) {
+    pool_ptrs[i] = (char *)pma_malloc(ARENA_PAGE);
+    if (pool_ptrs[i] == NULL) {
+      fprintf(stderr, "malloc not sane:\n");
+      goto test_error;
+    }
+    pool_ptrs[i][0] = (char)i;
+  }
+
+  if (pma_sync(1UL, 1UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  }
+
+  for (uint64_t event = 2; event < 6; event += 2) {
+    for (int i = 1; i < (2 * POOL_NUM_RUNS); i += 2) {
+      if (pma_free(pool_ptrs[i])) {
+        fprintf(stderr, "free not sane:\n");
+        goto test_error;
+      }
+    }
+
+    if (pma_sync(1UL, event)) {
+      fprintf(stderr, "sync not sane:\n");
+      goto test_error;
+    }
+
+    pma_get_stats(&stats);
+    if ((stats.free_page_runs != POOL_NUM_RUNS) || (stats.free_pages != POOL_NUM_RUNS)) {
+      fprintf(stderr, "free page runs not sane: %lu/%lu\n", stats.free_page_runs, stats.free_pages);
+      goto test_error;
+    }
+
+    // Every freed page is reused before the arena grows
+    for (int i = 1; i < (2 * POOL_NUM_RUNS); i += 2) {
+      pool_ptrs[i] = (char *)pma_malloc(ARENA_PAGE);
+      if ((pool_ptrs[i] == NULL) || (pool_ptrs[i] > (pool_ptrs[(2 * POOL_NUM_RUNS) - 2] + ARENA_PAGE))) {
+        fprintf(stderr, "free page reuse not sane:\n");
+        goto test_error;
+      }
+      pool_ptrs[i][0] = (char)i;
+    }
+
+    pma_get_stats(&stats);
+    if (stats.free_page_runs || stats.free_pages) {
+      fprintf(stderr, "free page runs not sane: %lu/%lu\n", stats.free_page_runs, stats.free_pages);
+      goto test_error;
+    }
+
+    if (pma_sync(1UL, (event + 1))) {
+      fprintf(stderr, "sync not sane:\n");
+      goto test_error;
+    }
+  }
+
+  if (pma_close(1UL, 6UL) || pma_load(path)) {
+    fprintf(stderr, "reload after free page reuse not sane:\n");
+    goto test_error;
+  }
+
+  for (int i = 0; i < (2 * POOL_NUM_RUNS); ++i) {
+    if (pool_ptrs[i][0] != (char)i) {
+      fprintf(stderr, "allocation after free page reuse not sane:\n");
+      goto test_error;
+    }
+  }
+
+  if (pma_close(1UL, 7UL)) {
+    fprintf(stderr, "sync not sane:\n");
+    goto test_error;
+  };
+
+  // Allocate across the end of a small arena reservation: the part inside it
+  // replaces the reservation, and the rest is mapped beyond it. Reloading maps
+  // the same range again.
+  pma_set_arena_reserve(ARENA_RESERVE);
+
+  sprintf(path, "%s/reserve", argv[1]);
+  if (pma_init(path)) {
+    fprintf(stderr, "init not sane:\n");
+    goto test_error;
+  };
+
+  ptr_1 = pma_malloc(4 * ARENA_PAGE);
+  ptr_2 = pma_malloc(6 * ARENA_PAGE);
+  if (
+      (ptr_1 == NULL) ||
+      (ptr_2 == NULL) ||
+      ((char *)ptr_2 >= (char *)(ARENA_ADDR + ARENA_RESERVE)) ||
+      (((char *)ptr_2 + (6 * ARENA_PAGE)) <= (char *)(ARENA_ADDR + ARENA_RESERVE))) {
+    fprintf(stderr, "malloc across arena reservation not sane:\n");
+    goto test_error;
+  }
+
+  memset(ptr_2, 1, (6 * ARENA_PAGE));
+  if (pma_close(1UL, 1UL) || pma_load(path)) {
+    fprintf(stderr, "reload across arena reservation not sane:\n");
+    goto test_error;
+  }
+
+  if ((((char *)ptr_2)[0] != 1) || (((char *)ptr_2)[(6 * ARENA_PAGE) - 1] != 1) || pma_close(1UL, 2UL)) {
+    fprintf(stderr, "allocation across arena reservation not sane:\n");
+    goto test_error;
+  }
+
+  // Block part of the range to reserve, so that only the first half of it is
+  // reserved: nothing else can be mapped there, but it can right after it
+  blocker = mmap(
+      (void *)(ARENA_ADDR + (6 * ARENA_PAGE)),
+      ARENA_PAGE,
+      PROT_NONE,
+      (MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE),
+      -1,
+      0);
+  if (blocker != (void *)(ARENA_ADDR + (6 * ARENA_PAGE))) {
+    fprintf(stderr, "arena blocker not sane:\n");
+    goto test_error;
+  }
+
+  sprintf(path, "%s/halve", argv[1]);
+  if (pma_init(path)) {
+    fprintf(stderr, "init not sane:\n");
+    goto test_error;
+  };
+
+  probe = mmap(
+      (void *)(ARENA_ADDR + (3 * ARENA_PAGE)),
+      ARENA_PAGE,
+      PROT_NONE,
+      (MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE),
+      -1,
+      0);
+  if (probe != MAP_FAILED) {
+    fprintf(stderr, "halved arena reservation not sane:\n");
+    goto test_error;
+  }
+
+  probe = mmap(
+      (void *)(ARENA_ADDR + (4 * ARENA_PAGE)),
+      ARENA_PAGE,
+      PROT_NONE,
+      (MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE),
+      -1,
+      0);
+  if ((probe != (void *)(ARENA_ADDR + (4 * ARENA_PAGE))) || munmap(probe, ARENA_PAGE)) {
+    fprintf(stderr, "halved arena reservation not sane:\n");
+    goto test_error;
+  }
+
+  // Fill the halved reservation, and the pages after it up to the blocker
+  ptr_1 = pma_malloc(2 * ARENA_PAGE);
+  ptr_2 = pma_malloc(3 * ARENA_PAGE);
+  if ((ptr_1 == NULL) || (ptr_2 == NULL) || pma_close(1UL, 1UL) || munmap(blocker, ARENA_PAGE)) {
+    fprintf(stderr, "malloc in halved arena reservation not sane:\n");
+    goto test_error;
+  }
+
   printf("sane\n");
 
   return 0;